@@ -0,0 +1,156 @@
+// Hot path benchmarks on the host, one JSON object per line on stdout. Compared against a baseline of the same
+// format, any stage slower than the tolerance, any stack or binary growth is reported and fails the run.
+//   waterer_bench [--quick] [--size file]... [--baseline bench.json] [--tolerance PCT] > bench.json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "sim.h"
+#include "hal.h"
+#include "benchmark.h"
+
+#define BENCH_MAX_SIZES 8
+#define BENCH_MAX_BASELINE 32
+#define BENCH_DEFAULT_TOLERANCE 10.0
+
+typedef struct {
+    char name[256];         // stage, or the file of a size entry
+    bool is_size;
+    double per_op;
+    unsigned long stack_bytes;
+    unsigned long bytes;
+} baseline_entry_t;
+
+static const uint32_t rounds[BENCH_STAGE_COUNT] = {
+    [BENCH_ADC_READ] = 200,
+    [BENCH_ADC_CALIBRATION] = 200,
+    [BENCH_CONVERSION] = 200,
+    [BENCH_DECISION] = 20000,
+    [BENCH_REPORT] = 20000,
+    [BENCH_LOG_DEFERRED] = 20000,
+    [BENCH_LOG_DRAIN] = 2000,
+    [BENCH_LOG_PRINTF] = 2000,
+};
+
+static baseline_entry_t baseline[BENCH_MAX_BASELINE];
+static int baseline_count;
+static int regressions;
+
+static void setup_pots(void) {
+    static const soil_pot_t pot = { .moisture = 55.0f, .dry_rate = 2.0f, .pump_gain = 0.8f, .soak_tau_s = 600.0f,
+                                    .noise_mv = 12.0f, .spike_rate = 0.01f, .settle_tau_ms = 8.0f, .drain_above = 85.0f };
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        sim_pots[i] = pot;
+    }
+}
+
+static bool load_baseline(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), f) && baseline_count < BENCH_MAX_BASELINE) {
+        baseline_entry_t *e = &baseline[baseline_count];
+        if (sscanf(line, "{\"bench\":\"%255[^\"]\",\"ops\":%*u,\"per_op\":%lf,\"unit\":\"%*[^\"]\",\"stack_bytes\":%lu}",
+                   e->name, &e->per_op, &e->stack_bytes) == 3) {
+            e->is_size = false;
+            baseline_count++;
+        } else if (sscanf(line, "{\"size\":\"%255[^\"]\",\"bytes\":%lu}", e->name, &e->bytes) == 2) {
+            e->is_size = true;
+            baseline_count++;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static const baseline_entry_t *find_baseline(const char *name, bool is_size) {
+    for (int i = 0; i < baseline_count; i++) {
+        if (baseline[i].is_size == is_size && !strcmp(baseline[i].name, name)) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+static void check_stage(const benchmark_result_t *result, double tolerance) {
+    const baseline_entry_t *base = find_baseline(result->name, false);
+    double per_op = result->ops ? (double)result->cycles / result->ops : 0.0;
+    if (!base) {
+        return;
+    }
+    if (per_op > base->per_op * (1.0 + tolerance / 100.0)) {
+        fprintf(stderr, "regression: %s %.1f ns/op, baseline %.1f\n", result->name, per_op, base->per_op);
+        regressions++;
+    }
+    if (result->stack_bytes > base->stack_bytes) {
+        fprintf(stderr, "regression: %s stack %lu bytes, baseline %lu\n", result->name,
+                (unsigned long)result->stack_bytes, base->stack_bytes);
+        regressions++;
+    }
+}
+
+static void check_size(const char *path, unsigned long bytes) {
+    const baseline_entry_t *base = find_baseline(path, true);
+    if (base && bytes > base->bytes) {
+        fprintf(stderr, "regression: %s %lu bytes, baseline %lu\n", path, bytes, base->bytes);
+        regressions++;
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--quick] [--size file]... [--baseline bench.json] [--tolerance PCT]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *sizes[BENCH_MAX_SIZES];
+    int size_count = 0;
+    const char *baseline_path = NULL;
+    double tolerance = BENCH_DEFAULT_TOLERANCE;
+    uint32_t divider = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick")) {
+            divider = 10;
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc && size_count < BENCH_MAX_SIZES) {
+            sizes[size_count++] = argv[++i];
+        } else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (baseline_path && !load_baseline(baseline_path)) {
+        return 1;
+    }
+
+    setup_pots();
+    init_driver_immediate();
+    benchmark_init();
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        benchmark_result_t result;
+        uint32_t n = rounds[stage] / divider ? rounds[stage] / divider : 1;
+        if (benchmark_run(stage, n, &result) != ESP_OK) {
+            fprintf(stderr, "Stage %d failed to run\n", stage);
+            return 1;
+        }
+        benchmark_print_json(&result, "ns");
+        check_stage(&result, tolerance);
+    }
+    for (int i = 0; i < size_count; i++) {
+        struct stat st;
+        if (stat(sizes[i], &st)) {
+            perror(sizes[i]);
+            return 1;
+        }
+        printf("{\"size\":\"%s\",\"bytes\":%lu}\n", sizes[i], (unsigned long)st.st_size);
+        check_size(sizes[i], st.st_size);
+    }
+    return regressions ? 2 : 0;
+}
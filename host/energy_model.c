@@ -0,0 +1,21 @@
+#include "energy_model.h"
+
+#define MS_PER_DAY (24.0 * 3600.0 * 1000.0)
+
+void energy_estimate_per_day(const sim_stats_t *stats, int days, int poll_interval_ms, energy_budget_t *out) {
+    double awake_ms = stats->awake_ms / days + stats->wakeups / (double)days * ENERGY_CYCLE_CPU_MS;
+    double report_ms = stats->reports / (double)days * ENERGY_REPORT_MS;
+
+    out->sensor_mah = ENERGY_SENSOR_MA * stats->sensor_on_ms / days / 3.6e6;
+    if (poll_interval_ms > 0) {
+        double poll_ms = MS_PER_DAY / poll_interval_ms * ENERGY_POLL_MS;
+        out->radio_mah = (ENERGY_RX_MA * poll_ms + ENERGY_TX_MA * report_ms) / 3.6e6;
+        out->cpu_mah = ENERGY_ACTIVE_MA * (awake_ms + poll_ms + report_ms) / 3.6e6;
+        out->sleep_mah = ENERGY_LIGHT_SLEEP_MA * (MS_PER_DAY - awake_ms - poll_ms - report_ms) / 3.6e6;
+    } else {
+        out->radio_mah = (ENERGY_RX_MA * (MS_PER_DAY - report_ms) + ENERGY_TX_MA * report_ms) / 3.6e6;
+        out->cpu_mah = ENERGY_ACTIVE_MA * MS_PER_DAY / 3.6e6;
+        out->sleep_mah = 0.0;
+    }
+    out->total_mah = out->sleep_mah + out->cpu_mah + out->radio_mah + out->sensor_mah;
+}
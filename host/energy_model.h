@@ -0,0 +1,28 @@
+#pragma once
+
+// Rough ESP32-H2 energy budget built from simulator counters. Currents are datasheet-order assumptions,
+// not measurements; they are meant for comparing firmware configurations against each other.
+
+#include "sim.h"
+
+#define ENERGY_SUPPLY_V             3.3
+#define ENERGY_LIGHT_SLEEP_MA       0.085   // light sleep, CPU powered down, RTC timer running
+#define ENERGY_ACTIVE_MA            9.0     // CPU running at 96 MHz
+#define ENERGY_RX_MA                12.0    // receiver on
+#define ENERGY_TX_MA                15.0    // transmit at 0 dBm
+#define ENERGY_SENSOR_MA            5.0     // capacitive probes while powered
+#define ENERGY_POLL_MS              4.0     // data request + ack + receive window per parent poll
+#define ENERGY_REPORT_MS            6.0     // one attribute report frame with MAC retries amortised
+#define ENERGY_CYCLE_CPU_MS         2.0     // decision logic and reporting per measurement cycle
+#define ENERGY_BATTERY_MAH          2000.0
+
+typedef struct {
+    double sleep_mah;
+    double cpu_mah;
+    double radio_mah;
+    double sensor_mah;
+    double total_mah;
+} energy_budget_t;
+
+// poll_interval_ms == 0 models an always-on receiver (no light sleep)
+void energy_estimate_per_day(const sim_stats_t *stats, int days, int poll_interval_ms, energy_budget_t *out);
@@ -0,0 +1,504 @@
+#include "hal.h"
+#include "sim.h"
+#include "zones.h"
+#include "flow.h"
+#include "esp_log.h"
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ADC_FULL_SCALE_MV 3300
+#define ADC_MAX_RAW 4095
+#define SIM_EVENT_QUEUE_LENGTH 8
+#define SIM_MAX_TIMERS 4
+#define SIM_HISTORY_SIZE (64 * 1024)    // matches the "history" partition
+#define SIM_FLASH_SECTOR 4096
+
+soil_pot_t sim_pots[SENSOR_COUNT];
+sim_stats_t sim_stats;
+float sim_target_humidity = DEFAULT_MIN_HUMIDITY;
+float sim_pump_flow_ml_s = SIM_PUMP_FLOW_ML_S;
+double sim_reservoir_ml = -1.0;
+sim_fault_t sim_fault = SIM_FAULT_NONE;
+int64_t sim_fault_from_us;
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+static int64_t now_us;
+static uint32_t gpio_levels;
+static int64_t pump_started_us[GPIO_NUM_MAX] = { [0 ... GPIO_NUM_MAX - 1] = -1 };
+static int64_t sensor_powered_us = -1;
+static int64_t awake_since_us = -1;
+static int awake_holds;
+static bool pulse_ready;
+static bool pulse_counting;
+static uint32_t pulse_count;
+static double pulse_fraction;
+static int stuck_mv = -1;
+static int adc_channel_count;
+static hal_event_t event_queue[SIM_EVENT_QUEUE_LENGTH];
+static int queue_head;
+static int queue_len;
+static int64_t timer_deadline_us[SIM_MAX_TIMERS];
+static hal_event_t timer_events[SIM_MAX_TIMERS];
+static uint32_t stream_freq_hz;
+static int stream_next_index;
+static uint8_t history_flash[SIM_HISTORY_SIZE];
+static bool history_flash_ready;
+
+static bool relay_on(gpio_num_t pin) {
+    return !(gpio_levels & (1u << pin));    // relays are active low
+}
+
+static bool is_relay(gpio_num_t pin) {
+    for (int z = 0; z < zones_count(); z++) {
+        if (zones_get(z)->relay_pin == pin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool reservoir_empty(void) {
+    return sim_reservoir_ml >= 0.0 && sim_reservoir_ml < 1e-3;
+}
+
+// A pot gets water while the relay of its sensor's zone is on and the reservoir holds any
+static bool pot_watered(int pot) {
+    int zone = zones_of_sensor(pot);
+    return zone >= 0 && relay_on(zones_get(zone)->relay_pin) && !reservoir_empty();
+}
+
+// Every running pump moves sim_pump_flow_ml_s through the one meter until the reservoir is empty
+static void pumps_flow(float dt_s) {
+    int running = 0;
+    for (int z = 0; z < zones_count(); z++) {
+        running += relay_on(zones_get(z)->relay_pin);
+    }
+    if (!running) {
+        return;
+    }
+    if (reservoir_empty()) {
+        sim_stats.dry_pump_seconds += dt_s;
+        return;
+    }
+    double ml = running * sim_pump_flow_ml_s * dt_s;
+    if (sim_reservoir_ml >= 0.0 && ml > sim_reservoir_ml) {
+        ml = sim_reservoir_ml;
+    }
+    if (sim_reservoir_ml >= 0.0) {
+        sim_reservoir_ml -= ml;
+    }
+    sim_stats.flow_ml += ml;
+    pulse_fraction += ml * FLOW_PULSES_PER_LITRE / 1000.0;
+    uint32_t pulses = (uint32_t)pulse_fraction;
+    pulse_fraction -= pulses;
+    sim_pulse_inject(pulses);
+}
+
+void host_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+    static const char letters[] = "NEWIDV";
+    va_list args;
+    printf("%c (%.3f) %s: ", letters[level], now_us / 1e6, tag);
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+}
+
+double sim_now_s(void) {
+    return now_us / 1e6;
+}
+
+void sim_advance_us(int64_t us) {
+    int64_t end_us = now_us + us;
+    while (now_us < end_us) {
+        bool pump = false;
+        bool settling = false;
+        for (int i = 0; i < SENSOR_COUNT; i++) {
+            pump |= pot_watered(i);
+            settling |= sim_pots[i].pending > 0.01f;
+        }
+        int64_t step_us = (pump || settling) ? 1000000 : 60000000;
+        if (step_us > end_us - now_us) {
+            step_us = end_us - now_us;
+        }
+        float dt_s = step_us / 1e6f;
+        pumps_flow(dt_s);
+        for (int i = 0; i < SENSOR_COUNT; i++) {
+            soil_step(&sim_pots[i], now_us / 1e6, dt_s, pot_watered(i));
+            float moisture = sim_pots[i].moisture;
+            if (moisture < sim_target_humidity - SIM_EXCURSION_MARGIN) { sim_stats.minutes_below[i] += dt_s / 60.0; }
+            if (moisture > SIM_FLOOD_HUMIDITY) { sim_stats.minutes_flooded[i] += dt_s / 60.0; }
+            if (moisture < sim_stats.lowest[i]) { sim_stats.lowest[i] = moisture; }
+            sim_stats.moisture_minutes[i] += moisture * dt_s / 60.0;
+        }
+        now_us += step_us;
+    }
+}
+
+esp_err_t hal_gpio_init_outputs(uint64_t pin_mask) {
+    return ESP_OK;
+}
+
+esp_err_t hal_gpio_set_level(gpio_num_t pin, uint32_t level) {
+    bool was_pumping = relay_on(pin);
+    if (level) {
+        gpio_levels |= 1u << pin;
+    } else {
+        gpio_levels &= ~(1u << pin);
+    }
+
+    if (is_relay(pin)) {
+        if (!was_pumping && relay_on(pin)) {
+            sim_stats.pump_cycles++;
+            bool any_dry = false;
+            int running = 0;
+            for (int z = 0; z < zones_count(); z++) {
+                running += relay_on(zones_get(z)->relay_pin);
+                if (zones_get(z)->relay_pin != pin) {
+                    continue;
+                }
+                for (int i = 0; i < SENSOR_COUNT; i++) {
+                    if (zones_get(z)->sensor_mask & (1u << i)) {
+                        any_dry |= sim_pots[i].moisture < sim_target_humidity + SIM_FALSE_TRIGGER_MARGIN;
+                    }
+                }
+            }
+            if (!any_dry) {
+                sim_stats.false_triggers++;
+            }
+            if (running > sim_stats.max_pumps) {
+                sim_stats.max_pumps = running;
+            }
+            pump_started_us[pin] = now_us;
+        } else if (was_pumping && !relay_on(pin) && pump_started_us[pin] >= 0) {
+            sim_stats.pump_seconds += (now_us - pump_started_us[pin]) / 1e6;
+            pump_started_us[pin] = -1;
+        }
+    } else if (pin == SENSOR_POWER_PIN) {
+        if (level && sensor_powered_us < 0) {
+            sensor_powered_us = now_us;
+            sim_stats.wakeups++;
+        } else if (!level && sensor_powered_us >= 0) {
+            sim_stats.sensor_on_ms += (now_us - sensor_powered_us) / 1e3;
+            sensor_powered_us = -1;
+        }
+    }
+    return ESP_OK;
+}
+
+void sim_pulse_inject(uint32_t pulses) {
+    if (pulse_counting) {
+        pulse_count += pulses;
+    }
+}
+
+esp_err_t hal_pulse_init(gpio_num_t pin, uint32_t glitch_ns) {
+    pulse_ready = true;
+    return ESP_OK;
+}
+
+// Like the PCNT unit with power management, counting keeps the chip awake
+esp_err_t hal_pulse_start(void) {
+    if (!pulse_ready || pulse_counting) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    pulse_counting = true;
+    hal_stay_awake(true);
+    return ESP_OK;
+}
+
+esp_err_t hal_pulse_stop(void) {
+    if (!pulse_counting) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    pulse_counting = false;
+    hal_stay_awake(false);
+    return ESP_OK;
+}
+
+uint32_t hal_pulse_count(void) {
+    return pulse_count;
+}
+
+static int probe_fault(int mv) {
+    if (sim_fault == SIM_FAULT_NONE || now_us < sim_fault_from_us) {
+        return mv;
+    }
+    switch (sim_fault) {
+    case SIM_FAULT_OPEN:
+        return (int)fabsf(soil_gaussian() * 5.0f);
+    case SIM_FAULT_SATURATED:
+        return ADC_FULL_SCALE_MV;
+    case SIM_FAULT_STUCK:
+        if (stuck_mv < 0) {
+            stuck_mv = soil_probe_mv(&sim_pots[0], 1000.0f);    // frozen at a settled reading
+        }
+        return stuck_mv;
+    case SIM_FAULT_NOISY:
+        return mv + (int)(soil_gaussian() * SIM_FAULT_NOISE_MV);
+    case SIM_FAULT_DRIFT:
+        return mv + (int)(SIM_FAULT_DRIFT_MV * (now_us - sim_fault_from_us) / 86400e6);
+    default:
+        return mv;
+    }
+}
+
+bool hal_adc_init(const int *channels, int count) {
+    adc_channel_count = count < SENSOR_COUNT ? count : SENSOR_COUNT;
+    return true;
+}
+
+esp_err_t hal_adc_stream_start(uint32_t freq_hz) {
+    if (stream_freq_hz) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    stream_freq_hz = freq_hz;
+    stream_next_index = 0;
+    return ESP_OK;
+}
+
+esp_err_t hal_adc_stream_read(hal_adc_sample_t *samples, int max, int *count) {
+    if (!stream_freq_hz) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (int i = 0; i < max; i++) {
+        sim_advance_us(1000000 / stream_freq_hz);
+        int index = stream_next_index;
+        stream_next_index = (stream_next_index + 1) % adc_channel_count;
+        int mv = soil_probe_mv(&sim_pots[index], sensor_powered_us < 0 ? 0.0f : (now_us - sensor_powered_us) / 1e3f);
+        if (index == 0) {
+            mv = probe_fault(mv);
+        }
+        if (mv < 0) { mv = 0; }
+        if (mv > ADC_FULL_SCALE_MV) { mv = ADC_FULL_SCALE_MV; }
+        samples[i].index = index;
+        samples[i].raw = mv * ADC_MAX_RAW / ADC_FULL_SCALE_MV;
+    }
+    *count = max;
+    sim_stats.adc_reads += max;
+    return ESP_OK;
+}
+
+esp_err_t hal_adc_stream_stop(void) {
+    stream_freq_hz = 0;
+    return ESP_OK;
+}
+
+esp_err_t hal_adc_raw_to_mv(int index, int raw, int *mv) {
+    *mv = raw * ADC_FULL_SCALE_MV / ADC_MAX_RAW;
+    return ESP_OK;
+}
+
+// NOR flash semantics: erase sets whole sectors to 0xFF, writes can only clear bits
+static void history_flash_prepare(void) {
+    if (!history_flash_ready) {
+        memset(history_flash, 0xFF, sizeof(history_flash));
+        history_flash_ready = true;
+    }
+}
+
+uint32_t hal_history_size(void) {
+    return SIM_HISTORY_SIZE;
+}
+
+esp_err_t hal_history_read(uint32_t offset, void *buf, size_t len) {
+    if (offset + len > SIM_HISTORY_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    history_flash_prepare();
+    memcpy(buf, &history_flash[offset], len);
+    sim_stats.flash_bytes_read += len;
+    return ESP_OK;
+}
+
+esp_err_t hal_history_write(uint32_t offset, const void *buf, size_t len) {
+    if (offset + len > SIM_HISTORY_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    history_flash_prepare();
+    const uint8_t *data = buf;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] & ~history_flash[offset + i]) {
+            ESP_LOGE("HAL_SIM", "Write to unerased flash at 0x%lx", (unsigned long)(offset + i));
+            return ESP_FAIL;
+        }
+        history_flash[offset + i] &= data[i];
+    }
+    sim_stats.flash_writes++;
+    sim_stats.flash_bytes_written += len;
+    return ESP_OK;
+}
+
+esp_err_t hal_history_erase(uint32_t offset, size_t len) {
+    if (offset % SIM_FLASH_SECTOR || len % SIM_FLASH_SECTOR || offset + len > SIM_HISTORY_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    history_flash_prepare();
+    memset(&history_flash[offset], 0xFF, len);
+    sim_stats.flash_erases += len / SIM_FLASH_SECTOR;
+    return ESP_OK;
+}
+
+int64_t hal_time_us(void) {
+    return now_us;
+}
+
+uint32_t hal_cycle_count(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+esp_err_t hal_events_init(int timer_count) {
+    if (timer_count > SIM_MAX_TIMERS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < SIM_MAX_TIMERS; i++) {
+        timer_deadline_us[i] = -1;
+    }
+    return ESP_OK;
+}
+
+esp_err_t hal_event_post(const hal_event_t *event, bool urgent) {
+    if (queue_len == SIM_EVENT_QUEUE_LENGTH) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (urgent) {
+        queue_head = (queue_head + SIM_EVENT_QUEUE_LENGTH - 1) % SIM_EVENT_QUEUE_LENGTH;
+        event_queue[queue_head] = *event;
+    } else {
+        event_queue[(queue_head + queue_len) % SIM_EVENT_QUEUE_LENGTH] = *event;
+    }
+    queue_len++;
+    return ESP_OK;
+}
+
+bool hal_event_wait(hal_event_t *event) {
+    if (!queue_len) {
+        return false;
+    }
+    *event = event_queue[queue_head];
+    queue_head = (queue_head + 1) % SIM_EVENT_QUEUE_LENGTH;
+    queue_len--;
+    return true;
+}
+
+esp_err_t hal_timer_schedule(int timer, uint32_t delay_ms, const hal_event_t *event) {
+    timer_deadline_us[timer] = now_us + (int64_t)delay_ms * 1000;
+    timer_events[timer] = *event;
+    return ESP_OK;
+}
+
+void hal_timer_cancel(int timer) {
+    timer_deadline_us[timer] = -1;
+}
+
+bool sim_next_event(hal_event_t *event, int64_t until_us) {
+    if (hal_event_wait(event)) {
+        return true;
+    }
+    int next = -1;
+    for (int i = 0; i < SIM_MAX_TIMERS; i++) {
+        if (timer_deadline_us[i] >= 0 && (next < 0 || timer_deadline_us[i] < timer_deadline_us[next])) {
+            next = i;
+        }
+    }
+    if (next < 0 || timer_deadline_us[next] > until_us) {
+        if (until_us > now_us) {
+            sim_advance_us(until_us - now_us);
+        }
+        return false;
+    }
+    if (timer_deadline_us[next] > now_us) {
+        sim_advance_us(timer_deadline_us[next] - now_us);
+    }
+    timer_deadline_us[next] = -1;
+    *event = timer_events[next];
+    return true;
+}
+
+// Holds nest, like the power management locks behind it on the device
+void hal_stay_awake(bool on) {
+    if (on && awake_holds++ == 0) {
+        awake_since_us = now_us;
+    } else if (!on && awake_holds > 0 && --awake_holds == 0) {
+        sim_stats.awake_ms += (now_us - awake_since_us) / 1e3;
+        awake_since_us = -1;
+    }
+}
+
+esp_err_t hal_task_create(hal_task_fn_t fn, const char *name, uint32_t stack_size, int priority) {
+    // The simulator owns the loop, it feeds events to driver_handle_event() itself
+    return ESP_OK;
+}
+
+#define SIM_STACK_PAINT 0xA5
+
+typedef struct {
+    hal_task_fn_t fn;
+    void *arg;
+} stack_run_t;
+
+static void *stack_run_thread(void *arg) {
+    stack_run_t *run = arg;
+    run->fn(run->arg);
+    return NULL;
+}
+
+static esp_err_t stack_run(hal_task_fn_t fn, void *arg, uint32_t stack_size, uint32_t *stack_used) {
+    if (stack_size < PTHREAD_STACK_MIN) {
+        stack_size = PTHREAD_STACK_MIN;
+    }
+    uint8_t *stack = malloc(stack_size);
+    if (!stack) {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(stack, SIM_STACK_PAINT, stack_size);
+    stack_run_t run = { .fn = fn, .arg = arg };
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack, stack_size);
+    int rc = pthread_create(&thread, &attr, stack_run_thread, &run);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        free(stack);
+        return ESP_FAIL;
+    }
+    pthread_join(thread, NULL);
+    uint32_t untouched = 0;
+    while (untouched < stack_size && stack[untouched] == SIM_STACK_PAINT) {
+        untouched++;
+    }
+    *stack_used = stack_size - untouched;
+    free(stack);
+    return ESP_OK;
+}
+
+static void stack_run_nothing(void *arg) {
+}
+
+// The stack is painted before the run, whatever is still intact at its far (low) end was never touched. The
+// thread descriptor and TLS that glibc keeps at the top of the stack are measured once and taken off.
+esp_err_t hal_run_on_stack(hal_task_fn_t fn, void *arg, uint32_t stack_size, uint32_t *stack_used) {
+    static uint32_t overhead;
+    static bool overhead_known;
+    if (!overhead_known) {
+        esp_err_t ret = stack_run(stack_run_nothing, NULL, PTHREAD_STACK_MIN, &overhead);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        overhead_known = true;
+    }
+    esp_err_t ret = stack_run(fn, arg, stack_size + overhead, stack_used);
+    if (ret == ESP_OK) {
+        *stack_used = *stack_used > overhead ? *stack_used - overhead : 0;
+    }
+    return ret;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// Host build stand-in for soc/adc_channel.h (ESP32-H2 ADC1 pin mapping)
+
+#define ADC1_GPIO1_CHANNEL     0
+#define ADC1_GPIO2_CHANNEL     1
+#define ADC1_GPIO3_CHANNEL     2
+#define ADC1_GPIO4_CHANNEL     3
+#define ADC1_GPIO5_CHANNEL     4
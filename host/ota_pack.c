@@ -0,0 +1,298 @@
+// Builds a Zigbee OTA file from a firmware binary, heatshrink-compressed by default, checks that the firmware's own
+// decoder (main/ota_image.c) gets the binary back out and compares transfer cost against the uncompressed file.
+//   ota_pack [--plain] [--version V] [--block N] [--hops N] [--hop-ms MS] build/esp_zb_waterer.bin waterer.ota
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ota_image.h"
+#include "esp_log.h"
+
+#define OTA_FILE_MAGIC              0x0BEEF11E
+#define OTA_FILE_HEADER_VERSION     0x0100
+#define OTA_FILE_HEADER_SIZE        56
+#define OTA_STACK_VERSION_PRO       0x0002
+
+// Frame sizes for the airtime estimate: PHY 6 + MAC 11 + NWK 8 + NWK security 18 + APS 8 + ZCL 3 bytes around
+// every command, image block request and response carry 14 bytes of fields, every frame is acknowledged per hop
+#define FRAME_OVERHEAD              54
+#define BLOCK_FIELDS                14
+#define MAC_ACK                     11
+#define RADIO_BPS                   250000
+
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+void host_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+    va_list args;
+    fprintf(stderr, "%s: ", tag);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+typedef struct {
+    buffer_t *out;
+    uint32_t acc;
+    int bits;
+} bit_writer_t;
+
+static void put(buffer_t *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void put_u16(buffer_t *b, uint16_t v) {
+    uint8_t p[2] = { v, v >> 8 };
+    put(b, p, 2);
+}
+
+static void put_u32(buffer_t *b, uint32_t v) {
+    uint8_t p[4] = { v, v >> 8, v >> 16, v >> 24 };
+    put(b, p, 4);
+}
+
+static void set_u32(buffer_t *b, size_t at, uint32_t v) {
+    b->data[at] = v; b->data[at + 1] = v >> 8; b->data[at + 2] = v >> 16; b->data[at + 3] = v >> 24;
+}
+
+static void push_bits(bit_writer_t *w, uint32_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        w->acc = w->acc << 1 | ((value >> i) & 1);
+        if (++w->bits == 8) {
+            uint8_t byte = w->acc;
+            put(w->out, &byte, 1);
+            w->acc = 0;
+            w->bits = 0;
+        }
+    }
+}
+
+// Greedy LZSS in the heatshrink bit format: 1 + 8 bit literals, 0 + (index - 1) + (count - 1) back-references.
+// Candidates come from hash chains over two-byte prefixes.
+static void compress(const uint8_t *in, size_t len, int window_bits, int lookahead_bits, buffer_t *out) {
+    size_t window = (size_t)1 << window_bits;
+    size_t max_count = (size_t)1 << lookahead_bits;
+    // a back-reference costs 1 + window + lookahead bits, literals 9 bits each
+    size_t min_count = (1 + window_bits + lookahead_bits) / 9 + 1;
+    int32_t *head = malloc(65536 * sizeof(int32_t));
+    int32_t *prev = malloc(len * sizeof(int32_t));
+    bit_writer_t w = { .out = out };
+    for (int i = 0; i < 65536; i++) {
+        head[i] = -1;
+    }
+
+    size_t pos = 0;
+    size_t hashed = 0;
+    while (pos < len) {
+        size_t best_count = 0;
+        size_t best_index = 0;
+        if (pos + 1 < len) {
+            uint16_t h = in[pos] << 8 | in[pos + 1];
+            for (int32_t cand = head[h]; cand >= 0 && pos - cand <= window; cand = prev[cand]) {
+                size_t n = 0;
+                while (n < max_count && pos + n < len && in[cand + n] == in[pos + n]) {
+                    n++;
+                }
+                if (n > best_count) {
+                    best_count = n;
+                    best_index = pos - cand;
+                    if (n == max_count) {
+                        break;
+                    }
+                }
+            }
+        }
+        size_t step = 1;
+        if (best_count >= min_count) {
+            push_bits(&w, 0, 1);
+            push_bits(&w, best_index - 1, window_bits);
+            push_bits(&w, best_count - 1, lookahead_bits);
+            step = best_count;
+        } else {
+            push_bits(&w, 1, 1);
+            push_bits(&w, in[pos], 8);
+        }
+        pos += step;
+        for (; hashed < pos && hashed + 1 < len; hashed++) {
+            uint16_t h = in[hashed] << 8 | in[hashed + 1];
+            prev[hashed] = head[h];
+            head[h] = hashed;
+        }
+    }
+    if (w.bits) {
+        push_bits(&w, 0, 8 - w.bits);
+    }
+    free(head);
+    free(prev);
+}
+
+static void build_ota_file(const uint8_t *image, size_t len, bool compressed, uint32_t version, buffer_t *file) {
+    put_u32(file, OTA_FILE_MAGIC);
+    put_u16(file, OTA_FILE_HEADER_VERSION);
+    put_u16(file, OTA_FILE_HEADER_SIZE);
+    put_u16(file, 0);
+    put_u16(file, OTA_UPGRADE_MANUFACTURER);
+    put_u16(file, OTA_UPGRADE_IMAGE_TYPE);
+    put_u32(file, version);
+    put_u16(file, OTA_STACK_VERSION_PRO);
+    char header_string[32] = {0};
+    snprintf(header_string, sizeof(header_string), "waterer %s", compressed ? "heatshrink" : "plain");
+    put(file, header_string, sizeof(header_string));
+    size_t total_at = file->len;
+    put_u32(file, 0);
+
+    if (compressed) {
+        buffer_t stream = {0};
+        compress(image, len, OTA_WINDOW_BITS, OTA_LOOKAHEAD_BITS, &stream);
+        put_u16(file, OTA_TAG_COMPRESSED_IMAGE);
+        put_u32(file, OTA_COMPRESSED_HEADER_SIZE + stream.len);
+        uint8_t params[2] = { OTA_WINDOW_BITS, OTA_LOOKAHEAD_BITS };
+        put(file, params, 2);
+        put_u32(file, len);
+        put(file, stream.data, stream.len);
+        free(stream.data);
+    } else {
+        put_u16(file, OTA_TAG_UPGRADE_IMAGE);
+        put_u32(file, len);
+        put(file, image, len);
+    }
+    set_u32(file, total_at, file->len);
+}
+
+typedef struct {
+    const uint8_t *expected;
+    size_t len;
+    size_t at;
+    bool mismatch;
+} verify_t;
+
+static esp_err_t verify_sink(const void *data, size_t len, void *ctx) {
+    verify_t *v = ctx;
+    if (v->at + len > v->len || memcmp(v->expected + v->at, data, len)) {
+        v->mismatch = true;
+        return ESP_FAIL;
+    }
+    v->at += len;
+    return ESP_OK;
+}
+
+// Feeds the payload block by block as the OTA client would, returns the decode time in ms or a negative value
+static double verify(const buffer_t *file, const uint8_t *image, size_t len, int block) {
+    verify_t v = { .expected = image, .len = len };
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ota_image_begin(file->len - OTA_FILE_HEADER_SIZE, verify_sink, &v);
+    esp_err_t ret = ESP_OK;
+    for (size_t at = OTA_FILE_HEADER_SIZE; at < file->len && ret == ESP_OK; at += block) {
+        size_t n = file->len - at < (size_t)block ? file->len - at : (size_t)block;
+        ret = ota_image_feed(file->data + at, n);
+    }
+    if (ret == ESP_OK) {
+        ret = ota_image_finish();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (ret != ESP_OK || v.mismatch || v.at != len) {
+        return -1;
+    }
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+static void print_transfer(const char *name, size_t file_len, int block, int hops, double hop_ms) {
+    size_t blocks = (file_len + block - 1) / block;
+    double frame_bytes = (FRAME_OVERHEAD + BLOCK_FIELDS) + (FRAME_OVERHEAD + BLOCK_FIELDS) + 2 * MAC_ACK;
+    double airtime_s = hops * (blocks * frame_bytes + file_len) * 8.0 / RADIO_BPS;
+    double duration_s = airtime_s + blocks * 2.0 * hops * hop_ms / 1e3;
+    printf("%-12s %8zu bytes, %6zu blocks of %d B, airtime %6.1f s, transfer %6.1f min (%d hops)\n",
+           name, file_len, blocks, block, airtime_s, duration_s / 60.0, hops);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--plain] [--version V] [--block N] [--hops N] [--hop-ms MS] firmware.bin out.ota\n", name);
+}
+
+int main(int argc, char **argv) {
+    bool plain = false;
+    uint32_t version = OTA_UPGRADE_FILE_VERSION;
+    int block = OTA_UPGRADE_MAX_DATA_SIZE;
+    int hops = 2;
+    double hop_ms = 10.0;   // CSMA backoff, forwarding and processing per frame and hop
+    const char *paths[2];
+    int path_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--plain")) {
+            plain = true;
+        } else if (!strcmp(argv[i], "--version") && i + 1 < argc) {
+            version = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--block") && i + 1 < argc) {
+            block = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--hops") && i + 1 < argc) {
+            hops = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--hop-ms") && i + 1 < argc) {
+            hop_ms = atof(argv[++i]);
+        } else if (argv[i][0] != '-' && path_count < 2) {
+            paths[path_count++] = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (path_count != 2 || block < 1 || hops < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(paths[0], "rb");
+    if (!f) {
+        perror(paths[0]);
+        return 1;
+    }
+    buffer_t image = {0};
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        put(&image, chunk, n);
+    }
+    fclose(f);
+
+    buffer_t files[2] = {{0}};
+    build_ota_file(image.data, image.len, false, version, &files[0]);
+    build_ota_file(image.data, image.len, true, version, &files[1]);
+
+    for (int i = 0; i < 2; i++) {
+        double decode_ms = verify(&files[i], image.data, image.len, block);
+        if (decode_ms < 0) {
+            fprintf(stderr, "%s image does not decode back to the input\n", i ? "Compressed" : "Plain");
+            return 1;
+        }
+        if (i) {
+            printf("compression: %.1f%% of the image, decoded in %.1f ms (%.1f MB/s on this host)\n",
+                   100.0 * files[1].len / files[0].len, decode_ms, decode_ms > 0 ? image.len / decode_ms / 1e3 : 0.0);
+        }
+    }
+    print_transfer("plain:", files[0].len, block, hops, hop_ms);
+    print_transfer("compressed:", files[1].len, block, hops, hop_ms);
+
+    const buffer_t *out = &files[plain ? 0 : 1];
+    f = fopen(paths[1], "wb");
+    if (!f || fwrite(out->data, 1, out->len, f) != out->len) {
+        perror(paths[1]);
+        return 1;
+    }
+    fclose(f);
+    printf("wrote %s (%s, version 0x%08lx)\n", paths[1], plain ? "plain" : "compressed", (unsigned long)version);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+// Shared state between the simulated HAL and the simulator driver loop
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "soil_model.h"
+#include "driver.h"
+
+#define SIM_FLOOD_HUMIDITY 85.0f
+#define SIM_FALSE_TRIGGER_MARGIN 3.0f
+#define SIM_EXCURSION_MARGIN 2.0f
+#define SIM_PUMP_FLOW_ML_S 25.0f    // small 5 V submersible pump, 1.5 l/min
+#define SIM_FAULT_NOISE_MV 400.0f   // sigma of a loose contact
+#define SIM_FAULT_DRIFT_MV 100.0f   // per day, a corroding probe
+
+// Probe faults --fault injects into sensor 0
+typedef enum {
+    SIM_FAULT_NONE,
+    SIM_FAULT_OPEN,
+    SIM_FAULT_SATURATED,
+    SIM_FAULT_STUCK,
+    SIM_FAULT_NOISY,
+    SIM_FAULT_DRIFT,
+} sim_fault_t;
+
+typedef struct {
+    uint64_t pump_cycles;
+    uint64_t false_triggers;                // pump started although every pot of its zone was clearly above target
+    uint32_t max_pumps;                     // relays on at the same time
+    double pump_seconds;                    // summed over all relays
+    double sensor_on_ms;
+    double awake_ms;                        // light sleep held off through hal_stay_awake()
+    uint64_t adc_reads;
+    uint64_t wakeups;
+    uint64_t reports;
+    uint64_t flash_writes;                  // history partition
+    uint64_t flash_bytes_written;
+    uint64_t flash_bytes_read;
+    uint64_t flash_erases;
+    double flow_ml;                         // water that went through the meter
+    double dry_pump_seconds;                // pumps on with the reservoir empty
+    double minutes_below[SENSOR_COUNT];     // moisture more than SIM_EXCURSION_MARGIN under the target
+    double minutes_flooded[SENSOR_COUNT];   // moisture over SIM_FLOOD_HUMIDITY
+    double moisture_minutes[SENSOR_COUNT];  // integral, for the mean
+    float lowest[SENSOR_COUNT];
+} sim_stats_t;
+
+extern soil_pot_t sim_pots[SENSOR_COUNT];
+extern sim_stats_t sim_stats;
+extern float sim_target_humidity;
+extern float sim_pump_flow_ml_s;            // per running pump
+extern double sim_reservoir_ml;             // negative: never runs out
+extern sim_fault_t sim_fault;
+extern int64_t sim_fault_from_us;
+
+// Moves the virtual clock forward, integrating the pots with the current relay state
+void sim_advance_us(int64_t us);
+double sim_now_s(void);
+// Flow meter stand-in: edges on the pulse input, counted while hal_pulse_start is in effect. The pumps feed it
+// according to sim_pump_flow_ml_s and the reservoir, tests can add their own pulse trains.
+void sim_pulse_inject(uint32_t pulses);
+// Returns the next queued or timer event, advancing the clock to the timer if needed.
+// Returns false once nothing is due before until_us; the clock is then at until_us.
+bool sim_next_event(hal_event_t *event, int64_t until_us);
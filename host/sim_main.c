@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sim.h"
+#include "hal.h"
+#include "esp_log.h"
+#include "energy_model.h"
+#include "reporting.h"
+#include "sample_queue.h"
+#include "history.h"
+#include "schedule.h"
+#include "dosing.h"
+#include "flow.h"
+#include "health.h"
+#include "conversion.h"
+#include "zones.h"
+#include "metrics.h"
+#include "dlog.h"
+#include "task_config.h"
+
+#define SIM_DEFAULT_INTERVAL_S (20 * 60) // MEASUREMENT_INTERVAL_S of the firmware
+#define SIM_DEFAULT_DAYS 365
+#define SIM_DEFAULT_POLL_MS 0            // always-on like the default firmware, 7500 for a sleepy end device
+#define SIM_LOG_DRAIN_US (3600 * 1000000LL) // the deferred log is printed after every simulated hour
+
+// Every humidity sample handed to the history, to check what comes back out of flash
+typedef struct {
+    uint32_t time_s;
+    uint8_t channel;
+    int32_t value;
+} logged_sample_t;
+
+typedef struct {
+    uint64_t records;
+    uint64_t checked;
+    uint64_t missing;
+    int32_t max_error;
+} history_check_t;
+
+static logged_sample_t *logged;
+static size_t logged_count;
+static size_t logged_capacity;
+
+static void sim_samples_ready(void) {
+    // no alarms here, a change held back by min_interval_s goes out with the first drain after it is due
+    for (int ch = 0; ch < REPORT_CHANNEL_COUNT; ch++) {
+        int32_t value;
+        if (reporting_take_pending(ch, hal_time_us(), &value)) {
+            sim_stats.reports++;
+        }
+    }
+    sample_t sample;
+    while (sample_queue_pop(&sample)) {
+        history_append_sample(&sample);
+        if (sample.kind != SAMPLE_HUMIDITY && sample.kind != SAMPLE_CONSUMPTION) {
+            continue;   // not reported
+        }
+        if (sample.kind == SAMPLE_HUMIDITY) {
+            if (logged_count == logged_capacity) {
+                logged_capacity = logged_capacity ? logged_capacity * 2 : 4096;
+                logged = realloc(logged, logged_capacity * sizeof(logged[0]));
+            }
+            logged[logged_count++] = (logged_sample_t) { history_time(sample.time_us), sample.channel, sample.value };
+            metrics_record(METRIC_REPORT_DELAY, hal_time_us() - sample.time_us);
+        }
+        int channel = sample.kind == SAMPLE_CONSUMPTION ? REPORT_CHANNEL_CONSUMPTION : sample.channel;
+        if (reporting_filter(channel, sample.value, sample.time_us)) {
+            sim_stats.reports++;
+        }
+    }
+}
+
+static bool history_check_record(const history_record_t *record, void *ctx) {
+    history_check_t *check = ctx;
+    check->records++;
+    if (record->kind != HISTORY_HUMIDITY) {
+        return true;
+    }
+    // logged is in time order, find the sample of this channel taken in the same second
+    size_t lo = 0, hi = logged_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (logged[mid].time_s < record->time_s) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    while (lo < logged_count && logged[lo].time_s == record->time_s && logged[lo].channel != record->channel) {
+        lo++;
+    }
+    if (lo == logged_count || logged[lo].time_s != record->time_s) {
+        check->missing++;
+        return true;
+    }
+    int32_t error = abs(logged[lo].value - record->value);
+    if (error > check->max_error) {
+        check->max_error = error;
+    }
+    check->checked++;
+    return true;
+}
+
+static void print_history(int days) {
+    history_flush();
+    const history_stats_t *stats = history_stats();
+
+    history_check_t check = {0};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    history_query(0, UINT32_MAX, history_check_record, &check);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double query_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    printf("history:              %.2f bytes/sample, %.1f flash writes/day, %llu sector erases, %.1f days in %lu bytes\n",
+           logged_count ? sim_stats.flash_bytes_written / (double)logged_count : 0.0, sim_stats.flash_writes / (double)days,
+           (unsigned long long)sim_stats.flash_erases, (stats->newest_s - stats->oldest_s) / 86400.0,
+           (unsigned long)stats->bytes_used);
+    printf("history readback:     %llu records, %llu samples checked (max error %.2f%%, %llu not logged), %.1f ms (%.0f kB/s)\n",
+           (unsigned long long)check.records, (unsigned long long)check.checked, check.max_error / 100.0,
+           (unsigned long long)check.missing, query_ms, query_ms > 0 ? stats->bytes_used / query_ms : 0.0);
+}
+
+typedef struct {
+    int64_t end_us;
+    int commands_per_day;
+    uint32_t commands;
+    int64_t next_command_us;
+    int64_t pause_us;       // sim_loop returns after the first event from then on
+    bool done;
+} sim_run_t;
+
+static uint64_t command_seed = 1;
+
+// Uniform over [0, 2 * mean), xorshift so the pots' random sequence is left alone
+static int64_t command_gap_us(int per_day) {
+    command_seed ^= command_seed << 13;
+    command_seed ^= command_seed >> 7;
+    command_seed ^= command_seed << 17;
+    return (int64_t)(command_seed % (2 * 86400000000ULL / per_day));
+}
+
+// Stands in for measure_task, on a stack of its size so its peak use can be measured. Commands (--commands) arrive
+// at random times and alternate between measure now and 5 s of watering zone 0. They carry their arrival time,
+// so one that came in while a handler ran shows the wait in METRIC_COMMAND_LATENCY. Returns early once past
+// run->pause_us, so the caller can drain the deferred log off this stack, and is called again until done.
+static void sim_loop(void *arg) {
+    sim_run_t *run = arg;
+    hal_event_t event;
+    while (true) {
+        int64_t until_us = run->next_command_us < run->end_us ? run->next_command_us : run->end_us;
+        if (sim_next_event(&event, until_us)) {
+            driver_handle_event(&event);
+            if (hal_time_us() >= run->pause_us) {
+                return;
+            }
+            continue;
+        }
+        if (until_us == run->end_us) {
+            run->done = true;
+            break;
+        }
+        hal_event_t command = { .posted_us = (uint32_t)run->next_command_us, .timed = true };
+        if (run->commands++ % 2) {
+            command.type = DRIVER_EVENT_WATER;
+            command.arg = DRIVER_ZONE_ARG(0, 5);
+        } else {
+            command.type = DRIVER_EVENT_MEASURE_NOW;
+        }
+        hal_event_post(&command, true);
+        run->next_command_us += command_gap_us(run->commands_per_day);
+    }
+}
+
+static void sim_log_print(esp_log_level_t level, const char *tag, int64_t time_ms, const char *message) {
+    static const char letters[] = "NEWIDV";
+    if (host_log_level >= level) {
+        printf("%c (%.3f) %s: %s\n", letters[level], time_ms / 1e3, tag, message);
+    }
+}
+
+// Stands in for Log_main, on a stack of its size
+static void sim_log_drain(void *arg) {
+    dlog_drain(sim_log_print);
+}
+
+static void print_metrics(int days) {
+    metrics_benchmark_t bench;
+    metrics_benchmark(1000000, &bench);
+    double record_ns = bench.cycles / (double)bench.records;
+    uint32_t records = 0;
+    for (int id = 0; id < METRIC_HISTOGRAM_COUNT; id++) {
+        records += metrics_histogram(id)->count;
+    }
+    records += metrics_counter(METRIC_PUMP_STARTS);
+    printf("metrics:              acquisition p50 %lu us, p90 %lu us, max %lu us; wakeup to report p90 %lu us; %lu pump starts\n",
+           (unsigned long)metrics_percentile(METRIC_ACQUISITION, 50), (unsigned long)metrics_percentile(METRIC_ACQUISITION, 90),
+           (unsigned long)metrics_histogram(METRIC_ACQUISITION)->max, (unsigned long)metrics_percentile(METRIC_REPORT_DELAY, 90),
+           (unsigned long)metrics_counter(METRIC_PUMP_STARTS));
+    printf("metrics overhead:     %.1f ns per record, %.1f records/day, %.2f us/day on this host\n",
+           record_ns, records / (double)days, records * record_ns / 1e3 / days);
+    printf("first decision:       %lu ms after boot (virtual time)\n", (unsigned long)metrics_gauge(METRIC_FIRST_DECISION_MS));
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--days N] [--seed N] [--interval S] [--target H] [--poll MS|0] [--report-change C] [--fixed] [--zones] [--pumps N] [--reservoir L] [--fault open|saturated|stuck|noisy|drift] [--fault-day N] [--commands N] [--bench-conversion] [--verbose]\n", name);
+}
+
+// --zones: every pot gets a pump of its own instead of sharing the one of the built-in table
+static void setup_zones(void) {
+    static zone_config_t split[SENSOR_COUNT];
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        split[i] = (zone_config_t) {
+            .relay_pin = RELAY_PIN + i,
+            .sensor_mask = 1u << i,
+            .aggregation = ZONE_AGGREGATE_MIN,
+            .cooldown_s = RELAY_MIN_TIME_BETWEEN_CYCLES_M * 60,
+            .setpoint_endpoint = 50 + i,
+            .relay_endpoint = 1 + i,
+        };
+    }
+    ESP_ERROR_CHECK(zones_configure(split, SENSOR_COUNT));
+}
+
+static void setup_pots(void) {
+    // A small quick-drying pot and a large slow one, sharing the pump unless --zones
+    static const soil_pot_t presets[] = {
+        { .moisture = 60.0f, .dry_rate = 3.0f, .pump_gain = 1.2f, .soak_tau_s = 300.0f, .noise_mv = 12.0f, .spike_rate = 0.01f, .settle_tau_ms = 8.0f, .drain_above = 80.0f },
+        { .moisture = 55.0f, .dry_rate = 1.2f, .pump_gain = 0.4f, .soak_tau_s = 900.0f, .noise_mv = 12.0f, .spike_rate = 0.01f, .settle_tau_ms = 8.0f, .drain_above = 85.0f },
+        { .moisture = 50.0f, .dry_rate = 2.0f, .pump_gain = 0.8f, .soak_tau_s = 600.0f, .noise_mv = 12.0f, .spike_rate = 0.01f, .settle_tau_ms = 8.0f, .drain_above = 85.0f },
+    };
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        sim_pots[i] = presets[i % (sizeof(presets) / sizeof(presets[0]))];
+        sim_stats.lowest[i] = 100.0f;
+    }
+}
+
+int main(int argc, char **argv) {
+    int days = SIM_DEFAULT_DAYS;
+    int interval_s = SIM_DEFAULT_INTERVAL_S;
+    uint64_t seed = 1;
+    int poll_ms = SIM_DEFAULT_POLL_MS;
+    int report_change = -1;
+    bool fixed_interval = false;
+    bool bench_conversion = false;
+    bool split_zones = false;
+    int fault_day = 30;
+    int commands_per_day = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--days") && i + 1 < argc) {
+            days = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--interval") && i + 1 < argc) {
+            interval_s = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--target") && i + 1 < argc) {
+            sim_target_humidity = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--poll") && i + 1 < argc) {
+            poll_ms = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--report-change") && i + 1 < argc) {
+            report_change = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--fixed")) {
+            fixed_interval = true;
+        } else if (!strcmp(argv[i], "--zones")) {
+            split_zones = true;
+        } else if (!strcmp(argv[i], "--pumps") && i + 1 < argc) {
+            zones_set_pump_budget(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--reservoir") && i + 1 < argc) {
+            sim_reservoir_ml = atof(argv[++i]) * 1000.0;
+        } else if (!strcmp(argv[i], "--fault") && i + 1 < argc) {
+            static const char *const faults[] = { "none", "open", "saturated", "stuck", "noisy", "drift" };
+            const char *name = argv[++i];
+            sim_fault = SIM_FAULT_NONE;
+            for (int f = 0; f < sizeof(faults) / sizeof(faults[0]); f++) {
+                if (!strcmp(name, faults[f])) {
+                    sim_fault = f;
+                }
+            }
+            if (sim_fault == SIM_FAULT_NONE) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--fault-day") && i + 1 < argc) {
+            fault_day = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--commands") && i + 1 < argc) {
+            commands_per_day = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--bench-conversion")) {
+            bench_conversion = true;
+        } else if (!strcmp(argv[i], "--verbose")) {
+            host_log_level = ESP_LOG_DEBUG;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench_conversion) {
+        conversion_build(SENSOR_COUNT, true);
+        conversion_benchmark_t bench;
+        conversion_benchmark(0, 200, &bench);
+        printf("conversion:           table %.1f ns, float %.1f ns per reading, max difference %.2f%%, %lu validity mismatches\n",
+               bench.table_cycles / (double)bench.conversions, bench.float_cycles / (double)bench.conversions,
+               bench.max_error / 100.0, (unsigned long)bench.validity_mismatches);
+        return 0;
+    }
+
+    soil_seed(seed);
+    setup_pots();
+    if (split_zones) {
+        setup_zones();
+    }
+    reporting_init();
+    history_init();
+    if (report_change >= 0) {
+        for (int i = 0; i < SENSOR_COUNT; i++) {
+            report_policy_t policy = *reporting_get_policy(i);
+            policy.reportable_change = report_change;
+            policy.max_interval_s = report_change ? policy.max_interval_s : 0;
+            reporting_set_policy(i, &policy);
+        }
+    }
+
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    init_driver_immediate();
+    ESP_ERROR_CHECK(init_driver(interval_s, sim_samples_ready));
+    if (fixed_interval) {
+        schedule_configure(interval_s, interval_s, interval_s);
+    }
+    for (int z = 0; z < zones_count(); z++) {
+        set_min_humidity(z, sim_target_humidity);
+    }
+
+    sim_fault_from_us = (int64_t)fault_day * 24 * 3600 * 1000000;
+    command_seed += seed;
+    sim_run_t run = { .end_us = (int64_t)days * 24 * 3600 * 1000000, .commands_per_day = commands_per_day,
+                      .next_command_us = commands_per_day ? command_gap_us(commands_per_day) : INT64_MAX };
+    uint32_t stack_used = 0;
+    uint32_t log_stack_used = 0;
+    while (!run.done) {
+        run.pause_us = hal_time_us() + SIM_LOG_DRAIN_US;
+        uint32_t chunk_stack;
+        ESP_ERROR_CHECK(hal_run_on_stack(sim_loop, &run, MEASURE_TASK_STACK_SIZE, &chunk_stack));
+        stack_used = chunk_stack > stack_used ? chunk_stack : stack_used;
+        ESP_ERROR_CHECK(hal_run_on_stack(sim_log_drain, NULL, LOG_TASK_STACK_SIZE, &chunk_stack));
+        log_stack_used = chunk_stack > log_stack_used ? chunk_stack : log_stack_used;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall_ms = (wall_end.tv_sec - wall_start.tv_sec) * 1e3 + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e6;
+
+    printf("simulated days:       %d (%s interval %d s, target %.1f%%, seed %llu)\n",
+           days, fixed_interval ? "fixed" : "adaptive, default", interval_s, sim_target_humidity, (unsigned long long)seed);
+    printf("sensor wakeups:       %llu (%.1f/day), sensor powered %.1f s/day, %.1f ms/wakeup\n",
+           (unsigned long long)sim_stats.wakeups, sim_stats.wakeups / (double)days, sim_stats.sensor_on_ms / 1e3 / days,
+           sim_stats.wakeups ? sim_stats.sensor_on_ms / sim_stats.wakeups : 0.0);
+    const schedule_stats_t *schedule = schedule_stats();
+    printf("schedule:             %lu adaptive, %lu fallback, %lu at min, %lu at max\n",
+           (unsigned long)schedule->adaptive, (unsigned long)schedule->fallback,
+           (unsigned long)schedule->min_clamped, (unsigned long)schedule->max_clamped);
+    printf("adc samples:          %llu (%.1f/wakeup)\n",
+           (unsigned long long)sim_stats.adc_reads, sim_stats.wakeups ? sim_stats.adc_reads / (double)sim_stats.wakeups : 0.0);
+    uint64_t suppressed = 0;
+    for (int i = 0; i < REPORT_CHANNEL_COUNT; i++) {
+        suppressed += reporting_get_counters(i)->suppressed;
+    }
+    printf("reports:              %llu sent (%.1f/day), %llu suppressed\n",
+           (unsigned long long)sim_stats.reports, sim_stats.reports / (double)days, (unsigned long long)suppressed);
+    printf("pump cycles:          %llu (%.2f/day), pump time %.0f s, %llu false triggers, %d zones, at most %lu of %d pumps at once\n",
+           (unsigned long long)sim_stats.pump_cycles, sim_stats.pump_cycles / (double)days, sim_stats.pump_seconds,
+           (unsigned long long)sim_stats.false_triggers, zones_count(), (unsigned long)sim_stats.max_pumps, zones_pump_budget());
+    const dosing_stats_t *dosing = dosing_stats();
+    printf("dosing:               %lu doses, %lu stopped at goal, %lu at %d s, gains",
+           (unsigned long)dosing->doses, (unsigned long)dosing->goal_cutoffs, (unsigned long)dosing->max_cutoffs, DOSE_MAX_S);
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        printf(" %.3f", dosing_get_gain(i));
+    }
+    printf(" %%/s\n");
+    const flow_stats_t *flow = flow_stats();
+    printf("flow:                 %.2f l pumped, %.2f l metered, %lu runs, %lu dry-run cutoffs, pumps ran dry %.0f s\n",
+           sim_stats.flow_ml / 1e3, flow->volume_ml / 1e3, (unsigned long)flow->runs, (unsigned long)flow->dry_runs,
+           sim_stats.dry_pump_seconds);
+    const health_stats_t *health = health_stats();
+    printf("sensor health:        faults");
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        printf(" 0x%02x", health_faults(i));
+    }
+    printf(", %lu raised, %lu readings held back (%lu confirmed)\n", (unsigned long)health->faults_raised,
+           (unsigned long)health->outliers, (unsigned long)health->confirmed);
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        printf("pot %d:                %.1f h below target-%.0f%%, %.1f h above %.0f%%, lowest %.1f%%, mean %.1f%%\n",
+               i, sim_stats.minutes_below[i] / 60.0, SIM_EXCURSION_MARGIN, sim_stats.minutes_flooded[i] / 60.0, SIM_FLOOD_HUMIDITY, sim_stats.lowest[i],
+               sim_stats.moisture_minutes[i] / (days * 24.0 * 60.0));
+    }
+    print_history(days);
+    print_metrics(days);
+    printf("commands:             %lu injected, posted to acted on p50 %lu us, p90 %lu us, max %lu us",
+           (unsigned long)run.commands, (unsigned long)metrics_percentile(METRIC_COMMAND_LATENCY, 50),
+           (unsigned long)metrics_percentile(METRIC_COMMAND_LATENCY, 90),
+           (unsigned long)metrics_histogram(METRIC_COMMAND_LATENCY)->max);
+    if (poll_ms > 0) {
+        printf(", plus up to %d ms until the next parent poll", poll_ms);
+    }
+    printf("\n");
+    const dlog_stats_t *log = dlog_stats();
+    printf("deferred log:         %lu records (%.1f/day), %lu dropped, ring max depth %lu of %d\n",
+           (unsigned long)log->written, log->written / (double)days, (unsigned long)log->dropped,
+           (unsigned long)log->max_depth, DLOG_RING_LENGTH);
+    printf("measure task stack:   %lu of %d bytes at peak (host build)\n", (unsigned long)stack_used, MEASURE_TASK_STACK_SIZE);
+    printf("log task stack:       %lu of %d bytes at peak (host build)\n", (unsigned long)log_stack_used, LOG_TASK_STACK_SIZE);
+    energy_budget_t energy;
+    energy_estimate_per_day(&sim_stats, days, poll_ms, &energy);
+    if (poll_ms > 0) {
+        printf("energy (sleepy, %d ms poll): ", poll_ms);
+    } else {
+        printf("energy (always-on):   ");
+    }
+    printf("%.2f mAh/day (sleep %.2f, cpu %.2f, radio %.2f, sensors %.3f), %.0f days on %.0f mAh\n",
+           energy.total_mah, energy.sleep_mah, energy.cpu_mah, energy.radio_mah, energy.sensor_mah,
+           ENERGY_BATTERY_MAH / energy.total_mah, ENERGY_BATTERY_MAH);
+    printf("wall time:            %.1f ms total, %.1f us per simulated day\n", wall_ms, wall_ms * 1e3 / days);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "soil_model.h"
+#include "driver.h"
+#include <math.h>
+
+#define SECONDS_PER_DAY (24.0 * 3600.0)
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+void soil_seed(uint64_t seed) {
+    rng_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double rng_uniform(void) {
+    return ((rng_next() >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+float soil_gaussian(void) {
+    return (float)(sqrt(-2.0 * log(rng_uniform())) * cos(2.0 * M_PI * rng_uniform()));
+}
+
+static float evaporation_factor(double t_s) {
+    double day_phase = fmod(t_s, SECONDS_PER_DAY) / SECONDS_PER_DAY;
+    double year_phase = t_s / (365.0 * SECONDS_PER_DAY);
+    // peak at 14:00, close to zero at night; summer dries twice as fast as winter
+    double diurnal = 1.0 + 0.8 * cos(2.0 * M_PI * (day_phase - 14.0 / 24.0));
+    double seasonal = 1.0 - 0.33 * cos(2.0 * M_PI * (year_phase - 10.0 / 365.0));
+    return (float)(diurnal * seasonal);
+}
+
+void soil_step(soil_pot_t *pot, double t_s, float dt_s, bool pump_on) {
+    if (pump_on) {
+        pot->pending += pot->pump_gain * dt_s;
+    }
+    if (pot->pending > 0.0f) {
+        float soaked = pot->pending * (1.0f - expf(-dt_s / pot->soak_tau_s));
+        pot->pending -= soaked;
+        pot->moisture += soaked;
+    }
+    float loss = pot->dry_rate * (pot->moisture / 100.0f) * evaporation_factor(t_s) * dt_s / 3600.0f;
+    pot->moisture -= loss;
+    if (pot->moisture > pot->drain_above) {
+        pot->moisture -= (pot->moisture - pot->drain_above) * (1.0f - expf(-dt_s / 600.0f));
+    }
+    if (pot->moisture < 0.0f) { pot->moisture = 0.0f; }
+    if (pot->moisture > 100.0f) { pot->moisture = 100.0f; }
+}
+
+int soil_probe_mv(const soil_pot_t *pot, float powered_ms) {
+    float mv = DRY_VOLTAGE + (WET_VOLTAGE - DRY_VOLTAGE) * pot->moisture / 100.0f;
+    mv *= 1.0f - expf(-powered_ms / pot->settle_tau_ms);
+    mv += pot->noise_mv * soil_gaussian();
+    if (rng_uniform() < pot->spike_rate) {
+        mv += (rng_uniform() < 0.5 ? -1.0f : 1.0f) * (200.0f + 400.0f * (float)rng_uniform());
+    }
+    return (int)lroundf(mv);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+// Simple plant pot model used by the host simulator: evapotranspiration with a daily and seasonal cycle,
+// delayed soak-in of pumped water and a capacitive probe with gaussian noise.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    float moisture;         // sensor-visible soil moisture, %
+    float pending;          // pumped water not soaked in yet, % of pot capacity
+    float dry_rate;         // loss per hour at 100% moisture, daytime peak excluded, %/h
+    float pump_gain;        // water added per second of pumping, %/s
+    float soak_tau_s;       // soak-in time constant
+    float noise_mv;         // sensor noise sigma
+    float spike_rate;       // probability of a single sample being an outlier
+    float settle_tau_ms;    // probe output time constant after power up
+    float drain_above;      // moisture above which the excess drains out of the pot, %
+} soil_pot_t;
+
+void soil_seed(uint64_t seed);
+float soil_gaussian(void);
+
+// Advances the pot by dt_s seconds at absolute simulated time t_s
+void soil_step(soil_pot_t *pot, double t_s, float dt_s, bool pump_on);
+
+// Probe output in millivolts for the current state, including noise, powered_ms after the probe got power
+int soil_probe_mv(const soil_pot_t *pot, float powered_ms);
@@ -0,0 +1,209 @@
+#include "acquisition.h"
+#include "driver.h"
+#include "hal.h"
+#include "dlog.h"
+#include <stdlib.h>
+
+static const char *TAG = "ACQ";
+
+#define ACQ_READ_CHUNK 64
+
+static uint16_t blocks[SENSOR_COUNT][ACQ_BLOCK_SAMPLES];
+
+static void sort_block(uint16_t *block, int len) {
+    for (int i = 1; i < len; i++) {
+        uint16_t v = block[i];
+        int j = i - 1;
+        while (j >= 0 && block[j] > v) {
+            block[j + 1] = block[j];
+            j--;
+        }
+        block[j + 1] = v;
+    }
+}
+
+static int trimmed_mean(uint16_t *block) {
+    sort_block(block, ACQ_BLOCK_SAMPLES);
+    int sum = 0;
+    for (int i = ACQ_TRIM_SAMPLES; i < ACQ_BLOCK_SAMPLES - ACQ_TRIM_SAMPLES; i++) {
+        sum += block[i];
+    }
+    int n = ACQ_BLOCK_SAMPLES - 2 * ACQ_TRIM_SAMPLES;
+    return (sum + n / 2) / n;
+}
+
+static int64_t powered_at;
+static bool held;
+
+// Leaves the sensors unpowered if the ADC does not start
+static esp_err_t power_on(int count) {
+    uint32_t freq_hz = ACQ_CHANNEL_FREQ_HZ * count;
+    if (freq_hz > ACQ_MAX_FREQ_HZ) {
+        freq_hz = ACQ_MAX_FREQ_HZ;
+    }
+    hal_stay_awake(true);
+    hal_gpio_set_level(SENSOR_POWER_PIN, 1);
+    powered_at = hal_time_us();
+    esp_err_t ret = hal_adc_stream_start(freq_hz);
+    if (ret != ESP_OK) {
+        DLOGW(TAG, "ADC stream start failed: %d", ret);
+        hal_gpio_set_level(SENSOR_POWER_PIN, 0);
+        hal_stay_awake(false);
+    }
+    return ret;
+}
+
+static uint32_t power_off(void) {
+    hal_gpio_set_level(SENSOR_POWER_PIN, 0);
+    uint32_t powered_us = hal_time_us() - powered_at;
+    hal_adc_stream_stop();
+    hal_stay_awake(false);
+    return powered_us;
+}
+
+// Fills one block per channel, returns the number of samples read or a negative value on error, ESP_ERR_TIMEOUT
+// if a channel has not filled its block by deadline_us
+static int read_blocks(int count, int *fill, int64_t deadline_us, esp_err_t *ret) {
+    hal_adc_sample_t chunk[ACQ_READ_CHUNK];
+    int total = 0;
+    while (true) {
+        int got = 0;
+        *ret = hal_adc_stream_read(chunk, ACQ_READ_CHUNK, &got);
+        if (*ret != ESP_OK) {
+            DLOGW(TAG, "ADC stream read failed: %d", *ret);
+            return -1;
+        }
+        total += got;
+
+        for (int s = 0; s < got; s++) {
+            int ch = chunk[s].index;
+            if (ch < count && fill[ch] < ACQ_BLOCK_SAMPLES) {
+                blocks[ch][fill[ch]++] = chunk[s].raw;
+            }
+        }
+
+        bool complete = true;
+        for (int ch = 0; ch < count; ch++) {
+            complete &= fill[ch] == ACQ_BLOCK_SAMPLES;
+        }
+        if (complete) {
+            return total;
+        }
+        if (hal_time_us() >= deadline_us) {
+            *ret = ESP_ERR_TIMEOUT;
+            return -1;
+        }
+    }
+}
+
+// Reads blocks until every channel is stable or SENSOR_POWER_UP_TIME_MS ran out, sensors must be powered
+static esp_err_t settle(int count, int *out_value, acquisition_stats_t *stats) {
+    int fill[SENSOR_COUNT] = {0};
+    int previous[SENSOR_COUNT];
+    int stable[SENSOR_COUNT] = {0};
+    bool have_previous = false;
+    esp_err_t ret = ESP_OK;
+
+    stats->samples = 0;
+    stats->settled = false;
+
+    while (!stats->settled) {
+        int got = read_blocks(count, fill, powered_at + SENSOR_POWER_UP_TIME_MS * 1000, &ret);
+        if (got < 0) {
+            break;
+        }
+        stats->samples += got;
+
+        bool all_stable = true;
+        for (int ch = 0; ch < count; ch++) {
+            int value = trimmed_mean(blocks[ch]);
+            if (have_previous && abs(value - previous[ch]) <= ACQ_SETTLE_TOLERANCE) {
+                stable[ch]++;
+            } else {
+                stable[ch] = 0;
+            }
+            previous[ch] = value;
+            fill[ch] = 0;
+            all_stable &= stable[ch] >= ACQ_SETTLE_BLOCKS;
+        }
+        have_previous = true;
+        stats->settled = all_stable;
+
+        if (hal_time_us() - powered_at >= SENSOR_POWER_UP_TIME_MS * 1000) {
+            break;
+        }
+    }
+    stats->powered_us = hal_time_us() - powered_at;
+
+    if (!have_previous) {
+        if (ret == ESP_ERR_TIMEOUT) {
+            DLOGW(TAG, "No complete block of every channel within %d ms", SENSOR_POWER_UP_TIME_MS);
+        }
+        return ret == ESP_OK ? ESP_ERR_TIMEOUT : ret;
+    }
+    for (int ch = 0; ch < count; ch++) {
+        out_value[ch] = previous[ch];
+    }
+    if (!stats->settled) {
+        DLOGW(TAG, "Sensors did not settle within %d ms", SENSOR_POWER_UP_TIME_MS);
+    }
+    return ESP_OK;
+}
+
+esp_err_t acquisition_measure(int count, int *out_value, acquisition_stats_t *stats) {
+    if (held) {
+        stats->powered_us = hal_time_us() - powered_at;
+        stats->samples = 0;
+        stats->settled = true;
+        return acquisition_sample(count, out_value);
+    }
+    esp_err_t ret = power_on(count);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = settle(count, out_value, stats);
+    stats->powered_us = power_off();
+    return ret;
+}
+
+esp_err_t acquisition_hold(int count, int *out_value, acquisition_stats_t *stats) {
+    if (held) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t ret = power_on(count);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = settle(count, out_value, stats);
+    if (ret != ESP_OK) {
+        power_off();
+        return ret;
+    }
+    held = true;
+    return ESP_OK;
+}
+
+esp_err_t acquisition_sample(int count, int *out_value) {
+    if (!held) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    int fill[SENSOR_COUNT] = {0};
+    esp_err_t ret;
+    if (read_blocks(count, fill, hal_time_us() + SENSOR_POWER_UP_TIME_MS * 1000, &ret) < 0) {
+        if (ret == ESP_ERR_TIMEOUT) {
+            DLOGW(TAG, "No complete block of every channel within %d ms", SENSOR_POWER_UP_TIME_MS);
+        }
+        return ret;
+    }
+    for (int ch = 0; ch < count; ch++) {
+        out_value[ch] = trimmed_mean(blocks[ch]);
+    }
+    return ESP_OK;
+}
+
+void acquisition_release(void) {
+    if (held) {
+        held = false;
+        power_off();
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define ACQ_CHANNEL_FREQ_HZ 10000       // per channel, the total rate grows with the channel count so a block
+#define ACQ_MAX_FREQ_HZ 80000           // takes the same time for one sensor or eight (ESP32-H2 limit is 83.3 kHz)
+#define ACQ_BLOCK_SAMPLES 32            // samples per channel reduced into one value
+#define ACQ_TRIM_SAMPLES 8              // dropped from each end of a sorted block before averaging
+#define ACQ_SETTLE_TOLERANCE 7          // ADC codes (about 6 mV), consecutive blocks closer than this count as stable
+#define ACQ_SETTLE_BLOCKS 3             // stable blocks in a row required on every channel
+
+typedef struct {
+    uint32_t powered_us;    // sensor power on to power off
+    uint32_t samples;       // samples taken over all channels
+    bool settled;           // false if SENSOR_POWER_UP_TIME_MS ran out before readings were stable
+} acquisition_stats_t;
+
+// Powers the sensors, burst-samples all channels until the readings settle and cuts the power again.
+// Writes one reduced value per channel as a raw ADC code, see conversion.h for turning it into humidity.
+// On an error the sensors are left unpowered and neither the values nor the stats are written.
+esp_err_t acquisition_measure(int count, int *out_value, acquisition_stats_t *stats);
+
+// Like acquisition_measure, but leaves the sensors powered and the ADC streaming until acquisition_release(), so
+// acquisition_sample() can follow the soil closely (e.g. while watering). acquisition_measure takes a single block
+// while the sensors are held.
+esp_err_t acquisition_hold(int count, int *out_value, acquisition_stats_t *stats);
+// One block per channel, no settling; only valid while held
+esp_err_t acquisition_sample(int count, int *out_value);
+void acquisition_release(void);
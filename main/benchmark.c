@@ -0,0 +1,253 @@
+#include "benchmark.h"
+#include "hal.h"
+#include "acquisition.h"
+#include "conversion.h"
+#include "schedule.h"
+#include "dosing.h"
+#include "health.h"
+#include "reporting.h"
+#include "sample_queue.h"
+#include "zones.h"
+#include "dlog.h"
+#include "esp_log.h"
+#include <stdio.h>
+
+static const char *TAG = "BENCH";
+
+static const char *const stage_names[BENCH_STAGE_COUNT] = {
+    [BENCH_ADC_READ] = "adc_read",
+    [BENCH_ADC_CALIBRATION] = "adc_calibration",
+    [BENCH_CONVERSION] = "conversion",
+    [BENCH_DECISION] = "decision",
+    [BENCH_REPORT] = "report",
+    [BENCH_LOG_DEFERRED] = "log_deferred",
+    [BENCH_LOG_DRAIN] = "log_drain",
+    [BENCH_LOG_PRINTF] = "log_printf",
+};
+
+typedef struct {
+    benchmark_stage_t stage;
+    uint32_t rounds;
+    benchmark_result_t *result;
+} bench_run_t;
+
+static uint32_t trace_seed;
+
+// Fixed sequence, every run sees the same trace
+static int32_t trace_noise(void) {
+    trace_seed = trace_seed * 1664525u + 1013904223u;
+    return (int32_t)(trace_seed >> 16) % (2 * BENCHMARK_TRACE_NOISE + 1) - BENCHMARK_TRACE_NOISE;
+}
+
+static void bench_adc_read(uint32_t rounds, benchmark_result_t *result) {
+    int values[SENSOR_COUNT];
+    acquisition_stats_t acq;
+    for (uint32_t r = 0; r < rounds; r++) {
+        uint32_t start = hal_cycle_count();
+        if (acquisition_measure(SENSOR_COUNT, values, &acq) != ESP_OK) {
+            ESP_LOGW(TAG, "Acquisition failed");
+            return;
+        }
+        result->cycles += (uint32_t)(hal_cycle_count() - start);
+        result->ops++;
+    }
+}
+
+static void bench_adc_calibration(uint32_t rounds, benchmark_result_t *result) {
+    volatile int sink = 0;
+    for (uint32_t r = 0; r < rounds; r++) {
+        uint32_t start = hal_cycle_count();
+        for (int raw = 0; raw <= CONVERSION_RAW_MAX; raw++) {
+            int mv;
+            hal_adc_raw_to_mv(raw % SENSOR_COUNT, raw, &mv);
+            sink += mv;
+        }
+        result->cycles += (uint32_t)(hal_cycle_count() - start);
+        result->ops += CONVERSION_RAW_MAX + 1;
+    }
+    (void)sink;
+}
+
+static void bench_conversion(uint32_t rounds, benchmark_result_t *result) {
+    volatile int32_t sink = 0;
+    for (uint32_t r = 0; r < rounds; r++) {
+        uint32_t start = hal_cycle_count();
+        for (int raw = 0; raw <= CONVERSION_RAW_MAX; raw++) {
+            sink += conversion_humidity(raw % SENSOR_COUNT, raw);
+        }
+        result->cycles += (uint32_t)(hal_cycle_count() - start);
+        result->ops += CONVERSION_RAW_MAX + 1;
+    }
+    (void)sink;
+}
+
+// Every sensor dries out on its own from 60 %, a zone below its target gets a dose and the trace a watering.
+// Time advances by whatever interval the schedule plans, as on the device.
+static void bench_decision(uint32_t rounds, benchmark_result_t *result) {
+    int16_t humidity[SENSOR_COUNT];
+    int16_t usable[SENSOR_COUNT];
+    int raw[SENSOR_COUNT];
+    float percent[SENSOR_COUNT];
+    float targets[SENSOR_COUNT];
+    int64_t now_us = 0;
+    uint32_t interval_s = SCHEDULE_MIN_INTERVAL_S;
+    const float target = DEFAULT_MIN_HUMIDITY;
+
+    trace_seed = 1;
+    schedule_reset(UINT32_MAX);
+    health_init();
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        humidity[i] = 6000;
+        targets[i] = zones_of_sensor(i) < 0 ? -1.0f : target;
+    }
+
+    for (uint32_t r = 0; r < rounds; r++) {
+        now_us += (int64_t)interval_s * 1000000;
+        for (int i = 0; i < SENSOR_COUNT; i++) {
+            // sensors dry at slightly different rates
+            int32_t drop = (int32_t)(BENCHMARK_TRACE_DRY_RATE * (1.0f + 0.25f * i) * interval_s / 36.0f);
+            int32_t level = humidity[i] - drop + trace_noise();
+            humidity[i] = level < 0 ? 0 : level > 10000 ? 10000 : level;   // wetter than saturated runs off
+            raw[i] = CONVERSION_RAW_MAX * 3 / 4 - humidity[i] / 4;     // the probe reads higher the drier the soil
+        }
+
+        uint32_t start = hal_cycle_count();
+        health_update(raw, humidity, usable);
+        for (int i = 0; i < SENSOR_COUNT; i++) {
+            percent[i] = humidity[i] / 100.0f;
+            schedule_observe(i, now_us, percent[i]);
+        }
+        for (int z = 0; z < zones_count(); z++) {
+            dosing_learn(z, percent, now_us);
+            int16_t level = zones_aggregate(z, usable);
+            if (level == CONVERSION_INVALID || level >= target * 100 || dosing_soaking(z, now_us)) {
+                continue;
+            }
+            uint32_t mask = zones_get(z)->sensor_mask;
+            if (dosing_begin(z, percent, mask, target, now_us)) {
+                dosing_end(z, now_us);
+                schedule_reset(mask);
+                for (int i = 0; i < SENSOR_COUNT; i++) {
+                    humidity[i] += (mask & (1u << i)) ? BENCHMARK_TRACE_WATERING : 0;
+                }
+            }
+        }
+        interval_s = schedule_next_interval_s(targets);
+        result->cycles += (uint32_t)(hal_cycle_count() - start);
+        result->ops++;
+        dlog_drain(NULL);   // the records are written above, formatting them is not part of the decision
+    }
+}
+
+// Noisy readings around a slow drift, so the filter both sends and suppresses
+static void bench_report(uint32_t rounds, benchmark_result_t *result) {
+    int64_t now_us = 0;
+    int32_t level = 5000;
+    sample_t sample;
+
+    trace_seed = 2;
+    reporting_init();
+    for (uint32_t r = 0; r < rounds; r++) {
+        uint32_t start = hal_cycle_count();
+        for (int n = 0; n < BENCHMARK_REPORT_BATCH; n++) {
+            now_us += 60 * 1000000LL;
+            level += trace_noise() * 4 - 1;
+            sample = (sample_t) { .time_us = now_us, .value = level, .kind = SAMPLE_HUMIDITY, .channel = n % SENSOR_COUNT };
+            sample_queue_push(&sample);
+        }
+        while (sample_queue_pop(&sample)) {
+            reporting_filter(sample.channel, sample.value, sample.time_us);
+        }
+        result->cycles += (uint32_t)(hal_cycle_count() - start);
+        result->ops += BENCHMARK_REPORT_BATCH;
+    }
+}
+
+// The message of dosing_end, two floats and an integer
+#define BENCH_LOG_FORMAT "Zone %d dosed %.1f s towards %.1f%%"
+
+static void bench_log_deferred(uint32_t rounds, benchmark_result_t *result) {
+    dlog_drain(NULL);
+    for (uint32_t r = 0; r < rounds; r++) {
+        uint32_t start = hal_cycle_count();
+        for (int n = 0; n < BENCHMARK_LOG_BATCH; n++) {
+            DLOGI(TAG, BENCH_LOG_FORMAT, n % ZONE_MAX, n * 1.5f, DEFAULT_MIN_HUMIDITY);
+        }
+        result->cycles += (uint32_t)(hal_cycle_count() - start);
+        result->ops += BENCHMARK_LOG_BATCH;
+        dlog_drain(NULL);
+    }
+}
+
+static volatile char log_sink;
+
+static void bench_log_print(esp_log_level_t level, const char *tag, int64_t time_ms, const char *message) {
+    log_sink = message[0];
+}
+
+static void bench_log_drain(uint32_t rounds, benchmark_result_t *result) {
+    dlog_drain(NULL);
+    for (uint32_t r = 0; r < rounds; r++) {
+        for (int n = 0; n < BENCHMARK_LOG_BATCH; n++) {
+            DLOGI(TAG, BENCH_LOG_FORMAT, n % ZONE_MAX, n * 1.5f, DEFAULT_MIN_HUMIDITY);
+        }
+        uint32_t start = hal_cycle_count();
+        result->ops += dlog_drain(bench_log_print);
+        result->cycles += (uint32_t)(hal_cycle_count() - start);
+    }
+}
+
+// ESP_LOGI streams into the console instead of a buffer, so this one does not count towards the stack
+static char log_line[DLOG_LINE_MAX];
+
+static void bench_log_printf(uint32_t rounds, benchmark_result_t *result) {
+    for (uint32_t r = 0; r < rounds; r++) {
+        uint32_t start = hal_cycle_count();
+        for (int n = 0; n < BENCHMARK_LOG_BATCH; n++) {
+            snprintf(log_line, sizeof(log_line), "I (%lu) %s: " BENCH_LOG_FORMAT "\n", (unsigned long)(hal_time_us() / 1000),
+                     TAG, n % ZONE_MAX, n * 1.5f, DEFAULT_MIN_HUMIDITY);
+            log_sink = log_line[0];
+        }
+        result->cycles += (uint32_t)(hal_cycle_count() - start);
+        result->ops += BENCHMARK_LOG_BATCH;
+    }
+}
+
+static void bench_task(void *arg) {
+    bench_run_t *run = arg;
+    switch (run->stage) {
+    case BENCH_ADC_READ: bench_adc_read(run->rounds, run->result); break;
+    case BENCH_ADC_CALIBRATION: bench_adc_calibration(run->rounds, run->result); break;
+    case BENCH_CONVERSION: bench_conversion(run->rounds, run->result); break;
+    case BENCH_DECISION: bench_decision(run->rounds, run->result); break;
+    case BENCH_REPORT: bench_report(run->rounds, run->result); break;
+    case BENCH_LOG_DEFERRED: bench_log_deferred(run->rounds, run->result); break;
+    case BENCH_LOG_DRAIN: bench_log_drain(run->rounds, run->result); break;
+    case BENCH_LOG_PRINTF: bench_log_printf(run->rounds, run->result); break;
+    default: break;
+    }
+}
+
+void benchmark_init(void) {
+    int channels[SENSOR_COUNT];
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        channels[i] = sensor_config[i].adc_channel;
+    }
+    conversion_build(SENSOR_COUNT, hal_adc_init(channels, SENSOR_COUNT));
+    schedule_configure(SCHEDULE_MIN_INTERVAL_S, SCHEDULE_MAX_INTERVAL_S, SCHEDULE_MIN_INTERVAL_S);
+}
+
+esp_err_t benchmark_run(benchmark_stage_t stage, uint32_t rounds, benchmark_result_t *result) {
+    if (stage >= BENCH_STAGE_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *result = (benchmark_result_t) { .name = stage_names[stage] };
+    bench_run_t run = { .stage = stage, .rounds = rounds, .result = result };
+    return hal_run_on_stack(bench_task, &run, BENCHMARK_STACK_SIZE, &result->stack_bytes);
+}
+
+void benchmark_print_json(const benchmark_result_t *result, const char *unit) {
+    printf("{\"bench\":\"%s\",\"ops\":%lu,\"per_op\":%.1f,\"unit\":\"%s\",\"stack_bytes\":%lu}\n", result->name,
+           (unsigned long)result->ops, result->ops ? (double)result->cycles / result->ops : 0.0, unit,
+           (unsigned long)result->stack_bytes);
+}
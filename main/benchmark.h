@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "task_config.h"
+
+// Cycle counts of the measurement hot path, stage by stage, with the peak stack of each. Stateful stages run on
+// synthetic traces. Host: host/build/waterer_bench, device: define BENCHMARK_SUITE (driver.h) and read the console.
+// Both print one JSON object per stage and line, see benchmark_print_json.
+
+#define BENCHMARK_STACK_SIZE        MEASURE_TASK_STACK_SIZE     // stack each stage runs on
+#define BENCHMARK_TRACE_DRY_RATE    1.5f    // %/h, synthetic traces dry out at about this rate
+#define BENCHMARK_TRACE_NOISE       30      // 1/100 %, peak noise added to every synthetic reading
+#define BENCHMARK_TRACE_WATERING    1500    // 1/100 %, rise of a synthetic watering
+#define BENCHMARK_REPORT_BATCH      16      // samples pushed before the drain pops them, within SAMPLE_QUEUE_LENGTH
+#define BENCHMARK_LOG_BATCH         16      // records written before the drain takes them, within DLOG_RING_LENGTH
+
+typedef enum {
+    BENCH_ADC_READ,         // acquisition_measure: sensor power-up, streamed ADC read and block reduction
+    BENCH_ADC_CALIBRATION,  // hal_adc_raw_to_mv (adc_cali_raw_to_voltage on the device) over the 12-bit range
+    BENCH_CONVERSION,       // conversion_humidity over the 12-bit range
+    BENCH_DECISION,         // measure task logic after the acquisition: schedule fit, zone aggregation, dosing plan
+    BENCH_REPORT,           // drain path up to the attribute update: sample queue and reporting filter
+    BENCH_LOG_DEFERRED,     // DLOGI of the dosing summary, what the measure task pays per message (dlog.h)
+    BENCH_LOG_DRAIN,        // formatting those records later, on the drain's stack
+    BENCH_LOG_PRINTF,       // the same message formatted in place, as ESP_LOGI does before the console write
+    BENCH_STAGE_COUNT,
+} benchmark_stage_t;
+
+typedef struct {
+    const char *name;
+    uint32_t ops;           // readings, wakeups or samples, depending on the stage
+    uint64_t cycles;        // over all ops, hal_cycle_count units
+    uint32_t stack_bytes;   // peak
+} benchmark_result_t;
+
+// Sets up the ADC and the conversion tables like init_driver. The stages leave the schedule, dosing and reporting
+// state behind, so the suite runs instead of the driver, not next to it.
+void benchmark_init(void);
+// rounds: ADC reads, sweeps over the raw range, synthetic wakeups or report batches
+esp_err_t benchmark_run(benchmark_stage_t stage, uint32_t rounds, benchmark_result_t *result);
+// {"bench":"conversion","ops":819200,"per_op":12.3,"unit":"ns","stack_bytes":176}
+void benchmark_print_json(const benchmark_result_t *result, const char *unit);
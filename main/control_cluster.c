@@ -0,0 +1,57 @@
+#include "control_cluster.h"
+#include "driver.h"
+#include "history.h"
+#include "zones.h"
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "CONTROL_ZB";
+
+static uint16_t get_u16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+esp_zb_attribute_list_t *control_cluster_create(void)
+{
+    uint32_t zero = 0;
+    esp_zb_attribute_list_t *attrs = esp_zb_zcl_attr_list_create(CONTROL_CLUSTER_ID);
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, CONTROL_PAUSED_UNTIL_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32,
+                                                          ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero));
+    return attrs;
+}
+
+void control_cluster_paused(int zone, int64_t time_us, uint32_t seconds)
+{
+    uint32_t until = seconds ? history_time(time_us) + seconds : 0;
+    esp_zb_zcl_set_attribute_val(zones_get(zone)->setpoint_endpoint, CONTROL_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+        CONTROL_PAUSED_UNTIL_ATTR_ID, &until, false);
+}
+
+esp_err_t control_cluster_handle_command(int zone, const esp_zb_zcl_custom_cluster_command_message_t *message)
+{
+    ESP_RETURN_ON_FALSE(zone >= 0 && zone < zones_count(), ESP_ERR_INVALID_ARG, TAG, "No zone on endpoint %d",
+                        message->info.dst_endpoint);
+    const uint8_t *data = message->data.value;
+    switch (message->info.command.id) {
+    case CONTROL_CMD_MEASURE_NOW:
+        ESP_LOGI(TAG, "Measure now");
+        driver_measure_now();
+        return ESP_OK;
+    case CONTROL_CMD_WATER: {
+        ESP_RETURN_ON_FALSE(message->data.size >= 2 && data, ESP_ERR_INVALID_ARG, TAG, "Short water command");
+        uint16_t seconds = get_u16(data);
+        ESP_LOGI(TAG, "Zone %d: water for %u s", zone, seconds);
+        driver_water(zone, seconds);
+        return ESP_OK;
+    }
+    case CONTROL_CMD_PAUSE: {
+        ESP_RETURN_ON_FALSE(message->data.size >= 2 && data, ESP_ERR_INVALID_ARG, TAG, "Short pause command");
+        uint16_t hours = get_u16(data);
+        ESP_RETURN_ON_FALSE(hours <= CONTROL_PAUSE_MAX_H, ESP_ERR_INVALID_ARG, TAG, "Pause of %u h too long", hours);
+        ESP_LOGI(TAG, "Zone %d: pause for %u h", zone, hours);
+        driver_pause(zone, hours * 3600u);
+        return ESP_OK;
+    }
+    default:
+        ESP_LOGW(TAG, "Unsupported control command 0x%x", message->info.command.id);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "esp_zigbee_core.h"
+
+// Manufacturer-specific cluster for commands that should not wait for the next measurement, on every zone's
+// setpoint endpoint. All of them are queued to the measure task (driver.h), which enforces the pump limits:
+//
+// CONTROL_CMD_MEASURE_NOW (no payload) takes a measurement of every sensor and reports it right away.
+// CONTROL_CMD_WATER (seconds U16) runs the zone's pump, at most RELAY_MANUAL_MAX_S and not during its cooldown.
+// CONTROL_CMD_PAUSE (hours U16) stops automatic watering of the zone, 0 resumes it. Not kept across reboots.
+
+#define CONTROL_CLUSTER_ID                  0xFC14
+#define CONTROL_PAUSED_UNTIL_ATTR_ID        0x0000  /* U32, history clock (history_cluster.h) the pause ends, 0 - not paused */
+
+#define CONTROL_CMD_MEASURE_NOW             0x00    /* client -> server */
+#define CONTROL_CMD_WATER                   0x01    /* client -> server */
+#define CONTROL_CMD_PAUSE                   0x02    /* client -> server */
+
+#define CONTROL_PAUSE_MAX_H                 (30 * 24)
+
+esp_zb_attribute_list_t *control_cluster_create(void);
+// A pause started or ended at time_us, must be called with the Zigbee lock held
+void control_cluster_paused(int zone, int64_t time_us, uint32_t seconds);
+esp_err_t control_cluster_handle_command(int zone, const esp_zb_zcl_custom_cluster_command_message_t *message);
@@ -0,0 +1,160 @@
+#include "conversion.h"
+#include "hal.h"
+#include "esp_log.h"
+#include <stdlib.h>
+
+static const char *TAG = "CONVERSION";
+
+typedef struct {
+    calibration_point_t points[CONVERSION_MAX_POINTS];    // sorted by voltage
+    int count;
+    int16_t knots[CONVERSION_KNOTS];
+    int16_t valid_min;          // range of table values inside the calibration points
+    int16_t valid_max;
+} conversion_channel_t;
+
+static conversion_channel_t channels[SENSOR_COUNT] = {
+    [0 ... SENSOR_COUNT - 1] = {
+        .points = { { .mv = WET_VOLTAGE, .centi_percent = 10000 }, { .mv = DRY_VOLTAGE, .centi_percent = 0 } },
+        .count = 2,
+    },
+};
+static bool adc_calibrated;
+
+// Sorts by voltage into sorted and checks the points
+static esp_err_t sort_points(const calibration_point_t *points, int count, calibration_point_t *sorted) {
+    if (count < 2 || count > CONVERSION_MAX_POINTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < count; i++) {
+        if (points[i].centi_percent < 0 || points[i].centi_percent > 10000) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        int j = i;
+        while (j > 0 && sorted[j - 1].mv > points[i].mv) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = points[i];
+    }
+    for (int i = 1; i < count; i++) {
+        if (sorted[i].mv == sorted[i - 1].mv) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t conversion_check_points(const calibration_point_t *points, int count) {
+    calibration_point_t sorted[CONVERSION_MAX_POINTS];
+    return sort_points(points, count, sorted);
+}
+
+esp_err_t conversion_set_points(int channel, const calibration_point_t *points, int count) {
+    calibration_point_t sorted[CONVERSION_MAX_POINTS];
+    if (channel < 0 || channel >= SENSOR_COUNT || sort_points(points, count, sorted) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    conversion_channel_t *ch = &channels[channel];
+    for (int i = 0; i < count; i++) {
+        ch->points[i] = sorted[i];
+    }
+    ch->count = count;
+    return ESP_OK;
+}
+
+static int raw_to_mv(int channel, int raw) {
+    int mv;
+    if (adc_calibrated && hal_adc_raw_to_mv(channel, raw, &mv) == ESP_OK) {
+        return mv;
+    }
+    return raw * CONVERSION_NOMINAL_FULL_SCALE_MV / CONVERSION_RAW_MAX;
+}
+
+// Piecewise linear through the calibration points, extrapolated past the ends and saturated to int16
+static int16_t mv_to_centi(const conversion_channel_t *ch, int mv) {
+    int i = 1;
+    while (i < ch->count - 1 && mv > ch->points[i].mv) {
+        i++;
+    }
+    const calibration_point_t *a = &ch->points[i - 1];
+    const calibration_point_t *b = &ch->points[i];
+    int32_t num = (int32_t)(mv - a->mv) * (b->centi_percent - a->centi_percent);
+    int32_t den = b->mv - a->mv;
+    // round half away from zero
+    int32_t v = a->centi_percent + (num >= 0 ? num + den / 2 : num - den / 2) / den;
+    if (v > INT16_MAX) { v = INT16_MAX; }
+    if (v < INT16_MIN) { v = INT16_MIN; }
+    return v;
+}
+
+void conversion_build(int count, bool calibrated) {
+    adc_calibrated = calibrated;
+    for (int c = 0; c < count && c < SENSOR_COUNT; c++) {
+        conversion_channel_t *ch = &channels[c];
+        for (int k = 0; k < CONVERSION_KNOTS; k++) {
+            int raw = k << CONVERSION_KNOT_SHIFT;
+            ch->knots[k] = mv_to_centi(ch, raw_to_mv(c, raw > CONVERSION_RAW_MAX ? CONVERSION_RAW_MAX : raw));
+        }
+        ch->valid_min = ch->points[0].centi_percent;
+        ch->valid_max = ch->points[0].centi_percent;
+        for (int i = 1; i < ch->count; i++) {
+            if (ch->points[i].centi_percent < ch->valid_min) { ch->valid_min = ch->points[i].centi_percent; }
+            if (ch->points[i].centi_percent > ch->valid_max) { ch->valid_max = ch->points[i].centi_percent; }
+        }
+        ESP_LOGD(TAG, "Channel %d: %d calibration points, %d..%d", c, ch->count, ch->valid_min, ch->valid_max);
+    }
+}
+
+int16_t conversion_humidity(int channel, int raw) {
+    const conversion_channel_t *ch = &channels[channel];
+    if (raw < 0) { raw = 0; }
+    if (raw > CONVERSION_RAW_MAX) { raw = CONVERSION_RAW_MAX; }
+    int k = raw >> CONVERSION_KNOT_SHIFT;
+    int frac = raw & (CONVERSION_KNOT_CODES - 1);
+    int32_t a = ch->knots[k];
+    int32_t v = a + (((ch->knots[k + 1] - a) * frac + CONVERSION_KNOT_CODES / 2) >> CONVERSION_KNOT_SHIFT);
+    return (v < ch->valid_min || v > ch->valid_max) ? CONVERSION_INVALID : v;
+}
+
+// The conversion this replaced: calibrated millivolts, then a float division per reading
+static int16_t float_humidity(int channel, int raw) {
+    int mv = raw_to_mv(channel, raw);
+    if (mv > DRY_VOLTAGE || mv < WET_VOLTAGE) {
+        return CONVERSION_INVALID;
+    }
+    float humidity = ((float)(mv - DRY_VOLTAGE) / (WET_VOLTAGE - DRY_VOLTAGE)) * 100.0f;
+    return (int16_t)(100 * humidity);
+}
+
+void conversion_benchmark(int channel, int rounds, conversion_benchmark_t *result) {
+    volatile int32_t sink = 0;
+    *result = (conversion_benchmark_t) {0};
+
+    // per round, hal_cycle_count() wraps within seconds
+    for (int r = 0; r < rounds; r++) {
+        uint32_t start = hal_cycle_count();
+        for (int raw = 0; raw <= CONVERSION_RAW_MAX; raw++) {
+            sink += conversion_humidity(channel, raw);
+        }
+        result->table_cycles += (uint32_t)(hal_cycle_count() - start);
+
+        start = hal_cycle_count();
+        for (int raw = 0; raw <= CONVERSION_RAW_MAX; raw++) {
+            sink += float_humidity(channel, raw);
+        }
+        result->float_cycles += (uint32_t)(hal_cycle_count() - start);
+    }
+    result->conversions = rounds * (CONVERSION_RAW_MAX + 1);
+
+    for (int raw = 0; raw <= CONVERSION_RAW_MAX; raw++) {
+        int16_t table = conversion_humidity(channel, raw);
+        int16_t reference = float_humidity(channel, raw);
+        if ((table == CONVERSION_INVALID) != (reference == CONVERSION_INVALID)) {
+            result->validity_mismatches++;
+        } else if (abs(table - reference) > result->max_error) {
+            result->max_error = abs(table - reference);
+        }
+    }
+    (void)sink;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver.h"
+
+// ADC code to humidity without floating point. Per channel, the ADC calibration (raw -> mV) and the sensor
+// calibration points (mV -> 1/100 %) are folded into one table of knots every CONVERSION_KNOT_CODES codes,
+// converting a reading is then a table lookup and one integer interpolation.
+
+#define CONVERSION_RAW_BITS             12
+#define CONVERSION_RAW_MAX              ((1 << CONVERSION_RAW_BITS) - 1)
+#define CONVERSION_KNOT_SHIFT           5
+#define CONVERSION_KNOT_CODES           (1 << CONVERSION_KNOT_SHIFT)
+#define CONVERSION_KNOTS                ((1 << (CONVERSION_RAW_BITS - CONVERSION_KNOT_SHIFT)) + 1)
+#define CONVERSION_MAX_POINTS           8
+#define CONVERSION_INVALID              (-100)  // 1/100 %, outside the calibrated range
+#define CONVERSION_NOMINAL_FULL_SCALE_MV 3300   // used for the table when the ADC has no calibration scheme
+
+typedef struct calibration_point {
+    int16_t mv;
+    int16_t centi_percent;
+} calibration_point_t;
+
+// Sensor calibration of a channel, two to CONVERSION_MAX_POINTS points with distinct voltages in any order and
+// humidities within 0..100 %. Defaults to DRY_VOLTAGE -> 0 % and WET_VOLTAGE -> 100 %. Takes effect on the next
+// conversion_build().
+esp_err_t conversion_set_points(int channel, const calibration_point_t *points, int count);
+// The same checks without applying the points
+esp_err_t conversion_check_points(const calibration_point_t *points, int count);
+// Rebuilds the tables of the first count channels, adc_calibrated selects hal_adc_raw_to_mv over the nominal scale
+void conversion_build(int count, bool adc_calibrated);
+// Humidity in 1/100 % (the ZCL MeasuredValue unit), CONVERSION_INVALID outside the calibration points
+int16_t conversion_humidity(int channel, int raw);
+
+// Times the table against the float path it replaced (default calibration points) over every ADC code with
+// hal_cycle_count() and compares their results
+typedef struct {
+    uint32_t conversions;
+    uint64_t table_cycles;
+    uint64_t float_cycles;
+    int32_t max_error;          // 1/100 %, table vs float path where both are valid
+    uint32_t validity_mismatches;
+} conversion_benchmark_t;
+
+void conversion_benchmark(int channel, int rounds, conversion_benchmark_t *result);
@@ -0,0 +1,144 @@
+#include "dlog.h"
+#include "hal.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DLOG_RING_MASK (DLOG_RING_LENGTH - 1)
+
+_Static_assert((DLOG_RING_LENGTH & DLOG_RING_MASK) == 0, "DLOG_RING_LENGTH must be a power of two");
+
+typedef struct {
+    const char *tag;
+    const char *format;
+    uint32_t time_ms;
+    uint8_t level;
+    uint8_t argc;
+    uint32_t args[DLOG_MAX_ARGS];
+} dlog_record_t;
+
+static const char *TAG = "DLOG";
+
+static dlog_record_t ring[DLOG_RING_LENGTH];
+static atomic_uint head;    // next record to read, owned by the consumer
+static atomic_uint tail;    // next record to write, owned by the producer
+static dlog_stats_t stats;
+static uint32_t reported_dropped;   // consumer's copy
+
+void dlog_write(esp_log_level_t level, const char *tag, const char *format, uint32_t argc, ...) {
+    unsigned t = atomic_load_explicit(&tail, memory_order_relaxed);
+    unsigned h = atomic_load_explicit(&head, memory_order_acquire);
+
+    if (t - h >= DLOG_RING_LENGTH) {
+        stats.dropped++;
+        return;
+    }
+    dlog_record_t *r = &ring[t & DLOG_RING_MASK];
+    r->tag = tag;
+    r->format = format;
+    r->time_ms = (uint32_t)(hal_time_us() / 1000);
+    r->level = level;
+    r->argc = argc;
+    va_list args;
+    va_start(args, argc);
+    for (uint32_t i = 0; i < argc; i++) {
+        r->args[i] = va_arg(args, uint32_t);
+    }
+    va_end(args);
+    atomic_store_explicit(&tail, t + 1, memory_order_release);
+
+    stats.written++;
+    if (t + 1 - h > stats.max_depth) {
+        stats.max_depth = t + 1 - h;
+    }
+}
+
+static float word_float(uint32_t word) {
+    union { uint32_t word; float f; } u = { .word = word };
+    return u.f;
+}
+
+// printf subset: flags, width and precision are passed on, length modifiers dropped since every argument is 32 bits
+static void format_record(const dlog_record_t *r, char *out, size_t size) {
+    size_t n = 0;
+    int arg = 0;
+    const char *p = r->format;
+    while (*p && n + 1 < size) {
+        if (*p != '%') {
+            out[n++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            out[n++] = '%';
+            p += 2;
+            continue;
+        }
+        char spec[16];
+        size_t s = 0;
+        spec[s++] = *p++;
+        while (*p && strchr("-+ #0123456789.", *p) && s < sizeof(spec) - 2) {
+            spec[s++] = *p++;
+        }
+        while (*p && strchr("hlLjzt", *p)) {
+            p++;
+        }
+        char conversion = *p;
+        if (!conversion) {
+            break;
+        }
+        p++;
+        spec[s++] = conversion;
+        spec[s] = '\0';
+
+        uint32_t word = arg < r->argc ? r->args[arg++] : 0;
+        int written;
+        if (strchr("fFeEgG", conversion)) {
+            written = snprintf(out + n, size - n, spec, (double)word_float(word));
+        } else if (strchr("dic", conversion)) {
+            written = snprintf(out + n, size - n, spec, (int)(int32_t)word);
+        } else if (strchr("ouxX", conversion)) {
+            written = snprintf(out + n, size - n, spec, (unsigned)word);
+        } else {
+            written = snprintf(out + n, size - n, "?");
+        }
+        if (written < 0) {
+            break;
+        }
+        n += (size_t)written < size - n ? (size_t)written : size - n - 1;
+    }
+    out[n] = '\0';
+}
+
+uint32_t dlog_drain(dlog_print_t print) {
+    char line[DLOG_LINE_MAX];
+    uint32_t count = 0;
+    while (true) {
+        unsigned h = atomic_load_explicit(&head, memory_order_relaxed);
+        unsigned t = atomic_load_explicit(&tail, memory_order_acquire);
+        if (h == t) {
+            break;
+        }
+        // read after the tail, so no record is newer than now
+        int64_t now_ms = hal_time_us() / 1000;
+        const dlog_record_t *r = &ring[h & DLOG_RING_MASK];
+        if (print) {
+            format_record(r, line, sizeof(line));
+            print(r->level, r->tag, now_ms - (uint32_t)((uint32_t)now_ms - r->time_ms), line);
+        }
+        atomic_store_explicit(&head, h + 1, memory_order_release);
+        count++;
+    }
+
+    uint32_t dropped = stats.dropped;
+    if (dropped != reported_dropped && print) {
+        snprintf(line, sizeof(line), "%lu records dropped, ring full", (unsigned long)(dropped - reported_dropped));
+        print(ESP_LOG_WARN, TAG, hal_time_us() / 1000, line);
+    }
+    reported_dropped = dropped;
+    return count;
+}
+
+const dlog_stats_t *dlog_stats(void) {
+    return &stats;
+}
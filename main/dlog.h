@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_log.h"
+
+// Deferred log for the measure task. A DLOGx call formats nothing: it stores the level, tag, the address of the
+// format string (which stays in flash and serves as the message ID) and up to DLOG_MAX_ARGS raw 32-bit arguments
+// in a RAM ring. dlog_drain formats them later on the consumer's stack, on the device on the low-priority Log_main
+// task, woken after each batch of samples, in the simulator between simulated hours.
+//
+// Integers are kept as 32 bits, floats and doubles as float bits; %s, %p and * widths are not supported. Single
+// producer, like the sample queue: only the measure task and init_driver before it starts may use DLOGx. Calls
+// above DLOG_LEVEL are compiled out together with their format strings, the runtime level (esp_log_level_set,
+// --verbose in the simulator) filters what is left when it is printed.
+
+#ifndef DLOG_LEVEL
+#define DLOG_LEVEL          ESP_LOG_INFO
+#endif
+#ifndef DLOG_RING_LENGTH
+#define DLOG_RING_LENGTH    32      // records, power of two, 40 bytes each on the device
+#endif
+#define DLOG_MAX_ARGS       6
+#define DLOG_LINE_MAX       160     // formatted message, longer ones are cut
+
+typedef struct {
+    uint32_t written;
+    uint32_t dropped;       // ring full
+    uint32_t max_depth;
+} dlog_stats_t;
+
+// time_ms since boot, the record keeps its low 32 bits only and must be drained within 49 days
+typedef void (*dlog_print_t)(esp_log_level_t level, const char *tag, int64_t time_ms, const char *message);
+
+// argc uint32_t words follow, see DLOG_WORD
+void dlog_write(esp_log_level_t level, const char *tag, const char *format, uint32_t argc, ...);
+// Formats and prints every record in the ring, oldest first, on the caller's stack; NULL drops them unformatted.
+// Records lost to a full ring are reported as a warning. Returns the records taken out.
+uint32_t dlog_drain(dlog_print_t print);
+const dlog_stats_t *dlog_stats(void);
+
+static inline uint32_t dlog_float_word(double value) {
+    union { float f; uint32_t word; } u = { .f = (float)value };
+    return u.word;
+}
+
+static inline uint32_t dlog_int_word(uint32_t value) {
+    return value;
+}
+
+// Never called, lets the compiler check the arguments against the format
+static inline __attribute__((format(printf, 1, 2))) void dlog_check(const char *format, ...) {}
+
+#define DLOG_WORD(x) _Generic((x), float: dlog_float_word, double: dlog_float_word, default: dlog_int_word)(x)
+#define DLOG_WORDS_0()
+#define DLOG_WORDS_1(a) , DLOG_WORD(a)
+#define DLOG_WORDS_2(a, b) DLOG_WORDS_1(a), DLOG_WORD(b)
+#define DLOG_WORDS_3(a, b, c) DLOG_WORDS_2(a, b), DLOG_WORD(c)
+#define DLOG_WORDS_4(a, b, c, d) DLOG_WORDS_3(a, b, c), DLOG_WORD(d)
+#define DLOG_WORDS_5(a, b, c, d, e) DLOG_WORDS_4(a, b, c, d), DLOG_WORD(e)
+#define DLOG_WORDS_6(a, b, c, d, e, f) DLOG_WORDS_5(a, b, c, d, e), DLOG_WORD(f)
+#define DLOG_COUNT(...) DLOG_COUNT_(_, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define DLOG_COUNT_(_, a, b, c, d, e, f, n, ...) n
+#define DLOG_CAT(a, b) DLOG_CAT_(a, b)
+#define DLOG_CAT_(a, b) a##b
+
+#define DLOG_LEVEL_LOCAL(level, tag, format, ...) do {                                              \
+        if (0) {                                                                                    \
+            dlog_check(format, ##__VA_ARGS__);                                                      \
+        }                                                                                           \
+        if (DLOG_LEVEL >= (level)) {                                                                \
+            dlog_write(level, tag, format, DLOG_COUNT(__VA_ARGS__)                                  \
+                       DLOG_CAT(DLOG_WORDS_, DLOG_COUNT(__VA_ARGS__))(__VA_ARGS__));                \
+        }                                                                                           \
+    } while (0)
+
+#define DLOGE(tag, format, ...) DLOG_LEVEL_LOCAL(ESP_LOG_ERROR,   tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...) DLOG_LEVEL_LOCAL(ESP_LOG_WARN,    tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...) DLOG_LEVEL_LOCAL(ESP_LOG_INFO,    tag, format, ##__VA_ARGS__)
+#define DLOGD(tag, format, ...) DLOG_LEVEL_LOCAL(ESP_LOG_DEBUG,   tag, format, ##__VA_ARGS__)
+#define DLOGV(tag, format, ...) DLOG_LEVEL_LOCAL(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
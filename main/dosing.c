@@ -0,0 +1,141 @@
+#include "dosing.h"
+#include "zones.h"
+#include "dlog.h"
+
+static const char *TAG = "DOSING";
+
+typedef enum {
+    DOSE_IDLE,
+    DOSE_PUMPING,
+    DOSE_SOAKING,
+} dose_state_t;
+
+static float gains[SENSOR_COUNT] = {
+    [0 ... SENSOR_COUNT - 1] = DOSE_DEFAULT_GAIN,
+};
+typedef struct {
+    dose_state_t state;
+    float start_humidity[SENSOR_COUNT];
+    float goal;
+    uint32_t dosed_mask;            // sensors the dose is sized for
+    int64_t started_us;
+    int64_t stopped_us;
+} dose_t;
+
+static dose_t doses[ZONE_MAX];
+static dosing_stats_t stats;
+
+void dosing_set_gain(int channel, float gain) {
+    if (gain < DOSE_GAIN_MIN) { gain = DOSE_GAIN_MIN; }
+    if (gain > DOSE_GAIN_MAX) { gain = DOSE_GAIN_MAX; }
+    gains[channel] = gain;
+}
+
+float dosing_get_gain(int channel) {
+    return gains[channel];
+}
+
+bool dosing_begin(int zone, const float *humidity, uint32_t sensor_mask, float target, int64_t now_us) {
+    dose_t *d = &doses[zone];
+    d->goal = target + DOSE_TARGET_MARGIN;
+    d->dosed_mask = 0;
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        d->start_humidity[i] = humidity[i];
+        if ((sensor_mask & (1u << i)) && humidity[i] >= 0 && humidity[i] < d->goal) {
+            d->dosed_mask |= 1u << i;
+        }
+    }
+    if (!d->dosed_mask) {
+        return false;
+    }
+    d->state = DOSE_PUMPING;
+    d->started_us = now_us;
+    stats.doses++;
+    return true;
+}
+
+bool dosing_update(int zone, const float *humidity, int64_t now_us) {
+    const dose_t *d = &doses[zone];
+    if (d->state != DOSE_PUMPING) {
+        return false;
+    }
+    float elapsed_s = (now_us - d->started_us) / 1e6f;
+    if (elapsed_s >= DOSE_MAX_S) {
+        stats.max_cutoffs++;
+        return true;
+    }
+    if (elapsed_s < DOSE_MIN_S) {
+        return false;
+    }
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        if (!(d->dosed_mask & (1u << i))) {
+            continue;
+        }
+        float predicted = d->start_humidity[i] + gains[i] * elapsed_s;
+        // whichever reaches the goal first ends the dose: the prediction, or the reading if the soil answers faster
+        // than the gain expects (the reading lags the soak-in, so it is the later of the two unless the gain is low)
+        if (predicted < d->goal && humidity[i] < d->goal) {
+            return false;
+        }
+    }
+    stats.goal_cutoffs++;
+    return true;
+}
+
+void dosing_end(int zone, int64_t now_us) {
+    dose_t *d = &doses[zone];
+    if (d->state != DOSE_PUMPING) {
+        return;
+    }
+    d->state = DOSE_SOAKING;
+    d->stopped_us = now_us;
+    DLOGI(TAG, "Zone %d dosed %.1f s towards %.1f%%", zone, (d->stopped_us - d->started_us) / 1e6f, d->goal);
+}
+
+void dosing_cancel(int zone) {
+    doses[zone].state = DOSE_IDLE;
+}
+
+uint32_t dosing_soak_remaining_s(int zone, int64_t now_us) {
+    const dose_t *d = &doses[zone];
+    if (d->state != DOSE_SOAKING) {
+        return 0;
+    }
+    int64_t remaining_us = d->stopped_us + (int64_t)DOSE_SOAK_S * 1000000 - now_us;
+    return remaining_us > 0 ? (remaining_us + 999999) / 1000000 : 0;
+}
+
+bool dosing_soaking(int zone, int64_t now_us) {
+    return dosing_soak_remaining_s(zone, now_us) > 0;
+}
+
+uint32_t dosing_learn(int zone, const float *humidity, int64_t now_us) {
+    dose_t *d = &doses[zone];
+    if (d->state != DOSE_SOAKING || dosing_soaking(zone, now_us)) {
+        return 0;
+    }
+    d->state = DOSE_IDLE;
+    float pumped_s = (d->stopped_us - d->started_us) / 1e6f;
+    if (pumped_s <= 0) {
+        return 0;
+    }
+
+    uint32_t changed = 0;
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        if (!(d->dosed_mask & (1u << i)) || humidity[i] < 0) {
+            continue;
+        }
+        float observed = (humidity[i] - d->start_humidity[i]) / pumped_s;
+        float old = gains[i];
+        dosing_set_gain(i, old + DOSE_LEARN_RATE * (observed - old));
+        DLOGI(TAG, "Sensor %d: %.2f%% -> %.2f%% after %.1f s, gain %.3f -> %.3f %%/s", i, d->start_humidity[i], humidity[i],
+              pumped_s, old, gains[i]);
+        changed |= 1u << i;
+        stats.learned++;
+    }
+    return changed;
+}
+
+const dosing_stats_t *dosing_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver.h"
+
+// Closed-loop watering. A dose is sized from a learned per-sensor gain (humidity rise after soak-in per pump second)
+// and the pump is cut as soon as that prediction, or the soil response sampled while pumping, reaches the goal.
+// One soak-in period after the pump stops the rise is measured and folded into the gain. Every zone runs its own
+// dose, the gains belong to the sensors.
+
+#define DOSE_SAMPLE_INTERVAL_MS     250     // sensors are held powered and sampled at this rate while pumping
+#define DOSE_TARGET_MARGIN          5.0f    // %, a dose aims this far above the target once soaked in
+#define DOSE_MIN_S                  2
+#define DOSE_MAX_S                  30      // relay is released after this no matter what
+#define DOSE_SOAK_S                 (30 * 60)   // watering is held off and the gain measured after this
+#define DOSE_DEFAULT_GAIN           0.5f    // %/s
+#define DOSE_GAIN_MIN               0.05f
+#define DOSE_GAIN_MAX               5.0f
+#define DOSE_LEARN_RATE             0.3f    // weight of the newest observation
+#define DOSE_GAIN_SCALE             1000    // gains leave the driver as integers in 1/1000 %/s
+
+typedef struct {
+    uint32_t doses;
+    uint32_t goal_cutoffs;          // predicted or observed humidity reached the goal
+    uint32_t max_cutoffs;           // DOSE_MAX_S ran out
+    uint32_t learned;               // gain updates
+} dosing_stats_t;
+
+void dosing_set_gain(int channel, float gain);
+float dosing_get_gain(int channel);
+
+// Plans a dose for the zone's sensors (sensor_mask) from the readings (in %, negative is invalid) taken before
+// watering, false if none of them needs water
+bool dosing_begin(int zone, const float *humidity, uint32_t sensor_mask, float target, int64_t now_us);
+// Readings taken while pumping, true once the zone's pump should stop
+bool dosing_update(int zone, const float *humidity, int64_t now_us);
+// Pump stopped, starts the soak-in period
+void dosing_end(int zone, int64_t now_us);
+// Drops the running dose without learning from it, e.g. when the relay is taken over manually
+void dosing_cancel(int zone);
+// Seconds until the zone's soak-in check is due, 0 if none is pending or it is overdue
+uint32_t dosing_soak_remaining_s(int zone, int64_t now_us);
+bool dosing_soaking(int zone, int64_t now_us);
+// Readings taken after the soak-in period: updates the gains, returns a mask of the channels that changed
+uint32_t dosing_learn(int zone, const float *humidity, int64_t now_us);
+const dosing_stats_t *dosing_stats(void);
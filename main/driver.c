@@ -1,144 +1,663 @@
 #include "driver.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
+#include "acquisition.h"
+#include "sample_queue.h"
+#include "schedule.h"
+#include "dosing.h"
+#include "flow.h"
+#include "health.h"
+#include "conversion.h"
+#include "zones.h"
+#include "metrics.h"
+#include "task_config.h"
+#include "dlog.h"
 #include "esp_log.h"
-#include "esp_adc/adc_oneshot.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 
 static const char *TAG = "DRIVER";
-int sensor_pins[] = {ADC1_GPIO1_CHANNEL, ADC1_GPIO2_CHANNEL, ADC1_GPIO3_CHANNEL};
 bool calibration_enabled = true;
-adc_cali_handle_t calibration_handles[] = {0, 0, 0}; // seems like an overkill, one calibration func should be plenty
-static int target_min_humidity = DEFAULT_MIN_HUMIDITY;
-static float minutes_since_last_pump = 0.0f;
-static uint16_t water_consumption_cycles = 0;
 
-#define ATTN ADC_ATTEN_DB_12
-
-static esp_humidity_sensor_callback_t report_ptr;
-static esp_water_consumption_callback_t consumption_ptr;
-static int interval;
-adc_oneshot_unit_handle_t adc1_handle;
+typedef struct {
+    int32_t target;         // 1/100 %, like every humidity below
+    int64_t started_us;
+    int64_t deadline_us;    // 0: no deadline
+    int64_t last_end_us;
+    int64_t paused_until_us;
+    bool running;
+    bool dosing;            // running under dosing control, not manually
+} zone_state_t;
+
+static zone_state_t zone_states[ZONE_MAX];
+static int16_t last_humidity[SENSOR_COUNT];
+static int64_t pump_total_us = 0;
+static bool dose_held = false;
+
+static esp_samples_ready_callback_t ready_ptr;
 static bool driver_initialized = false;
-
-esp_err_t set_relay_state(bool on) {
-        esp_err_t gpio_result = gpio_set_level(RELAY_PIN, on ? 0 : 1);    // inverted relay state since my custom-built relay driver is inverted                     
-        if (gpio_result != ESP_OK) {            
-            ESP_LOGI(TAG, "Error %d when setting gpio pin", gpio_result);
+static bool first_decision_made = false;
+static bool flow_metered = false;
+static bool flow_rate_published = false;   // for the current run
+static bool flow_dry = false;               // latched by a dry run, cleared by a manual relay command
+static atomic_bool stop_requested;          // set by driver_emergency_stop on any task
+static atomic_bool calibration_staged;      // staged_points belong to the measure task until it clears this
+static calibration_point_t staged_points[CONVERSION_MAX_POINTS];
+static int staged_count;
+
+static esp_err_t set_relay_state(int zone, bool on) {
+        esp_err_t gpio_result = hal_gpio_set_level(zones_get(zone)->relay_pin, on ? 0 : 1);    // inverted relay state since my custom-built relay driver is inverted
+        if (gpio_result != ESP_OK) {
+            DLOGI(TAG, "Error %d when setting gpio pin", gpio_result);
         }
     return gpio_result;
 }
 
-static float calculate_humidity(int value) {
-    if (value > DRY_VOLTAGE) { return -1.0f; };
-    if (value < WET_VOLTAGE) { return -1.0f; };
-    return ((float)(value - DRY_VOLTAGE) / (WET_VOLTAGE - DRY_VOLTAGE)) * 100.0;
+// The dry-out and dose models work in %, negative marks an invalid reading
+static void to_percent(const int16_t *humidity, float *percent) {
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        percent[i] = humidity[i] == CONVERSION_INVALID ? -1.0f : humidity[i] / 100.0f;
+    }
 }
 
-static bool adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_atten_t atten, adc_cali_handle_t *out_handle)
-{
-    adc_cali_handle_t handle = NULL;
-    esp_err_t ret = ESP_FAIL;
-    bool calibrated = false;
+static void publish_at(int64_t time_us, sample_kind_t kind, int channel, int32_t value) {
+    sample_t sample = { .time_us = time_us, .value = value, .kind = kind, .channel = channel };
+    if (!sample_queue_push(&sample)) {
+        DLOGW(TAG, "Sample queue full, dropped sample for channel %d", channel);
+    }
+}
 
-    ESP_LOGD(TAG, "calibration scheme version is %s", "Curve Fitting");
-    adc_cali_curve_fitting_config_t cali_config = {
-        .unit_id = unit,
-        .chan = channel,
-        .atten = atten,
-        .bitwidth = ADC_BITWIDTH_DEFAULT,
-    };
-    ret = adc_cali_create_scheme_curve_fitting(&cali_config, &handle);
-    if (ret == ESP_OK) {
-        calibrated = true;
+static void publish(sample_kind_t kind, int channel, int32_t value) {
+    publish_at(hal_time_us(), kind, channel, value);
+}
+
+static esp_err_t post(driver_event_type_t type, int32_t arg, bool urgent, bool timed) {
+    hal_event_t event = { .type = type, .arg = arg, .posted_us = (uint32_t)hal_time_us(), .timed = timed };
+    esp_err_t ret = hal_event_post(&event, urgent);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Event queue full, dropped event %d", type);
     }
+    return ret;
+}
 
-    *out_handle = handle;
-    if (ret == ESP_OK) {
-        ESP_LOGD(TAG, "Calibration Success");
-    } else if (ret == ESP_ERR_NOT_SUPPORTED || !calibrated) {
-        ESP_LOGW(TAG, "eFuse not burnt, skip software calibration");
-    } else {
-        ESP_LOGE(TAG, "Invalid arg or no memory");
+static esp_err_t post_event(driver_event_type_t type, int32_t arg, bool urgent) {
+    return post(type, arg, urgent, false);
+}
+
+// Commands coming in through Zigbee, METRIC_COMMAND_LATENCY times them from posting to being acted on
+static void post_command(driver_event_type_t type, int32_t arg, bool urgent) {
+    post(type, arg, urgent, true);
+}
+
+static bool cooldown_elapsed(int zone, int64_t now_us) {
+    return now_us - zone_states[zone].last_end_us >= (int64_t)zones_get(zone)->cooldown_s * 1000000;
+}
+
+static int pumps_running(void) {
+    int running = 0;
+    for (int z = 0; z < zones_count(); z++) {
+        running += zone_states[z].running;
+    }
+    return running;
+}
+
+static bool doses_running(void) {
+    for (int z = 0; z < zones_count(); z++) {
+        if (zone_states[z].dosing) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// One timer serves every zone: it is armed for the earliest deadline of the running pumps
+static void pump_timer_arm(void) {
+    int64_t earliest_us = 0;
+    for (int z = 0; z < zones_count(); z++) {
+        const zone_state_t *s = &zone_states[z];
+        if (s->running && s->deadline_us && (!earliest_us || s->deadline_us < earliest_us)) {
+            earliest_us = s->deadline_us;
+        }
+    }
+    if (!earliest_us) {
+        hal_timer_cancel(DRIVER_TIMER_PUMP);
+        return;
     }
+    int64_t delay_us = earliest_us - hal_time_us();
+    hal_event_t off = { .type = DRIVER_EVENT_PUMP_OFF };
+    hal_timer_schedule(DRIVER_TIMER_PUMP, delay_us > 0 ? (delay_us + 999) / 1000 : 0, &off);
+}
 
-    return calibrated;
+static void flow_check_schedule(void) {
+    hal_event_t check = { .type = DRIVER_EVENT_FLOW_CHECK };
+    hal_timer_schedule(DRIVER_TIMER_FLOW, FLOW_CHECK_INTERVAL_MS, &check);
 }
 
+// The meter counts only while some pump runs, a run spans from the first pump on to the last one off
+static void flow_run_start(int64_t now_us) {
+    if (!flow_metered) {
+        return;
+    }
+    hal_pulse_start();
+    flow_start(hal_pulse_count(), now_us);
+    flow_rate_published = false;
+    flow_check_schedule();
+}
 
-static void measure_task(void *pvParameters) {
-    
-    while (true) {
+static void flow_run_stop(int64_t now_us) {
+    if (!flow_metered) {
+        return;
+    }
+    hal_timer_cancel(DRIVER_TIMER_FLOW);
+    flow_stop(hal_pulse_count(), now_us);
+    hal_pulse_stop();
+    publish(SAMPLE_FLOW_RATE, 0, 0);
+    publish(SAMPLE_FLOW_VOLUME, 0, flow_volume_ml());
+}
 
-        ESP_LOGD(TAG, "Starting measurement, powering up");
-        gpio_set_level(SENSOR_POWER_PIN, 1);
-        vTaskDelay(pdMS_TO_TICKS(SENSOR_POWER_UP_TIME_MS));
-        int adc_raw;
+static void pump_start(int zone, uint32_t duration_s) {
+    zone_state_t *s = &zone_states[zone];
+    DLOGI(TAG, "Zone %d: turning pump on", zone);
+    bool first = !pumps_running();
+    set_relay_state(zone, true);
+    metrics_count(METRIC_PUMP_STARTS);
+    s->running = true;
+    s->started_us = hal_time_us();
+    s->deadline_us = duration_s ? s->started_us + (int64_t)duration_s * 1000000 : 0;
+    pump_timer_arm();
+    publish(SAMPLE_RELAY, zone, 1);
+    if (first) {
+        flow_run_start(s->started_us);
+    }
+}
+
+static void schedule_measurement(void) {
+    float targets[SENSOR_COUNT];
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        int zone = zones_of_sensor(i);
+        targets[i] = zone < 0 ? -1.0f : zone_states[zone].target / 100.0f;
+    }
+    uint32_t next_s = schedule_next_interval_s(targets);
+    int64_t now_us = hal_time_us();
+    for (int z = 0; z < zones_count(); z++) {
+        uint32_t soak_s = dosing_soak_remaining_s(z, now_us);
+        if (soak_s && soak_s < next_s) {
+            next_s = soak_s;    // the gain is measured right when the soak-in period ends
+        }
+    }
+    hal_event_t next = { .type = DRIVER_EVENT_MEASURE };
+    hal_timer_schedule(DRIVER_TIMER_MEASURE, next_s * 1000, &next);
+    DLOGD(TAG, "Next measurement in %lu s", (unsigned long)next_s);
+}
 
-        float min_measured_humidity = 100.0f;
+static void schedule_measurement_retry(void) {
+    hal_event_t next = { .type = DRIVER_EVENT_MEASURE };
+    hal_timer_schedule(DRIVER_TIMER_MEASURE, MEASURE_RETRY_S * 1000, &next);
+}
 
-        for (int i = 0; i < SENSOR_COUNT; i++) {
-            ESP_ERROR_CHECK(adc_oneshot_read(adc1_handle, sensor_pins[i], &adc_raw));
-            ESP_LOGD(TAG, "ADC%d Channel[%d] Raw Data: %d", ADC_UNIT_1 + 1, sensor_pins[i], adc_raw);
+// The sensors stay powered while any zone is dosing
+static void dose_release(void) {
+    if (doses_running()) {
+        return;
+    }
+    hal_timer_cancel(DRIVER_TIMER_DOSE);
+    if (dose_held) {
+        acquisition_release();
+        dose_held = false;
+    }
+}
+
+// watered false: the run delivered no water to speak of (dry run), it neither soaks in nor resets the drying fit
+static void pump_stop_run(int zone, bool watered) {
+    zone_state_t *s = &zone_states[zone];
+    if (!s->running) {
+        return;
+    }
+    DLOGI(TAG, "Zone %d: turning pump off", zone);
+    set_relay_state(zone, false);
+    s->running = false;
+    s->dosing = false;
+    s->last_end_us = hal_time_us();
+    dose_release();
+    pump_timer_arm();
+    if (watered) {
+        dosing_end(zone, s->last_end_us);
+        schedule_reset(zones_get(zone)->sensor_mask);
+    }
+    pump_total_us += s->last_end_us - s->started_us;
+    publish(SAMPLE_RELAY, zone, 0);
+    publish(SAMPLE_PUMP, zone, (s->last_end_us - s->started_us + 500000) / 1000000);
+    publish(SAMPLE_CONSUMPTION, 0, (pump_total_us + 500000) / 1000000);
+    if (!pumps_running()) {
+        flow_run_stop(s->last_end_us);
+    }
+    if (dosing_soak_remaining_s(zone, s->last_end_us)) {
+        schedule_measurement();
+    }
+    if (ready_ptr) {
+        ready_ptr();
+    }
+}
+
+static void pump_stop(int zone) {
+    pump_stop_run(zone, true);
+}
+
+static void schedule_dose_sample(void) {
+    hal_event_t sample = { .type = DRIVER_EVENT_DOSE_SAMPLE };
+    hal_timer_schedule(DRIVER_TIMER_DOSE, DOSE_SAMPLE_INTERVAL_MS, &sample);
+}
+
+static bool zone_needs_water(int zone, int64_t now_us, int32_t *deficit) {
+    const zone_state_t *s = &zone_states[zone];
+    if (s->running || s->paused_until_us > now_us || !cooldown_elapsed(zone, now_us) || dosing_soaking(zone, now_us)) {
+        return false;
+    }
+    int16_t humidity = zones_aggregate(zone, last_humidity);
+    if (humidity == CONVERSION_INVALID || humidity >= s->target) {
+        return false;
+    }
+    *deficit = s->target - humidity;
+    return true;
+}
+
+static bool dose_start(int zone, int64_t now_us) {
+    zone_state_t *s = &zone_states[zone];
+    float percent[SENSOR_COUNT];
+    to_percent(last_humidity, percent);
+    if (!dosing_begin(zone, percent, zones_get(zone)->sensor_mask, s->target / 100.0f, now_us)) {
+        return false;
+    }
+    bool first = !doses_running();
+    pump_start(zone, DOSE_MAX_S);
+    s->dosing = true;
+    if (!dose_held) {
+        int values[SENSOR_COUNT];
+        acquisition_stats_t acq;
+        dose_held = acquisition_hold(SENSOR_COUNT, values, &acq) == ESP_OK;
+        if (!dose_held) {
+            DLOGW(TAG, "Sensors unavailable, dosing on the learned gain only");
+        }
+    }
+    if (first) {
+        schedule_dose_sample();
+    }
+    return true;
+}
+
+// Starts the zones that need water, driest first, as long as the pump budget allows. Zones left waiting are
+// picked up as soon as a running pump stops.
+static void evaluate_watering(void) {
+    int64_t now_us = hal_time_us();
+    if (!first_decision_made) {
+        first_decision_made = true;
+        metrics_set(METRIC_FIRST_DECISION_MS, now_us / 1000);
+        DLOGI(TAG, "First watering decision %lu ms after boot", (unsigned long)(now_us / 1000));
+    }
+    if (flow_dry) {
+        return;     // nothing is watered automatically until someone has seen to the reservoir
+    }
+    int running = pumps_running();
+    uint32_t tried = 0;
+    while (running < zones_pump_budget()) {
+        int driest = -1;
+        int32_t largest = 0;
+        for (int z = 0; z < zones_count(); z++) {
+            int32_t deficit;
+            if (!(tried & (1u << z)) && zone_needs_water(z, now_us, &deficit) && deficit > largest) {
+                driest = z;
+                largest = deficit;
+            }
+        }
+        if (driest < 0) {
+            return;
+        }
+        tried |= 1u << driest;
+        if (dose_start(driest, now_us)) {
+            running++;
+        }
+    }
+}
+
+static void dose_sample(void) {
+    if (!doses_running()) {
+        return;
+    }
+    int16_t humidity[SENSOR_COUNT];
+    int values[SENSOR_COUNT];
+    bool sampled = dose_held && acquisition_sample(SENSOR_COUNT, values) == ESP_OK;
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        // without live readings the dose runs on the learned gain alone, excluded sensors never give any
+        humidity[i] = sampled && !health_excluded(i) ? conversion_humidity(i, values[i]) : CONVERSION_INVALID;
+    }
+    float percent[SENSOR_COUNT];
+    to_percent(humidity, percent);
+    int64_t now_us = hal_time_us();
+    bool stopped = false;
+    for (int z = 0; z < zones_count(); z++) {
+        if (zone_states[z].dosing && dosing_update(z, percent, now_us)) {
+            pump_stop(z);
+            stopped = true;
+        }
+    }
+    if (doses_running()) {
+        schedule_dose_sample();
+    }
+    if (stopped) {
+        evaluate_watering();
+    }
+}
+
+static void emergency_stop(void) {
+    DLOGW(TAG, "Emergency stop");
+    for (int z = 0; z < zones_count(); z++) {
+        pump_stop(z);
+    }
+}
 
-            int voltage;
-            int value = adc_raw;
+static bool pump_overdue(int64_t now_us) {
+    for (int z = 0; z < zones_count(); z++) {
+        const zone_state_t *s = &zone_states[z];
+        if (s->running && s->deadline_us && s->deadline_us <= now_us) {
+            return true;
+        }
+    }
+    return false;
+}
 
-            if (calibration_enabled) {
-                ESP_ERROR_CHECK(adc_cali_raw_to_voltage(calibration_handles[i], adc_raw, &voltage));
-                ESP_LOGD(TAG, "ADC%d Channel[%d] Cali Voltage: %d mV", ADC_UNIT_1 + 1, sensor_pins[i], voltage);               
-                value = voltage;
+static void pump_deadline(void) {
+    int64_t now_us = hal_time_us();
+    for (int z = 0; z < zones_count(); z++) {
+        const zone_state_t *s = &zone_states[z];
+        if (s->running && s->deadline_us && s->deadline_us <= now_us) {
+            pump_stop(z);
+        }
+    }
+    pump_timer_arm();
+    evaluate_watering();
+}
+
+static void flow_check(void) {
+    // backstop for the pump timer
+    if (pump_overdue(hal_time_us())) {
+        pump_deadline();
+    }
+    if (!pumps_running()) {
+        return;
+    }
+    flow_state_t state = flow_update(hal_pulse_count(), hal_time_us());
+    if (state == FLOW_DRY) {
+        DLOGW(TAG, "No flow, stopping every pump until the relay is switched manually");
+        flow_dry = true;
+        metrics_count(METRIC_DRY_RUNS);
+        publish(SAMPLE_FLOW_DRY, 0, 1);
+        for (int z = 0; z < zones_count(); z++) {
+            // an aborted dose must not teach the gain that the pump moves no water
+            if (zone_states[z].dosing) {
+                zone_states[z].dosing = false;
+                dosing_cancel(z);
             }
+            pump_stop_run(z, false);
+        }
+        return;
+    }
+    if (state == FLOW_FLOWING && !flow_rate_published) {
+        flow_rate_published = true;
+        publish(SAMPLE_FLOW_RATE, 0, flow_rate_ml_h());
+        if (ready_ptr) {
+            ready_ptr();
+        }
+    }
+    flow_check_schedule();
+}
+
+// False if the sensors could not be read: every channel is reported invalid and nothing is watered on old readings
+static bool measure(void) {
+    DLOGD(TAG, "Starting measurement, powering up");
+    int64_t woke_us = hal_time_us();
+    int values[SENSOR_COUNT];
+    acquisition_stats_t acq;
+    esp_err_t ret = acquisition_measure(SENSOR_COUNT, values, &acq);
+    if (ret != ESP_OK) {
+        DLOGE(TAG, "Measurement failed: %d, retrying in %d s", ret, MEASURE_RETRY_S);
+        for (int i = 0; i < SENSOR_COUNT; i++) {
+            last_humidity[i] = CONVERSION_INVALID;
+            publish_at(woke_us, SAMPLE_HUMIDITY, i, CONVERSION_INVALID);
+        }
+        if (ready_ptr) {
+            ready_ptr();
+        }
+        return false;
+    }
+    DLOGD(TAG, "Completed measurement, %lu samples, sensors powered %lu us", (unsigned long)acq.samples, (unsigned long)acq.powered_us);
+
+    int64_t now_us = hal_time_us();
+    metrics_record(METRIC_ACQUISITION, now_us - woke_us);
+    float percent[SENSOR_COUNT];
 
-            if (report_ptr) {
-                float rep = calculate_humidity(value);
-                ESP_LOGD(TAG, "Reporting value %.2f for channel %d", rep, i);
-                report_ptr(rep, i);
+    int16_t humidity[SENSOR_COUNT];
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        humidity[i] = conversion_humidity(i, values[i]);
+        DLOGD(TAG, "ADC1 Channel[%d] code %d, humidity %d.%02d%%", sensor_config[i].adc_channel, values[i], humidity[i] / 100, abs(humidity[i] % 100));
+    }
+    // the decision gets what the health monitor lets through, excluded sensors are reported as invalid
+    uint32_t changed = health_update(values, humidity, last_humidity);
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        // reported and logged as the decision sees it, held back readings stay out as well; stamped with the wakeup
+        // for METRIC_REPORT_DELAY
+        publish_at(woke_us, SAMPLE_HUMIDITY, i, last_humidity[i]);
+        if (changed & (1u << i)) {
+            publish(SAMPLE_SENSOR_FAULTS, i, health_faults(i));
+        }
+    }
+
+    to_percent(last_humidity, percent);
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        schedule_observe(i, now_us, percent[i]);
+    }
+    for (int z = 0; z < zones_count(); z++) {
+        uint32_t learned = dosing_learn(z, percent, now_us);
+        for (int i = 0; i < SENSOR_COUNT; i++) {
+            if (learned & (1u << i)) {
+                publish(SAMPLE_DOSE_GAIN, i, (int32_t)(dosing_get_gain(i) * DOSE_GAIN_SCALE + 0.5f));
             }
-            if (value > 0 && value < min_measured_humidity) { min_measured_humidity = value; }
         }
-        ESP_LOGD(TAG, "Completed measurement");
-        gpio_set_level(SENSOR_POWER_PIN, 0);
+    }
+    if (ready_ptr) {
+        ready_ptr();
+    }
+    return true;
+}
 
-        if (min_measured_humidity < target_min_humidity && minutes_since_last_pump > RELAY_MIN_TIME_BETWEEN_CYCLES_M) {
-            ESP_LOGI(TAG, "Turning pump on");
-            set_relay_state(true);
-            vTaskDelay(pdMS_TO_TICKS(RELAY_ON_TIME_S * 1000));
-            ESP_LOGI(TAG, "Turning pump off");
-            set_relay_state(false);
-            water_consumption_cycles += 1; // RELAY_ON_TIME_S;
-            consumption_ptr(water_consumption_cycles);
-            minutes_since_last_pump = 0;
-        } 
-        
-        vTaskDelay(pdMS_TO_TICKS(interval * 1000));
+// Relay and water commands alike: a stopped pump stays off during its cooldown and while the pump budget is used up,
+// a running one is kept on for at most RELAY_MANUAL_MAX_S in all
+static void manual_water(int zone, uint32_t seconds) {
+    zone_state_t *s = &zone_states[zone];
+    int64_t now_us = hal_time_us();
+    if (!seconds) {
+        pump_stop(zone);
+        return;
+    }
+    if (!s->running && !cooldown_elapsed(zone, now_us)) {
+        DLOGW(TAG, "Zone %d: pump stopped %lu s ago, refused during the cooldown", zone,
+              (unsigned long)((now_us - s->last_end_us) / 1000000));
+        publish(SAMPLE_RELAY, zone, 0);
+        if (ready_ptr) {
+            ready_ptr();
+        }
+        return;
+    }
+    if (!s->running && pumps_running() >= zones_pump_budget()) {
+        DLOGW(TAG, "Zone %d: %d pumps already on, refused over the pump budget", zone, pumps_running());
+        publish(SAMPLE_RELAY, zone, 0);
+        if (ready_ptr) {
+            ready_ptr();
+        }
+        return;
+    }
+    if (flow_dry) {
+        DLOGI(TAG, "Zone %d: switched on manually, automatic watering resumes", zone);
+        flow_dry = false;
+        publish(SAMPLE_FLOW_DRY, 0, 0);
+    }
+    if (seconds > RELAY_MANUAL_MAX_S) {
+        seconds = RELAY_MANUAL_MAX_S;
+    }
+    // taking over a dose keeps the pump running, but without learning from it
+    if (s->dosing) {
+        s->dosing = false;
+        dosing_cancel(zone);
+        dose_release();
+    }
+    if (s->running) {
+        int64_t limit_us = s->started_us + (int64_t)RELAY_MANUAL_MAX_S * 1000000;
+        int64_t deadline_us = now_us + (int64_t)seconds * 1000000;
+        s->deadline_us = deadline_us < limit_us ? deadline_us : limit_us;
+        pump_timer_arm();
+    } else {
+        pump_start(zone, seconds);
+    }
+    if (ready_ptr) {
+        ready_ptr();
+    }
+}
 
-        minutes_since_last_pump += interval / 60.0f;
+static void pause_watering(int zone, uint32_t seconds) {
+    zone_state_t *s = &zone_states[zone];
+    int64_t now_us = hal_time_us();
+    s->paused_until_us = seconds ? now_us + (int64_t)seconds * 1000000 : 0;
+    publish(SAMPLE_PAUSE, zone, seconds);
+    if (!seconds) {
+        DLOGI(TAG, "Zone %d: watering resumed", zone);
+        evaluate_watering();
+    } else if (s->dosing) {
+        DLOGI(TAG, "Zone %d: watering paused for %lu s, stopping the dose", zone, (unsigned long)seconds);
+        pump_stop(zone);
+        evaluate_watering();    // another zone may get the pump budget
+    } else {
+        DLOGI(TAG, "Zone %d: watering paused for %lu s", zone, (unsigned long)seconds);
+    }
+    if (ready_ptr) {
+        ready_ptr();
     }
-    
+}
+
+void driver_handle_event(const hal_event_t *event) {
+    int zone = DRIVER_ARG_ZONE(event->arg);
+    // a stop goes first, whatever woke the task
+    bool stopped = atomic_exchange(&stop_requested, false);
+    if (stopped) {
+        emergency_stop();
+    }
+    if (event->timed) {
+        // the wait for the measure task, what follows switches the relay or powers the sensors right away
+        metrics_record(METRIC_COMMAND_LATENCY, (uint32_t)hal_time_us() - event->posted_us);
+    }
+    switch (event->type) {
+    case DRIVER_EVENT_MEASURE:
+    case DRIVER_EVENT_MEASURE_NOW:
+        if (measure()) {
+            evaluate_watering();
+            schedule_measurement();
+        } else {
+            schedule_measurement_retry();
+        }
+        break;
+    case DRIVER_EVENT_PUMP_OFF:
+        pump_deadline();
+        break;
+    case DRIVER_EVENT_DOSE_SAMPLE:
+        dose_sample();
+        break;
+    case DRIVER_EVENT_FLOW_CHECK:
+        flow_check();
+        break;
+    case DRIVER_EVENT_RELAY:
+        if (zone < zones_count()) {
+            manual_water(zone, DRIVER_ARG_VALUE(event->arg) ? RELAY_MANUAL_MAX_S : 0);
+        }
+        break;
+    case DRIVER_EVENT_WATER:
+        if (zone < zones_count()) {
+            manual_water(zone, DRIVER_ARG_VALUE(event->arg));
+        }
+        break;
+    case DRIVER_EVENT_PAUSE:
+        if (zone < zones_count()) {
+            pause_watering(zone, DRIVER_ARG_VALUE(event->arg));
+        }
+        break;
+    case DRIVER_EVENT_CALIBRATION:
+        // between two readings, so no conversion sees half a table
+        if (conversion_set_points(event->arg, staged_points, staged_count) == ESP_OK) {
+            conversion_build(SENSOR_COUNT, calibration_enabled);
+            DLOGI(TAG, "Sensor %d: %d calibration points applied", (int)event->arg, staged_count);
+        }
+        atomic_store(&calibration_staged, false);
+        break;
+    case DRIVER_EVENT_SETPOINT:
+        if (zone >= zones_count()) {
+            break;
+        }
+        zone_states[zone].target = DRIVER_ARG_VALUE(event->arg);
+        DLOGI(TAG, "Zone %d: target humidity set to %d.%02d%%", zone, (int)(zone_states[zone].target / 100),
+              (int)(zone_states[zone].target % 100));
+        evaluate_watering();
+        if (driver_initialized) {
+            schedule_measurement();     // the planned wakeup was computed for the old target
+        }
+        break;
+    case DRIVER_EVENT_STOP:
+        if (!stopped) {
+            emergency_stop();
+        }
+        break;
+    default:
+        DLOGW(TAG, "Unknown driver event %d", event->type);
+        break;
+    }
+}
+
+static void measure_task(void *pvParameters) {
+    hal_event_t event;
+
+    while (true) {
+        if (hal_event_wait(&event)) {
+            driver_handle_event(&event);
+        }
+    }
+
 }
 
 esp_err_t init_driver_immediate() {
-    gpio_config_t io_conf = {};
-    io_conf.intr_type = GPIO_INTR_DISABLE;
-    io_conf.mode = GPIO_MODE_OUTPUT;
-    io_conf.pin_bit_mask = ((1ULL<<SENSOR_POWER_PIN) | (1ULL<<RELAY_PIN));
-    io_conf.pull_down_en = 0;
-    io_conf.pull_up_en = 0;
-    gpio_config(&io_conf);
+    uint64_t outputs = 1ULL << SENSOR_POWER_PIN;
+    for (int z = 0; z < zones_count(); z++) {
+        outputs |= 1ULL << zones_get(z)->relay_pin;
+    }
+    hal_gpio_init_outputs(outputs);
 
-    gpio_set_direction(RELAY_PIN, GPIO_MODE_INPUT_OUTPUT);
-    gpio_set_direction(SENSOR_POWER_PIN, GPIO_MODE_INPUT_OUTPUT);
+    hal_gpio_set_level(SENSOR_POWER_PIN, 0);
+    for (int z = 0; z < zones_count(); z++) {
+        set_relay_state(z, false);
+        zone_states[z].target = (int32_t)(DEFAULT_MIN_HUMIDITY * 100);
+    }
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        last_humidity[i] = CONVERSION_INVALID;  // nothing is watered before the first measurement
+    }
+    health_init();
+    return hal_events_init(DRIVER_TIMER_COUNT);
+}
 
-    gpio_set_level(SENSOR_POWER_PIN, 0);
-    set_relay_state(false);
-    return ESP_OK;
+void driver_restore(int zone, int32_t target, uint32_t pump_total_s) {
+    if (zone >= 0 && zone < zones_count()) {
+        zone_states[zone].target = target;
+    }
+    pump_total_us = (int64_t)pump_total_s * 1000000;
 }
 
-esp_err_t init_driver(int interval_s, esp_humidity_sensor_callback_t cb, esp_water_consumption_callback_t water_cb) {
+esp_err_t init_driver(int interval_s, esp_samples_ready_callback_t ready_cb) {
 
-    report_ptr = cb;
-    consumption_ptr = water_cb;
-    interval = interval_s;
+    ready_ptr = ready_cb;
+    schedule_configure(SCHEDULE_MIN_INTERVAL_S, SCHEDULE_MAX_INTERVAL_S, interval_s);
     ESP_LOGI(TAG, "Driver init");
 
     if (driver_initialized) {
@@ -147,29 +666,75 @@ esp_err_t init_driver(int interval_s, esp_humidity_sensor_callback_t cb, esp_wat
 
     driver_initialized = true;
 
-    adc_oneshot_unit_init_cfg_t init_config1 = {
-        .unit_id = ADC_UNIT_1,
-    };
-    ESP_ERROR_CHECK(adc_oneshot_new_unit(&init_config1, &adc1_handle));
+    int channels[SENSOR_COUNT];
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        channels[i] = sensor_config[i].adc_channel;
+    }
+    calibration_enabled = hal_adc_init(channels, SENSOR_COUNT);
+    conversion_build(SENSOR_COUNT, calibration_enabled);
+#ifdef FLOW_METER_PIN
+    flow_metered = hal_pulse_init(FLOW_METER_PIN, FLOW_GLITCH_NS) == ESP_OK;
+    if (!flow_metered) {
+        ESP_LOGW(TAG, "Flow meter unavailable, no volume metering or dry-run cutoff");
+    }
+#endif
+#ifdef CONVERSION_BENCHMARK
+    conversion_benchmark_t bench;
+    conversion_benchmark(0, 4, &bench);
+    ESP_LOGI(TAG, "Conversion: table %lu, float %lu cycles/reading, max difference %ld/100 %%, %lu validity mismatches",
+             (unsigned long)(bench.table_cycles / bench.conversions), (unsigned long)(bench.float_cycles / bench.conversions),
+             (long)bench.max_error, (unsigned long)bench.validity_mismatches);
+#endif
+#ifdef METRICS_BENCHMARK
+    metrics_benchmark_t metrics_bench;
+    metrics_benchmark(10000, &metrics_bench);
+    ESP_LOGI(TAG, "Metrics: %lu cycles/record", (unsigned long)(metrics_bench.cycles / metrics_bench.records));
+#endif
+
+    ESP_LOGI(TAG, "Calibration %s, %d zones, up to %d pumps at once", calibration_enabled ? "Enabled" : "Disabled",
+             zones_count(), zones_pump_budget());
+
+    post_event(DRIVER_EVENT_MEASURE, 0, false);
+    return hal_task_create(measure_task, "Measure_main", MEASURE_TASK_STACK_SIZE, MEASURE_TASK_PRIORITY);
+}
+
+void driver_set_relay(int zone, bool on) {
+    post_command(DRIVER_EVENT_RELAY, DRIVER_ZONE_ARG(zone, on), !on);    // switching off jumps the queue like an emergency stop
+}
 
-    adc_oneshot_chan_cfg_t config = {
-        .bitwidth = ADC_BITWIDTH_DEFAULT,
-        .atten = ATTN,
-    };
+void driver_emergency_stop(void) {
+    atomic_store(&stop_requested, true);    // the event may not fit in a full queue, the flag always does
+    post_command(DRIVER_EVENT_STOP, 0, true);
+}
 
-    for (int i = 0 ; i < SENSOR_COUNT; i++) {
-        calibration_enabled &= adc_calibration_init(ADC_UNIT_1, sensor_pins[0], ATTN, &calibration_handles[i]);
+esp_err_t driver_set_calibration(int sensor, const calibration_point_t *points, int count) {
+    if (sensor < 0 || sensor >= SENSOR_COUNT || conversion_check_points(points, count) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (atomic_exchange(&calibration_staged, true)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memcpy(staged_points, points, count * sizeof(points[0]));
+    staged_count = count;
+    esp_err_t ret = post_event(DRIVER_EVENT_CALIBRATION, sensor, false);
+    if (ret != ESP_OK) {
+        atomic_store(&calibration_staged, false);
     }
+    return ret;
+}
 
-    ESP_LOGI(TAG, "Calibration %s", calibration_enabled ? "Enabled" : "Disabled");
+void set_min_humidity(int zone, float value) {
+    post_event(DRIVER_EVENT_SETPOINT, DRIVER_ZONE_ARG(zone, (int32_t)(value * 100 + 0.5f)), false);
+}
 
-    for (int i = 0; i < SENSOR_COUNT; i++) {    
-        ESP_ERROR_CHECK(adc_oneshot_config_channel(adc1_handle, sensor_pins[i], &config));
-    }
+void driver_measure_now(void) {
+    post_command(DRIVER_EVENT_MEASURE_NOW, 0, true);
+}
 
-    return (xTaskCreate(measure_task, "Measure_main", 8192, NULL, 10, NULL) == true) ? ESP_OK : ESP_FAIL;
+void driver_water(int zone, uint32_t seconds) {
+    post_command(DRIVER_EVENT_WATER, DRIVER_ZONE_ARG(zone, seconds > RELAY_MANUAL_MAX_S ? RELAY_MANUAL_MAX_S : seconds), true);
 }
 
-void set_min_humidity(float value) {
-    target_min_humidity = value;
-}
\ No newline at end of file
+void driver_pause(int zone, uint32_t seconds) {
+    post_command(DRIVER_EVENT_PAUSE, DRIVER_ZONE_ARG(zone, seconds > DRIVER_ARG_VALUE_MAX ? DRIVER_ARG_VALUE_MAX : seconds), false);
+}
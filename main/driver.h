@@ -1,13 +1,18 @@
+#pragma once
+
 #include "driver/gpio.h"
 #include "soc/adc_channel.h"
+#include "hal.h"
 
-#define RELAY_PIN GPIO_NUM_4
-#define RELAY_ON_TIME_S 10
-#define RELAY_MIN_TIME_BETWEEN_CYCLES_M 3
+#define RELAY_PIN GPIO_NUM_4                 // first zone, see zones.c for the others
+#define RELAY_MIN_TIME_BETWEEN_CYCLES_M 3   // default zone cooldown
+#define RELAY_MANUAL_MAX_S 300              // manual relay and water commands switch off after this at the latest
 
 #define SENSOR_POWER_PIN GPIO_NUM_0
+#define FLOW_METER_PIN GPIO_NUM_10          // flow meter pulse output (flow.h), comment out without a meter
 
-#define SENSOR_POWER_UP_TIME_MS 100
+#define SENSOR_POWER_UP_TIME_MS 100 // upper bound, acquisition cuts power as soon as readings settle
+#define MEASURE_RETRY_S 60          // a measurement the ADC failed is tried again after this
 
 #define SENSOR_COUNT 2
 
@@ -16,10 +21,59 @@
 
 #define DEFAULT_MIN_HUMIDITY 40.0f
 
-typedef void (*esp_humidity_sensor_callback_t)(float temperature, int device);
-typedef void (*esp_water_consumption_callback_t)(uint32_t seconds);
+// #define CONVERSION_BENCHMARK    // log table vs float conversion cycle counts at start-up
+// #define METRICS_BENCHMARK       // log the cycle cost of recording a metric at start-up
+// #define BENCHMARK_SUITE         // benchmark build: print the hot path benchmarks (benchmark.h) instead of joining
+
+// Everything the measure task does is triggered by one of these, either from a timer or from another task
+typedef enum {
+    DRIVER_EVENT_MEASURE,       // acquire all sensors, report and decide on watering
+    DRIVER_EVENT_PUMP_OFF,      // watering time of at least one zone is over
+    DRIVER_EVENT_DOSE_SAMPLE,   // sample the held sensors while doses are running
+    DRIVER_EVENT_FLOW_CHECK,    // integrate the flow meter and check for a dry run while pumps are running
+    // from other tasks from here on; relay, stop, measure now, water and pause are commands, timed in
+    // METRIC_COMMAND_LATENCY, setpoints are configuration and not timed
+    DRIVER_EVENT_RELAY,         // manual relay command, DRIVER_ZONE_ARG(zone, requested state)
+    DRIVER_EVENT_SETPOINT,      // new target humidity, DRIVER_ZONE_ARG(zone, 1/100 %)
+    DRIVER_EVENT_STOP,          // cut every pump immediately
+    DRIVER_EVENT_MEASURE_NOW,   // like DRIVER_EVENT_MEASURE, ahead of the schedule
+    DRIVER_EVENT_WATER,         // run a zone's pump, DRIVER_ZONE_ARG(zone, seconds)
+    DRIVER_EVENT_PAUSE,         // no automatic watering of a zone, DRIVER_ZONE_ARG(zone, seconds), 0 resumes
+    DRIVER_EVENT_CALIBRATION,   // new calibration points of a sensor, arg the sensor, points staged by the poster
+} driver_event_type_t;
+
+// Zone events carry the zone in the top byte of the argument
+#define DRIVER_ZONE_ARG(zone, value)    ((int32_t)(((uint32_t)(zone) << 24) | ((uint32_t)(value) & 0xFFFFFF)))
+#define DRIVER_ARG_ZONE(arg)            ((int)((uint32_t)(arg) >> 24))
+#define DRIVER_ARG_VALUE(arg)           ((int32_t)((uint32_t)(arg) & 0xFFFFFF))
+#define DRIVER_ARG_VALUE_MAX            0xFFFFFF
+
+typedef enum {
+    DRIVER_TIMER_MEASURE,
+    DRIVER_TIMER_PUMP,
+    DRIVER_TIMER_DOSE,
+    DRIVER_TIMER_FLOW,
+    DRIVER_TIMER_COUNT
+} driver_timer_t;
+
+// Called on the measure task once a batch of samples has been pushed to sample_queue
+typedef void (*esp_samples_ready_callback_t)(void);
 
 esp_err_t init_driver_immediate();
-esp_err_t init_driver(int interval_s, esp_humidity_sensor_callback_t cb, esp_water_consumption_callback_t water_cb);
-esp_err_t set_relay_state(bool on);
-void set_min_humidity(float value);
\ No newline at end of file
+// Persisted state of a zone (target in 1/100 %) and the pump seconds so far, between init_driver_immediate and init_driver
+void driver_restore(int zone, int32_t target, uint32_t pump_total_s);
+esp_err_t init_driver(int interval_s, esp_samples_ready_callback_t ready_cb);
+// Runs a single event on the calling task, measure_task uses it for everything it receives
+void driver_handle_event(const hal_event_t *event);
+// The following are safe to call from any task, they are queued to the measure task
+void driver_set_relay(int zone, bool on);
+void driver_emergency_stop(void);
+void set_min_humidity(int zone, float value);
+void driver_measure_now(void);
+// Manual watering: capped at RELAY_MANUAL_MAX_S and refused while the zone's cooldown runs
+void driver_water(int zone, uint32_t seconds);
+void driver_pause(int zone, uint32_t seconds);
+// Checks the points (conversion_check_points) and has the measure task rebuild the sensor's conversion table with
+// them. One at a time: ESP_ERR_INVALID_STATE while the previous one is still queued.
+struct calibration_point;
+esp_err_t driver_set_calibration(int sensor, const struct calibration_point *points, int count);
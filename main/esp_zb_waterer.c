@@ -1,48 +1,383 @@
 #include "string.h"
+#include <stdatomic.h>
+#include <stdint.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "ha/esp_zigbee_ha_standard.h"
 #include "esp_zb_waterer.h"
 #include "esp_zigbee_type.h"
 #include "esp_check.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 #include "driver.h"
+#include "reporting.h"
+#include "settings.h"
+#include "sample_queue.h"
+#include "history.h"
+#include "history_cluster.h"
+#include "control_cluster.h"
+#include "dosing.h"
+#include "flow.h"
+#include "conversion.h"
+#include "zones.h"
+#include "ota.h"
+#include "metrics.h"
+#include "metrics_cluster.h"
+#include "dlog.h"
+#include "benchmark.h"
+#include "hal.h"
+#include "task_config.h"
 
 static const char *TAG = "MAIN";
-int meas_endpoints[] = {HA_ESP_SENSOR_1_ENDPOINT, HA_ESP_SENSOR_2_ENDPOINT, HA_ESP_SENSOR_3_ENDPOINT};
 
-static int target_cluster_id = 0;
+static control_state_t control_state;
+static control_state_t saved_control_state;
+static bool control_commit_pending;
+static atomic_bool zigbee_running;     /* the measure task keeps its samples queued until the stack is up */
+static SemaphoreHandle_t log_ready;    /* given by the measure task after each batch, Log_main drains on it */
+#ifdef HAL_STATIC_ALLOCATION
+static StaticSemaphore_t log_ready_buffer;
+#endif
 
 static void bdb_start_top_level_commissioning_cb(uint8_t mode_mask)
 {
     ESP_ERROR_CHECK(esp_zb_bdb_start_top_level_commissioning(mode_mask));
 }
 
-static void esp_app_water_consumption_handler(uint16_t value) {
-    esp_zb_lock_acquire(portMAX_DELAY);
-    ESP_LOGI(TAG, "Reporting water consumption - %d cycles", value);
-    esp_zb_zcl_set_attribute_val(HA_CONSUMPTION_SENSOR_ENDPOINT,
-        ESP_ZB_ZCL_CLUSTER_ID_TEMP_MEASUREMENT, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
-        ESP_ZB_ZCL_ATTR_TEMP_MEASUREMENT_VALUE_ID, &value, false);
-    esp_zb_lock_release();
+static int reporting_channel_endpoint(int channel)
+{
+    return channel == REPORT_CHANNEL_CONSUMPTION ? HA_CONSUMPTION_SENSOR_ENDPOINT : sensor_config[channel].endpoint;
+}
+
+/* Mirrors the policy into the stack's own reporting configuration, must be called with the Zigbee lock held */
+static void reporting_config_apply(int channel)
+{
+    const report_policy_t *policy = reporting_get_policy(channel);
+    bool consumption = channel == REPORT_CHANNEL_CONSUMPTION;
+    esp_zb_zcl_reporting_info_t reporting_info = {
+        .direction = ESP_ZB_ZCL_CMD_DIRECTION_TO_SRV,
+        .ep = reporting_channel_endpoint(channel),
+        .cluster_id = consumption ? ESP_ZB_ZCL_CLUSTER_ID_TEMP_MEASUREMENT : ESP_ZB_ZCL_CLUSTER_ID_REL_HUMIDITY_MEASUREMENT,
+        .cluster_role = ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+        .dst.profile_id = ESP_ZB_AF_HA_PROFILE_ID,
+        .u.send_info.min_interval = policy->min_interval_s,
+        .u.send_info.max_interval = policy->max_interval_s,
+        .u.send_info.def_min_interval = policy->min_interval_s,
+        .u.send_info.def_max_interval = policy->max_interval_s,
+        .u.send_info.delta.u16 = policy->reportable_change,
+        .attr_id = consumption ? ESP_ZB_ZCL_ATTR_TEMP_MEASUREMENT_VALUE_ID : ESP_ZB_ZCL_ATTR_REL_HUMIDITY_MEASUREMENT_VALUE_ID,
+        .manuf_code = ESP_ZB_ZCL_ATTR_NON_MANUFACTURER_SPECIFIC,
+    };
+    esp_zb_zcl_update_reporting_info(&reporting_info);
+}
+
+static void dose_gains_load(void)
+{
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        int32_t gain;
+        if (settings_load_dose_gain(i, &gain) == ESP_OK) {
+            dosing_set_gain(i, (float)gain / DOSE_GAIN_SCALE);
+        }
+    }
+}
+
+/* Sensor calibration points must be in place before the driver builds its conversion tables */
+static void calibration_load(void)
+{
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        calibration_point_t points[CONVERSION_MAX_POINTS];
+        int count = CONVERSION_MAX_POINTS;
+        if (settings_load_calibration(i, points, &count) == ESP_OK && conversion_set_points(i, points, count) != ESP_OK) {
+            ESP_LOGW(TAG, "Ignoring invalid calibration of sensor %d (%d points)", i, count);
+        }
+    }
+}
+
+static void reporting_config_load(void)
+{
+    reporting_init();
+    for (int i = 0; i < REPORT_CHANNEL_COUNT; i++) {
+        report_policy_t policy;
+        if (settings_load_report_policy(i, &policy) == ESP_OK) {
+            reporting_set_policy(i, &policy);
+        }
+    }
+}
+
+/* Publishes the sent/suppressed counters of a channel, must be called with the Zigbee lock held */
+static void reporting_counters_update(int channel)
+{
+    const report_counters_t *counters = reporting_get_counters(channel);
+    uint32_t sent = counters->sent;
+    uint32_t suppressed = counters->suppressed;
+    int endpoint = reporting_channel_endpoint(channel);
+    esp_zb_zcl_set_attribute_val(endpoint, REPORTING_CONFIG_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+        REPORTING_CONFIG_SENT_ATTR_ID, &sent, false);
+    esp_zb_zcl_set_attribute_val(endpoint, REPORTING_CONFIG_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+        REPORTING_CONFIG_SUPPRESSED_ATTR_ID, &suppressed, false);
+}
+
+/* Runs on the Zigbee task, one NVS write for everything that changed since the first change */
+static void control_state_commit(uint8_t param)
+{
+    control_commit_pending = false;
+    if (memcmp(&control_state, &saved_control_state, sizeof(control_state)) &&
+        settings_save_control_state(&control_state) == ESP_OK) {
+        saved_control_state = control_state;
+        ESP_LOGI(TAG, "Control state saved");
+    }
+}
+
+static void control_state_changed(void)
+{
+    if (!control_commit_pending) {
+        control_commit_pending = true;
+        esp_zb_scheduler_alarm(control_state_commit, 0, SETTINGS_COMMIT_DELAY_S * 1000);
+    }
+}
+
+/* Before the driver starts, so watering carries on from the persisted state whether or not the network is there */
+static void control_state_load(void)
+{
+    control_state_t loaded;
+    esp_err_t ret = settings_load_control_state(&loaded);
+    control_state = (control_state_t) { .version = SETTINGS_CONTROL_VERSION };
+    for (int z = 0; z < ZONE_MAX; z++) {
+        control_state.target[z] = (int32_t)(DEFAULT_MIN_HUMIDITY * 100);
+    }
+    if (ret == ESP_OK) {
+        control_state = loaded;
+    } else {
+        ESP_LOGI(TAG, "No control state restored (%s), using defaults", esp_err_to_name(ret));
+    }
+    saved_control_state = control_state;
+    flow_restore(control_state.volume_ml);
+    for (int z = 0; z < zones_count(); z++) {
+        driver_restore(z, control_state.target[z], control_state.pump_total_s);
+    }
+}
+
+/* Writes a reporting channel's MeasuredValue, the stack reports it from there */
+static void reporting_attribute_set(int channel, int32_t value)
+{
+    if (channel == REPORT_CHANNEL_CONSUMPTION) {
+        int16_t total_s = value;
+        ESP_LOGI(TAG, "Reporting water consumption - %d pump seconds", total_s);
+        esp_zb_zcl_set_attribute_val(HA_CONSUMPTION_SENSOR_ENDPOINT,
+            ESP_ZB_ZCL_CLUSTER_ID_TEMP_MEASUREMENT, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+            ESP_ZB_ZCL_ATTR_TEMP_MEASUREMENT_VALUE_ID, &total_s, false);
+    } else {
+        uint16_t humidity = value == CONVERSION_INVALID ? HUMIDITY_MEASURED_VALUE_UNKNOWN : value;
+        esp_zb_zcl_set_attribute_val(sensor_config[channel].endpoint,
+            ESP_ZB_ZCL_CLUSTER_ID_REL_HUMIDITY_MEASUREMENT, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+            ESP_ZB_ZCL_ATTR_REL_HUMIDITY_MEASUREMENT_VALUE_ID, &humidity, false);
+    }
+}
+
+static uint32_t reporting_flush_scheduled;     /* bit per channel with an alarm for its pending change */
+
+static uint32_t reporting_flush_delay_ms(int channel)
+{
+    int64_t delay_us = reporting_pending_us(channel) - esp_timer_get_time();
+    return delay_us > 0 ? (delay_us + 999) / 1000 : 0;
+}
+
+/* Zigbee task alarm: sends the change min_interval_s held back, unless a later value made it moot */
+static void reporting_flush(uint8_t channel)
+{
+    int32_t value;
+    if (reporting_take_pending(channel, esp_timer_get_time(), &value)) {
+        reporting_attribute_set(channel, value);
+        reporting_counters_update(channel);
+    }
+    if (reporting_pending_us(channel)) {
+        esp_zb_scheduler_alarm(reporting_flush, channel, reporting_flush_delay_ms(channel));
+    } else {
+        reporting_flush_scheduled &= ~(1u << channel);
+    }
+}
+
+static void reporting_flush_schedule(int channel)
+{
+    if (!reporting_pending_us(channel) || (reporting_flush_scheduled & (1u << channel))) {
+        return;
+    }
+    reporting_flush_scheduled |= 1u << channel;
+    esp_zb_scheduler_alarm(reporting_flush, channel, reporting_flush_delay_ms(channel));
+}
+
+static void reporting_update(int channel, int32_t value, int64_t time_us)
+{
+    if (reporting_filter(channel, value, time_us)) {
+        reporting_attribute_set(channel, value);
+    } else {
+        reporting_flush_schedule(channel);
+    }
+    reporting_counters_update(channel);
+}
+
+// MeasuredValue is an int16, the total stays at INT16_MAX pump seconds (about 9 h) once it gets there
+static void esp_app_water_consumption_report(int32_t total_s, int64_t time_us)
+{
+    reporting_update(REPORT_CHANNEL_CONSUMPTION, total_s < INT16_MAX ? total_s : INT16_MAX, time_us);
+}
+
+static void esp_app_flow_report(const sample_t *sample)
+{
+    switch (sample->kind) {
+    case SAMPLE_FLOW_VOLUME: {
+        esp_zb_uint48_t summation = { .low = (uint32_t)sample->value, .high = 0 };
+        ESP_LOGI(TAG, "Reporting metered water - %ld ml", (long)sample->value);
+        esp_zb_zcl_set_attribute_val(HA_FLOW_METER_ENDPOINT, ESP_ZB_ZCL_CLUSTER_ID_METERING, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+            ESP_ZB_ZCL_ATTR_METERING_CURRENT_SUMMATION_DELIVERED_ID, &summation, false);
+        control_state.volume_ml = sample->value;
+        control_state_changed();
+        break;
+    }
+    case SAMPLE_FLOW_RATE: {
+        esp_zb_int24_t demand = { .low = (uint16_t)sample->value, .high = (int8_t)(sample->value >> 16) };
+        esp_zb_zcl_set_attribute_val(HA_FLOW_METER_ENDPOINT, ESP_ZB_ZCL_CLUSTER_ID_METERING, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+            ESP_ZB_ZCL_ATTR_METERING_INSTANTANEOUS_DEMAND_ID, &demand, false);
+        break;
+    }
+    case SAMPLE_FLOW_DRY: {
+        uint8_t status = sample->value ? FLOW_METERING_STATUS_PIPE_EMPTY : 0;
+        esp_zb_zcl_set_attribute_val(HA_FLOW_METER_ENDPOINT, ESP_ZB_ZCL_CLUSTER_ID_METERING, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+            ESP_ZB_ZCL_ATTR_METERING_STATUS_ID, &status, false);
+        break;
+    }
+    }
+}
+
+static void esp_app_humidity_report(int16_t measured_value, int sensor_num, int64_t time_us)
+{
+    reporting_update(sensor_num, measured_value, time_us);
+}
+
+static void esp_app_sensor_faults_report(int sensor_num, uint8_t faults)
+{
+    ESP_LOGW(TAG, "Sensor %d health flags 0x%02x", sensor_num, faults);
+    esp_zb_zcl_set_attribute_val(sensor_config[sensor_num].endpoint, SENSOR_HEALTH_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+        SENSOR_HEALTH_FAULTS_ATTR_ID, &faults, false);
+}
+
+/* Keeps the On/Off attribute in line with the pump, which also stops on its own or refuses to start */
+static void esp_app_relay_report(int zone, bool on)
+{
+#ifdef EXPOSE_RELAY_INPUT
+    uint8_t endpoint = zones_get(zone)->relay_endpoint;
+    if (endpoint) {
+        esp_zb_zcl_set_attribute_val(endpoint, ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+            ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID, &on, false);
+    }
+#endif
+}
+
+/* Deferred log records of the measure task, printed in the usual console format */
+static void esp_app_log_print(esp_log_level_t level, const char *tag, int64_t time_ms, const char *message)
+{
+    static const char letters[] = "NEWIDV";
+    esp_log_write(level, tag, "%c (%lu) %s: %s\n", letters[level], (unsigned long)time_ms, tag, message);
 }
 
-static void esp_app_humidity_sensor_handler(float humidity, int sensor_num)
+/* Formats the measure task's log off the Zigbee task, the printf stack is Log_main's (task_config.h) */
+static void esp_app_log_task(void *pvParameters)
 {
-    int endpoint = meas_endpoints[sensor_num];
-    int16_t measured_value = (int16_t)(100 * humidity);
-    esp_zb_lock_acquire(portMAX_DELAY);
-    esp_zb_zcl_set_attribute_val(endpoint,
-        ESP_ZB_ZCL_CLUSTER_ID_REL_HUMIDITY_MEASUREMENT, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
-        ESP_ZB_ZCL_ATTR_REL_HUMIDITY_MEASUREMENT_VALUE_ID, &measured_value, false);
+    while (true) {
+        xSemaphoreTake(log_ready, portMAX_DELAY);
+        dlog_drain(esp_app_log_print);
+    }
+}
+
+/* Runs on the Zigbee task, empties the sample queue */
+static void esp_app_samples_drain(uint8_t param)
+{
+    sample_t sample;
+    uint32_t batch = 0;
+    while (sample_queue_pop(&sample)) {
+        history_append_sample(&sample);
+        switch (sample.kind) {
+        case SAMPLE_HUMIDITY:
+            esp_app_humidity_report((int16_t)sample.value, sample.channel, sample.time_us);
+            metrics_record(METRIC_REPORT_DELAY, esp_timer_get_time() - sample.time_us);
+            break;
+        case SAMPLE_CONSUMPTION:
+            esp_app_water_consumption_report(sample.value, sample.time_us);
+            control_state.pump_total_s = sample.value;
+            control_state_changed();
+            break;
+        case SAMPLE_PUMP:   /* history only */
+            break;
+        case SAMPLE_DOSE_GAIN:
+            settings_save_dose_gain(sample.channel, sample.value);
+            break;
+        case SAMPLE_FLOW_VOLUME:
+        case SAMPLE_FLOW_RATE:
+        case SAMPLE_FLOW_DRY:
+            esp_app_flow_report(&sample);
+            break;
+        case SAMPLE_SENSOR_FAULTS:
+            esp_app_sensor_faults_report(sample.channel, (uint8_t)sample.value);
+            break;
+        case SAMPLE_RELAY:
+            esp_app_relay_report(sample.channel, sample.value);
+            break;
+        case SAMPLE_PAUSE:
+            control_cluster_paused(sample.channel, sample.time_us, sample.value);
+            break;
+        }
+        batch++;
+    }
+    history_cluster_update();
+    metrics_cluster_update();
+    ESP_LOGD(TAG, "Drained %lu samples", (unsigned long)batch);
+}
+
+/* Called on the measure task: wakes Log_main, and a short lock acquisition schedules the drain on the Zigbee task */
+static void esp_app_samples_ready(void)
+{
+    xSemaphoreGive(log_ready);
+    if (!atomic_load(&zigbee_running)) {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    if (!esp_zb_lock_acquire(pdMS_TO_TICKS(SAMPLE_FLUSH_LOCK_TIMEOUT_MS))) {
+        metrics_count(METRIC_LOCK_TIMEOUTS);
+        ESP_LOGW(TAG, "Zigbee lock busy, %lu samples left queued", (unsigned long)sample_queue_depth());
+        return;
+    }
+    uint32_t waited_us = esp_timer_get_time() - start;
+    esp_zb_scheduler_alarm(esp_app_samples_drain, 0, 0);
     esp_zb_lock_release();
+
+    uint32_t previous_max_us = metrics_histogram(METRIC_LOCK_WAIT)->max;
+    metrics_record(METRIC_LOCK_WAIT, waited_us);
+    if (waited_us > previous_max_us) {
+        const sample_queue_stats_t *queue = sample_queue_stats();
+        ESP_LOGI(TAG, "New max Zigbee lock wait %lu us (p90 %lu us, queue max depth %lu, dropped %lu)",
+                 (unsigned long)waited_us, (unsigned long)metrics_percentile(METRIC_LOCK_WAIT, 90),
+                 (unsigned long)queue->max_depth, (unsigned long)queue->dropped);
+    }
 }
 
-static esp_err_t deferred_driver_init(void)
+static esp_err_t esp_zb_power_save_init(void)
 {
-    init_driver(MEASUREMENT_INTERVAL_S, &esp_app_humidity_sensor_handler, &esp_app_water_consumption_handler);
-    return ESP_OK;
+    esp_err_t rc = ESP_OK;
+#if defined(SLEEPY_END_DEVICE) && defined(CONFIG_PM_ENABLE)
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true
+#endif
+    };
+    rc = esp_pm_configure(&pm_config);
+#endif
+    return rc;
 }
 
 void esp_zb_app_signal_handler(esp_zb_app_signal_t *signal_struct)
@@ -53,18 +388,21 @@ void esp_zb_app_signal_handler(esp_zb_app_signal_t *signal_struct)
     switch (sig_type) {
     case ESP_ZB_ZDO_SIGNAL_SKIP_STARTUP:
         ESP_LOGI(TAG, "Initialize Zigbee stack");
+        /* the driver has been running since boot, pick up whatever it measured meanwhile */
+        atomic_store(&zigbee_running, true);
+        esp_zb_scheduler_alarm(esp_app_samples_drain, 0, 0);
         esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_INITIALIZATION);
         break;
     case ESP_ZB_BDB_SIGNAL_DEVICE_FIRST_START:
     case ESP_ZB_BDB_SIGNAL_DEVICE_REBOOT:
         if (err_status == ESP_OK) {
-            ESP_LOGI(TAG, "Deferred driver initialization %s", deferred_driver_init() ? "failed" : "successful");
             ESP_LOGI(TAG, "Device started up in %s factory-reset mode", esp_zb_bdb_is_factory_new() ? "" : "non");
             if (esp_zb_bdb_is_factory_new()) {
                 ESP_LOGI(TAG, "Start network steering");
                 esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_NETWORK_STEERING);
             } else {
                 ESP_LOGI(TAG, "Device rebooted");
+                ota_confirm_image();
             }
         } else {
             /* commissioning failed */
@@ -79,11 +417,18 @@ void esp_zb_app_signal_handler(esp_zb_app_signal_t *signal_struct)
                      extended_pan_id[7], extended_pan_id[6], extended_pan_id[5], extended_pan_id[4],
                      extended_pan_id[3], extended_pan_id[2], extended_pan_id[1], extended_pan_id[0],
                      esp_zb_get_pan_id(), esp_zb_get_current_channel(), esp_zb_get_short_address());
+            ota_confirm_image();
         } else {
             ESP_LOGI(TAG, "Network steering was not successful (status: %s)", esp_err_to_name(err_status));
             esp_zb_scheduler_alarm((esp_zb_callback_t)bdb_start_top_level_commissioning_cb, ESP_ZB_BDB_MODE_NETWORK_STEERING, 1000);
         }
         break;
+#ifdef SLEEPY_END_DEVICE
+    case ESP_ZB_COMMON_SIGNAL_CAN_SLEEP:
+        ESP_LOGD(TAG, "Zigbee can sleep");
+        esp_zb_sleep_now();
+        break;
+#endif
     default:
         ESP_LOGI(TAG, "ZDO signal: %s (0x%x), status: %s", esp_zb_zdo_signal_to_string(sig_type), sig_type,
                  esp_err_to_name(err_status));
@@ -91,47 +436,66 @@ void esp_zb_app_signal_handler(esp_zb_app_signal_t *signal_struct)
     }
 }
 
-static esp_err_t zb_attribute_handler(const esp_zb_zcl_set_attr_value_message_t *message)
+/****** ATTRIBUTE WRITES AND COMMANDS, routed by the device description below */
+
+static esp_err_t setpoint_write(int zone, const esp_zb_zcl_attribute_t *attribute)
 {
-    esp_err_t ret = ESP_OK;
+    float new_value = *(float *)attribute->data.value;
+    ESP_LOGI(TAG, "Got new target humidity value for zone %d - %0.2f", zone, new_value);
+    set_min_humidity(zone, new_value);
+    control_state.target[zone] = (int32_t)(new_value * 100 + 0.5f);
+    control_state_changed();
+    return ESP_OK;
+}
 
-    ESP_RETURN_ON_FALSE(message, ESP_FAIL, TAG, "Empty message");
-    ESP_RETURN_ON_FALSE(message->info.status == ESP_ZB_ZCL_STATUS_SUCCESS, ESP_ERR_INVALID_ARG, TAG, "Received message: error status(%d)",
-                        message->info.status);
-    ESP_LOGI(TAG, "Received message: endpoint(%d), cluster(0x%x), attribute(0x%x), data size(%d), type(0x%x)", message->info.dst_endpoint, message->info.cluster,
-             message->attribute.id, message->attribute.data.size, message->attribute.data.type);
-    if (message->info.dst_endpoint == HA_TARGET_HUMIDITY_ENDPOINT) {
-        if (message->info.cluster == ESP_ZB_ZCL_CLUSTER_ID_ANALOG_OUTPUT) {
-            if (message->attribute.id == ESP_ZB_ZCL_ATTR_ANALOG_OUTPUT_PRESENT_VALUE_ID) {
-                float new_value = *(float *)message->attribute.data.value;
-                ESP_LOGI(TAG, "Got new target humidity value - %0.2f", new_value);
-                set_min_humidity(new_value);
-            }
-        }
-    }
-    if (message->info.dst_endpoint == HA_ONOFF_SWITCH_ENDPOINT) {
-        if (message->info.cluster == ESP_ZB_ZCL_CLUSTER_ID_ON_OFF) {
-            if (message->attribute.id == ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID && message->attribute.data.type == ESP_ZB_ZCL_ATTR_TYPE_BOOL) {
-                bool light_state = message->attribute.data.value ? *(bool *)message->attribute.data.value : false;
-                set_relay_state(light_state);
-            }
-        }
+static esp_err_t reporting_config_write(int channel, const esp_zb_zcl_attribute_t *attribute)
+{
+    report_policy_t policy = *reporting_get_policy(channel);
+    uint16_t value = *(uint16_t *)attribute->data.value;
+    switch (attribute->id) {
+    case REPORTING_CONFIG_MIN_INTERVAL_ATTR_ID: policy.min_interval_s = value; break;
+    case REPORTING_CONFIG_MAX_INTERVAL_ATTR_ID: policy.max_interval_s = value; break;
+    case REPORTING_CONFIG_CHANGE_ATTR_ID: policy.reportable_change = value; break;
+    default: return ESP_OK;
     }
-    return ret;
+    ESP_LOGI(TAG, "Reporting policy for endpoint %d: min %u s, max %u s, change %u", reporting_channel_endpoint(channel),
+             policy.min_interval_s, policy.max_interval_s, policy.reportable_change);
+    reporting_set_policy(channel, &policy);
+    reporting_config_apply(channel);
+    settings_save_report_policy(channel, &policy);
+    return ESP_OK;
 }
 
-static esp_err_t zb_action_handler(esp_zb_core_action_callback_id_t callback_id, const void *message)
+static esp_err_t relay_write(int zone, const esp_zb_zcl_attribute_t *attribute)
 {
-    esp_err_t ret = ESP_OK;
-    switch (callback_id) {
-    case ESP_ZB_CORE_SET_ATTR_VALUE_CB_ID:
-        ret = zb_attribute_handler((esp_zb_zcl_set_attr_value_message_t *)message);
-        break;
-    default:
-        ESP_LOGW(TAG, "Received Zigbee action(0x%x) callback", callback_id);
-        break;
+    driver_set_relay(zone, *(bool *)attribute->data.value);
+    return ESP_OK;
+}
+
+static esp_err_t history_command(int index, const esp_zb_zcl_custom_cluster_command_message_t *message)
+{
+    return history_cluster_handle_command(message->info.dst_endpoint, message);
+}
+
+/* Calibration points of a sensor: applied by the measure task first, then stored for calibration_load at boot */
+static esp_err_t sensor_command(int index, const esp_zb_zcl_custom_cluster_command_message_t *message)
+{
+    const uint8_t *data = message->data.value;
+    ESP_RETURN_ON_FALSE(message->info.command.id == SENSOR_CMD_SET_CALIBRATION, ESP_ERR_NOT_SUPPORTED, TAG,
+                        "Unsupported sensor command 0x%x", message->info.command.id);
+    ESP_RETURN_ON_FALSE(message->data.size >= 1 && data, ESP_ERR_INVALID_ARG, TAG, "Short calibration command");
+    int count = data[0];
+    ESP_RETURN_ON_FALSE(count <= CONVERSION_MAX_POINTS && message->data.size >= 1 + 4 * count, ESP_ERR_INVALID_ARG, TAG,
+                        "Calibration command with %d points", count);
+    calibration_point_t points[CONVERSION_MAX_POINTS];
+    for (int i = 0; i < count; i++) {
+        const uint8_t *p = data + 1 + 4 * i;
+        points[i].mv = (int16_t)(p[0] | p[1] << 8);
+        points[i].centi_percent = (int16_t)(p[2] | p[3] << 8);
     }
-    return ret;
+    ESP_RETURN_ON_ERROR(driver_set_calibration(index, points, count), TAG, "Calibration of sensor %d refused", index);
+    ESP_LOGI(TAG, "Sensor %d: %d calibration points", index, count);
+    return settings_save_calibration(index, points, count);
 }
 
 
@@ -141,7 +505,11 @@ static esp_err_t zb_action_handler(esp_zb_core_action_callback_id_t callback_id,
 static esp_zb_cluster_list_t *basic_identity_clusters_create() {
    esp_zb_cluster_list_t *cluster_list = esp_zb_zcl_cluster_list_create();
     esp_zb_basic_cluster_cfg_t basic_config = {
+#ifdef SLEEPY_END_DEVICE
+        .power_source = 0x03, /* battery */
+#else
         .power_source = ESP_ZB_ZCL_BASIC_POWER_SOURCE_DEFAULT_VALUE,
+#endif
         .zcl_version = ESP_ZB_ZCL_BASIC_ZCL_VERSION_DEFAULT_VALUE
     };
 
@@ -154,10 +522,39 @@ static esp_zb_cluster_list_t *basic_identity_clusters_create() {
     };
     ESP_ERROR_CHECK(esp_zb_cluster_list_add_identify_cluster(cluster_list, esp_zb_identify_cluster_create(&identify_config), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
     ESP_ERROR_CHECK(esp_zb_cluster_list_add_identify_cluster(cluster_list, esp_zb_zcl_attr_list_create(ESP_ZB_ZCL_CLUSTER_ID_IDENTIFY), ESP_ZB_ZCL_CLUSTER_CLIENT_ROLE));
+#ifdef SLEEPY_END_DEVICE
+    /* a coordinator that wants a command through quickly answers a check-in with fast poll */
+    esp_zb_poll_control_cluster_cfg_t poll_control_config = {
+        .check_in_interval = POLL_CONTROL_CHECK_IN_INTERVAL_QS,
+        .long_poll_interval = POLL_CONTROL_LONG_POLL_INTERVAL_QS,
+        .short_poll_interval = POLL_CONTROL_SHORT_POLL_INTERVAL_QS,
+        .fast_poll_timeout = POLL_CONTROL_FAST_POLL_TIMEOUT_QS,
+    };
+    ESP_ERROR_CHECK(esp_zb_cluster_list_add_poll_control_cluster(cluster_list, esp_zb_poll_control_cluster_create(&poll_control_config), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
+#endif
     return cluster_list;
 }
 
-static esp_zb_cluster_list_t *custom_humidity_sensor_clusters_create()
+static void reporting_config_cluster_add(esp_zb_cluster_list_t *cluster_list, int channel)
+{
+    const report_policy_t *policy = reporting_get_policy(channel);
+    uint16_t min_interval = policy->min_interval_s;
+    uint16_t max_interval = policy->max_interval_s;
+    uint16_t change = policy->reportable_change;
+    uint32_t counter = 0;
+    uint8_t rw = ESP_ZB_ZCL_ATTR_ACCESS_READ_WRITE;
+    uint8_t ro = ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY;
+
+    esp_zb_attribute_list_t *attrs = esp_zb_zcl_attr_list_create(REPORTING_CONFIG_CLUSTER_ID);
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, REPORTING_CONFIG_MIN_INTERVAL_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U16, rw, &min_interval));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, REPORTING_CONFIG_MAX_INTERVAL_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U16, rw, &max_interval));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, REPORTING_CONFIG_CHANGE_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U16, rw, &change));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, REPORTING_CONFIG_SENT_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &counter));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, REPORTING_CONFIG_SUPPRESSED_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &counter));
+    ESP_ERROR_CHECK(esp_zb_cluster_list_add_custom_cluster(cluster_list, attrs, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
+}
+
+static esp_zb_cluster_list_t *custom_humidity_sensor_clusters_create(int channel)
 {
     esp_zb_cluster_list_t *cluster_list = esp_zb_zcl_cluster_list_create();
  
@@ -167,45 +564,82 @@ static esp_zb_cluster_list_t *custom_humidity_sensor_clusters_create()
     };
 
     ESP_ERROR_CHECK(esp_zb_cluster_list_add_humidity_meas_cluster(cluster_list, esp_zb_humidity_meas_cluster_create(&measure_config), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
+    reporting_config_cluster_add(cluster_list, channel);
+
+    uint8_t faults = 0;
+    esp_zb_attribute_list_t *health_attrs = esp_zb_zcl_attr_list_create(SENSOR_HEALTH_CLUSTER_ID);
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(health_attrs, SENSOR_HEALTH_FAULTS_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_8BITMAP,
+                                                          ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY | ESP_ZB_ZCL_ATTR_ACCESS_REPORTING, &faults));
+    ESP_ERROR_CHECK(esp_zb_cluster_list_add_custom_cluster(cluster_list, health_attrs, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
 
     return cluster_list;
 }
 
-static esp_zb_cluster_list_t *custom_consumption_clusters_create()
+static esp_zb_cluster_list_t *custom_consumption_clusters_create(int index)
 {
     esp_zb_cluster_list_t *cluster_list = esp_zb_zcl_cluster_list_create();
 
+    /* MeasuredValue carries the total pump seconds since boot */
     esp_zb_temperature_meas_cluster_cfg_t output_cfg = {
-        .measured_value = 0,
+        .measured_value = control_state.pump_total_s > INT16_MAX ? INT16_MAX : control_state.pump_total_s,
         .min_value = 0,
-        .max_value = 9999
+        .max_value = INT16_MAX
     };
 
     ESP_ERROR_CHECK(esp_zb_cluster_list_add_temperature_meas_cluster(cluster_list, esp_zb_temperature_meas_cluster_create(&output_cfg), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
+    reporting_config_cluster_add(cluster_list, REPORT_CHANNEL_CONSUMPTION);
+
+    return cluster_list;
+}
+
+static esp_zb_cluster_list_t *custom_flow_meter_clusters_create(int index)
+{
+    esp_zb_cluster_list_t *cluster_list = esp_zb_zcl_cluster_list_create();
+
+    esp_zb_metering_cluster_cfg_t metering_cfg = {
+        .current_summation_delivered = { .low = control_state.volume_ml, .high = 0 },
+        .status = 0,
+        .uint_of_measure = FLOW_METERING_UNIT_LITRES,
+        .summation_formatting = FLOW_METERING_FORMATTING,
+        .metering_device_type = FLOW_METERING_DEVICE_WATER,
+    };
+    esp_zb_attribute_list_t *attrs = esp_zb_metering_cluster_create(&metering_cfg);
+    esp_zb_uint24_t multiplier = { .low = 1, .high = 0 };
+    esp_zb_uint24_t divisor = { .low = FLOW_METERING_DIVISOR, .high = 0 };
+    esp_zb_int24_t demand = { 0 };
+    ESP_ERROR_CHECK(esp_zb_metering_cluster_add_attr(attrs, ESP_ZB_ZCL_ATTR_METERING_MULTIPLIER_ID, &multiplier));
+    ESP_ERROR_CHECK(esp_zb_metering_cluster_add_attr(attrs, ESP_ZB_ZCL_ATTR_METERING_DIVISOR_ID, &divisor));
+    ESP_ERROR_CHECK(esp_zb_metering_cluster_add_attr(attrs, ESP_ZB_ZCL_ATTR_METERING_INSTANTANEOUS_DEMAND_ID, &demand));
+    ESP_ERROR_CHECK(esp_zb_cluster_list_add_metering_cluster(cluster_list, attrs, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
 
     return cluster_list;
 }
 
-static esp_zb_cluster_list_t *custom_humidity_target_clusters_create()
+static esp_zb_cluster_list_t *custom_humidity_target_clusters_create(int zone)
 {
     esp_zb_cluster_list_t *cluster_list = esp_zb_zcl_cluster_list_create();
 
     esp_zb_analog_output_cluster_cfg_t output_cfg = {
         .out_of_service = false,
-        .present_value = DEFAULT_MIN_HUMIDITY,
+        .present_value = control_state.target[zone] / 100.0f,
         .status_flags = 0
     };
 
     esp_zb_attribute_list_t * attrs = esp_zb_analog_output_cluster_create(&output_cfg);
     ESP_ERROR_CHECK(esp_zb_cluster_list_add_analog_output_cluster(cluster_list, attrs, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
-    target_cluster_id = attrs->cluster_id;
     ESP_LOGD(TAG, "Created analog cluster output with id %i", attrs->cluster_id);
+    ESP_ERROR_CHECK(esp_zb_cluster_list_add_custom_cluster(cluster_list, control_cluster_create(), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
     return cluster_list;
 }
 
-static esp_zb_cluster_list_t *custom_on_off_clusters_create() {
+/* The first relay endpoint also carries the device's basic, identify and poll control clusters */
+static esp_zb_cluster_list_t *custom_on_off_clusters_create(int zone) {
 
-    esp_zb_cluster_list_t *cluster_list = basic_identity_clusters_create();
+    bool device_clusters = true;
+    for (int z = 0; z < zone; z++) {
+        device_clusters &= !zones_get(z)->relay_endpoint;
+    }
+    esp_zb_cluster_list_t *cluster_list = device_clusters ? basic_identity_clusters_create() : esp_zb_zcl_cluster_list_create();
 
     esp_zb_on_off_cluster_cfg_t onoff_cfg = {
         .on_off = false
@@ -217,53 +651,268 @@ static esp_zb_cluster_list_t *custom_on_off_clusters_create() {
         
 }
 
+static esp_zb_cluster_list_t *custom_history_clusters_create(int index)
+{
+    esp_zb_cluster_list_t *cluster_list = esp_zb_zcl_cluster_list_create();
+    ESP_ERROR_CHECK(esp_zb_cluster_list_add_custom_cluster(cluster_list, history_cluster_create(), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
+    return cluster_list;
+}
+
+static esp_zb_cluster_list_t *custom_ota_clusters_create(int index)
+{
+    esp_zb_cluster_list_t *cluster_list = esp_zb_zcl_cluster_list_create();
+    ESP_ERROR_CHECK(esp_zb_cluster_list_add_ota_cluster(cluster_list, ota_cluster_create(), ESP_ZB_ZCL_CLUSTER_CLIENT_ROLE));
+    return cluster_list;
+}
+
+static esp_zb_cluster_list_t *custom_diagnostics_clusters_create(int index)
+{
+    esp_zb_cluster_list_t *cluster_list = esp_zb_zcl_cluster_list_create();
+    ESP_ERROR_CHECK(esp_zb_cluster_list_add_custom_cluster(cluster_list, metrics_cluster_create(), ESP_ZB_ZCL_CLUSTER_SERVER_ROLE));
+    return cluster_list;
+}
+
 /****** END CLUSTER CREATION */
 
-static void esp_zb_task(void *pvParameters)
+
+/****** DEVICE DESCRIPTION */
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef esp_err_t (*attribute_write_fn_t)(int index, const esp_zb_zcl_attribute_t *attribute);
+typedef esp_err_t (*command_fn_t)(int index, const esp_zb_zcl_custom_cluster_command_message_t *message);
+
+typedef struct {
+    uint16_t cluster;
+    uint16_t attribute;
+    uint8_t type;
+    attribute_write_fn_t write;
+} attribute_route_t;
+
+typedef struct {
+    uint16_t cluster;
+    command_fn_t handle;
+} command_route_t;
+
+typedef enum {
+    ENDPOINT_ONCE,          /* at .endpoint, index .index */
+    ENDPOINT_PER_SENSOR,    /* at sensor_config[i].endpoint, index i */
+    ENDPOINT_PER_ZONE,      /* at each zone's setpoint endpoint, index zone */
+    ENDPOINT_PER_RELAY,     /* at the relay endpoint of each zone that has one, index zone */
+} endpoint_repeat_t;
+
+/* The create function and the routes get the index: sensor, zone or reporting channel */
+typedef struct {
+    endpoint_repeat_t repeat;
+    uint8_t endpoint;
+    uint8_t index;
+    uint16_t device_id;
+    esp_zb_cluster_list_t *(*create)(int index);
+    const attribute_route_t *attributes;
+    uint8_t attribute_count;
+    const command_route_t *commands;
+    uint8_t command_count;
+} endpoint_description_t;
+
+static const attribute_route_t reporting_config_routes[] = {
+    { REPORTING_CONFIG_CLUSTER_ID, REPORTING_CONFIG_MIN_INTERVAL_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U16, reporting_config_write },
+    { REPORTING_CONFIG_CLUSTER_ID, REPORTING_CONFIG_MAX_INTERVAL_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U16, reporting_config_write },
+    { REPORTING_CONFIG_CLUSTER_ID, REPORTING_CONFIG_CHANGE_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U16, reporting_config_write },
+};
+
+static const attribute_route_t setpoint_routes[] = {
+    { ESP_ZB_ZCL_CLUSTER_ID_ANALOG_OUTPUT, ESP_ZB_ZCL_ATTR_ANALOG_OUTPUT_PRESENT_VALUE_ID, ESP_ZB_ZCL_ATTR_TYPE_SINGLE, setpoint_write },
+};
+
+static const attribute_route_t relay_routes[] = {
+    { ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID, ESP_ZB_ZCL_ATTR_TYPE_BOOL, relay_write },
+};
+
+static const command_route_t control_routes[] = {
+    { CONTROL_CLUSTER_ID, control_cluster_handle_command },
+};
+
+static const command_route_t sensor_routes[] = {
+    { SENSOR_HEALTH_CLUSTER_ID, sensor_command },
+};
+
+static const command_route_t history_routes[] = {
+    { HISTORY_CLUSTER_ID, history_command },
+};
+
+/* Every endpoint of the device; registration and attribute / command dispatch both work from this table */
+static const endpoint_description_t device_description[] = {
+#ifdef EXPOSE_RELAY_INPUT
+    { .repeat = ENDPOINT_PER_RELAY, .device_id = ESP_ZB_HA_ON_OFF_LIGHT_DEVICE_ID, .create = custom_on_off_clusters_create,
+      .attributes = relay_routes, .attribute_count = ARRAY_SIZE(relay_routes) },
+#endif
+    { .repeat = ENDPOINT_PER_SENSOR, .device_id = ESP_ZB_HA_SIMPLE_SENSOR_DEVICE_ID, .create = custom_humidity_sensor_clusters_create,
+      .attributes = reporting_config_routes, .attribute_count = ARRAY_SIZE(reporting_config_routes),
+      .commands = sensor_routes, .command_count = ARRAY_SIZE(sensor_routes) },
+    { .repeat = ENDPOINT_ONCE, .endpoint = HA_CONSUMPTION_SENSOR_ENDPOINT, .index = REPORT_CHANNEL_CONSUMPTION,
+      .device_id = ESP_ZB_ZGP_TEMPERATURE_SENSOR_DEV_ID, .create = custom_consumption_clusters_create,
+      .attributes = reporting_config_routes, .attribute_count = ARRAY_SIZE(reporting_config_routes) },
+#ifdef FLOW_METER_PIN
+    { .repeat = ENDPOINT_ONCE, .endpoint = HA_FLOW_METER_ENDPOINT, .device_id = ESP_ZB_HA_METER_INTERFACE_DEVICE_ID,
+      .create = custom_flow_meter_clusters_create },
+#endif
+    { .repeat = ENDPOINT_PER_ZONE, .device_id = ESP_ZB_HA_CUSTOM_ATTR_DEVICE_ID, .create = custom_humidity_target_clusters_create,
+      .attributes = setpoint_routes, .attribute_count = ARRAY_SIZE(setpoint_routes),
+      .commands = control_routes, .command_count = ARRAY_SIZE(control_routes) },
+    { .repeat = ENDPOINT_ONCE, .endpoint = HA_HISTORY_ENDPOINT, .device_id = ESP_ZB_HA_CUSTOM_ATTR_DEVICE_ID,
+      .create = custom_history_clusters_create, .commands = history_routes, .command_count = ARRAY_SIZE(history_routes) },
+    { .repeat = ENDPOINT_ONCE, .endpoint = HA_OTA_ENDPOINT, .device_id = ESP_ZB_HA_CUSTOM_ATTR_DEVICE_ID,
+      .create = custom_ota_clusters_create },
+    { .repeat = ENDPOINT_ONCE, .endpoint = HA_DIAGNOSTICS_ENDPOINT, .device_id = ESP_ZB_HA_CUSTOM_ATTR_DEVICE_ID,
+      .create = custom_diagnostics_clusters_create },
+};
+
+typedef struct {
+    uint8_t description;    /* device_description index + 1, 0 - no endpoint of ours */
+    uint8_t index;
+} endpoint_slot_t;
+
+/* By endpoint number, filled in at registration so a write or command finds its routes without a search */
+static endpoint_slot_t endpoint_slots[256];
+
+static int description_instances(const endpoint_description_t *description)
 {
-    esp_zb_cfg_t zb_nwk_cfg = ESP_ZB_ZED_CONFIG();
-    esp_zb_init(&zb_nwk_cfg);
+    switch (description->repeat) {
+    case ENDPOINT_PER_SENSOR: return SENSOR_COUNT;
+    case ENDPOINT_PER_ZONE:
+    case ENDPOINT_PER_RELAY: return zones_count();
+    default: return 1;
+    }
+}
+
+/* 0 if that instance has no endpoint */
+static uint8_t description_endpoint(const endpoint_description_t *description, int instance)
+{
+    switch (description->repeat) {
+    case ENDPOINT_PER_SENSOR: return sensor_config[instance].endpoint;
+    case ENDPOINT_PER_ZONE: return zones_get(instance)->setpoint_endpoint;
+    case ENDPOINT_PER_RELAY: return zones_get(instance)->relay_endpoint;
+    default: return description->endpoint;
+    }
+}
 
-    esp_zb_ep_list_t *zb_endpoints = esp_zb_ep_list_create();
-    #ifdef EXPOSE_RELAY_INPUT 
-        esp_zb_endpoint_config_t endpoint_config = {
-            .endpoint = HA_ONOFF_SWITCH_ENDPOINT,
-            .app_profile_id = ESP_ZB_AF_HA_PROFILE_ID,
-            .app_device_id = ESP_ZB_HA_ON_OFF_LIGHT_DEVICE_ID,
-            .app_device_version = 0
-        };
+static esp_zb_ep_list_t *device_endpoints_create(int *count)
+{
+    esp_zb_ep_list_t *endpoints = esp_zb_ep_list_create();
+    *count = 0;
+    for (int d = 0; d < ARRAY_SIZE(device_description); d++) {
+        const endpoint_description_t *description = &device_description[d];
+        for (int i = 0; i < description_instances(description); i++) {
+            uint8_t endpoint = description_endpoint(description, i);
+            if (!endpoint) {
+                continue;
+            }
+            int index = description->repeat == ENDPOINT_ONCE ? description->index : i;
+            esp_zb_endpoint_config_t endpoint_config = {
+                .endpoint = endpoint,
+                .app_profile_id = ESP_ZB_AF_HA_PROFILE_ID,
+                .app_device_id = description->device_id,
+                .app_device_version = 0
+            };
+            ESP_ERROR_CHECK(esp_zb_ep_list_add_ep(endpoints, description->create(index), endpoint_config));
+            endpoint_slots[endpoint] = (endpoint_slot_t) { .description = d + 1, .index = index };
+            (*count)++;
+        }
+    }
+    return endpoints;
+}
 
-        esp_zb_ep_list_add_ep(zb_endpoints, custom_on_off_clusters_create(), endpoint_config);
-    #endif
+static const endpoint_description_t *endpoint_lookup(uint8_t endpoint, int *index)
+{
+    const endpoint_slot_t *slot = &endpoint_slots[endpoint];
+    if (!slot->description) {
+        return NULL;
+    }
+    *index = slot->index;
+    return &device_description[slot->description - 1];
+}
 
-    for (int i = 0; i < SENSOR_COUNT; i++) {
-        esp_zb_endpoint_config_t endpoint_config = {
-            .endpoint = meas_endpoints[i],
-            .app_profile_id = ESP_ZB_AF_HA_PROFILE_ID,
-            .app_device_id = ESP_ZB_HA_SIMPLE_SENSOR_DEVICE_ID,
-            .app_device_version = 0
-        };
-        esp_zb_ep_list_add_ep(zb_endpoints, custom_humidity_sensor_clusters_create(), endpoint_config);
-    }
-
-    esp_zb_endpoint_config_t consumpton_endpoint_config = {
-        .endpoint = HA_CONSUMPTION_SENSOR_ENDPOINT,
-        .app_profile_id = ESP_ZB_AF_HA_PROFILE_ID,
-        .app_device_id = ESP_ZB_ZGP_TEMPERATURE_SENSOR_DEV_ID,
-        .app_device_version = 0
-    };
-    esp_zb_ep_list_add_ep(zb_endpoints, custom_consumption_clusters_create(), consumpton_endpoint_config);
-    
-    esp_zb_endpoint_config_t target_endpoint_config = {
-        .endpoint = HA_TARGET_HUMIDITY_ENDPOINT,
-        .app_profile_id = ESP_ZB_AF_HA_PROFILE_ID,
-        .app_device_id = ESP_ZB_HA_CUSTOM_ATTR_DEVICE_ID,
-        .app_device_version = 0
-    };
-    
-    esp_zb_ep_list_add_ep(zb_endpoints, custom_humidity_target_clusters_create(), target_endpoint_config);
+/* An endpoint has at most three routes, so the scan after the lookup is bounded */
+static esp_err_t zb_attribute_handler(const esp_zb_zcl_set_attr_value_message_t *message)
+{
+    ESP_RETURN_ON_FALSE(message, ESP_FAIL, TAG, "Empty message");
+    ESP_RETURN_ON_FALSE(message->info.status == ESP_ZB_ZCL_STATUS_SUCCESS, ESP_ERR_INVALID_ARG, TAG, "Received message: error status(%d)",
+                        message->info.status);
+    ESP_LOGI(TAG, "Received message: endpoint(%d), cluster(0x%x), attribute(0x%x), data size(%d), type(0x%x)", message->info.dst_endpoint, message->info.cluster,
+             message->attribute.id, message->attribute.data.size, message->attribute.data.type);
+    int index;
+    const endpoint_description_t *description = endpoint_lookup(message->info.dst_endpoint, &index);
+    for (int i = 0; description && i < description->attribute_count; i++) {
+        const attribute_route_t *route = &description->attributes[i];
+        if (route->cluster == message->info.cluster && route->attribute == message->attribute.id) {
+            ESP_RETURN_ON_FALSE(message->attribute.data.type == route->type && message->attribute.data.value, ESP_ERR_INVALID_ARG,
+                                TAG, "Attribute 0x%x written with type 0x%x", route->attribute, message->attribute.data.type);
+            return route->write(index, &message->attribute);
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t zb_command_handler(const esp_zb_zcl_custom_cluster_command_message_t *message)
+{
+    int index;
+    const endpoint_description_t *description = endpoint_lookup(message->info.dst_endpoint, &index);
+    for (int i = 0; description && i < description->command_count; i++) {
+        if (description->commands[i].cluster == message->info.cluster) {
+            return description->commands[i].handle(index, message);
+        }
+    }
+    ESP_LOGW(TAG, "No handler for cluster 0x%x commands on endpoint %d", message->info.cluster, message->info.dst_endpoint);
+    return ESP_ERR_NOT_SUPPORTED;
+}
 
+static esp_err_t zb_action_handler(esp_zb_core_action_callback_id_t callback_id, const void *message)
+{
+    esp_err_t ret = ESP_OK;
+    switch (callback_id) {
+    case ESP_ZB_CORE_SET_ATTR_VALUE_CB_ID:
+        ret = zb_attribute_handler((esp_zb_zcl_set_attr_value_message_t *)message);
+        break;
+    case ESP_ZB_CORE_CMD_CUSTOM_CLUSTER_REQ_CB_ID:
+        ret = zb_command_handler((esp_zb_zcl_custom_cluster_command_message_t *)message);
+        break;
+    case ESP_ZB_CORE_OTA_UPGRADE_VALUE_CB_ID:
+        ret = ota_handle_upgrade_value((esp_zb_zcl_ota_upgrade_value_message_t *)message);
+        break;
+    default:
+        ESP_LOGW(TAG, "Received Zigbee action(0x%x) callback", callback_id);
+        break;
+    }
+    return ret;
+}
+
+static void esp_zb_task(void *pvParameters)
+{
+    esp_zb_cfg_t zb_nwk_cfg = ESP_ZB_ZED_CONFIG();
+#ifdef SLEEPY_END_DEVICE
+    esp_zb_sleep_enable(true);
+    esp_zb_sleep_set_threshold(SLEEP_THRESHOLD_MS);
+#endif
+    esp_zb_init(&zb_nwk_cfg);
+#ifdef SLEEPY_END_DEVICE
+    esp_zb_set_rx_on_when_idle(false);
+#endif
+
+    int64_t register_start_us = esp_timer_get_time();
+    size_t register_start_heap = esp_get_free_heap_size();
+    int endpoint_count;
+    esp_zb_ep_list_t *zb_endpoints = device_endpoints_create(&endpoint_count);
     esp_zb_device_register(zb_endpoints);
+    uint32_t register_us = esp_timer_get_time() - register_start_us;
+    uint32_t register_heap = register_start_heap - esp_get_free_heap_size();
+    metrics_set(METRIC_REGISTER_US, register_us);
+    metrics_set(METRIC_REGISTER_HEAP, register_heap);
+    ESP_LOGI(TAG, "Registered %d endpoints in %lu us, %lu bytes of heap", endpoint_count, (unsigned long)register_us,
+             (unsigned long)register_heap);
+    metrics_cluster_start();
+    for (int i = 0; i < REPORT_CHANNEL_COUNT; i++) {
+        reporting_config_apply(i);
+    }
 
     esp_zb_core_action_handler_register(zb_action_handler);
     esp_zb_set_primary_network_channel_set(ESP_ZB_PRIMARY_CHANNEL_MASK);
@@ -271,14 +920,58 @@ static void esp_zb_task(void *pvParameters)
     esp_zb_main_loop_iteration();
 }
 
+#ifdef BENCHMARK_SUITE
+static void benchmark_suite_run(void)
+{
+    static const uint32_t rounds[BENCH_STAGE_COUNT] = {
+        [BENCH_ADC_READ] = 10,
+        [BENCH_ADC_CALIBRATION] = 4,
+        [BENCH_CONVERSION] = 4,
+        [BENCH_DECISION] = 1000,
+        [BENCH_REPORT] = 200,
+        [BENCH_LOG_DEFERRED] = 200,
+        [BENCH_LOG_DRAIN] = 20,
+        [BENCH_LOG_PRINTF] = 20,
+    };
+    benchmark_init();
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        benchmark_result_t result;
+        if (benchmark_run(stage, rounds[stage], &result) == ESP_OK) {
+            benchmark_print_json(&result, "cycles");
+        }
+    }
+}
+#endif
+
 void app_main(void)
 {   
     init_driver_immediate();
+#ifdef BENCHMARK_SUITE
+    benchmark_suite_run();
+    return;
+#endif
     esp_zb_platform_config_t config = {
         .radio_config = ESP_ZB_DEFAULT_RADIO_CONFIG(),
         .host_config = ESP_ZB_DEFAULT_HOST_CONFIG(),
     };
     ESP_ERROR_CHECK(nvs_flash_init());
+    reporting_config_load();
+    dose_gains_load();
+    calibration_load();
+    control_state_load();
+    if (history_init() != ESP_OK) {
+        ESP_LOGW(TAG, "History partition unavailable, telemetry is not logged");
+    }
+    ESP_ERROR_CHECK(esp_zb_power_save_init());
     ESP_ERROR_CHECK(esp_zb_platform_config(&config));
-    xTaskCreate(esp_zb_task, "Zigbee_main", 4096, NULL, 5, NULL);
+#ifdef HAL_STATIC_ALLOCATION
+    log_ready = xSemaphoreCreateBinaryStatic(&log_ready_buffer);
+#else
+    log_ready = xSemaphoreCreateBinary();
+#endif
+    ESP_ERROR_CHECK(log_ready ? ESP_OK : ESP_ERR_NO_MEM);
+    ESP_ERROR_CHECK(hal_task_create(esp_app_log_task, "Log_main", LOG_TASK_STACK_SIZE, LOG_TASK_PRIORITY));
+    /* control does not wait for the network, the Zigbee task joins alongside */
+    ESP_ERROR_CHECK(init_driver(MEASUREMENT_INTERVAL_S, &esp_app_samples_ready));
+    ESP_ERROR_CHECK(hal_task_create(esp_zb_task, "Zigbee_main", ZIGBEE_TASK_STACK_SIZE, ZIGBEE_TASK_PRIORITY));
 }
@@ -1,22 +1,63 @@
+#pragma once
 
+
+#include "sdkconfig.h"
 #include "esp_zigbee_core.h"
 
+#ifdef CONFIG_WATERER_SLEEPY_END_DEVICE             /* menuconfig "Plant waterer", off by default */
+#define SLEEPY_END_DEVICE                           /* receiver off when idle, light-sleep between parent polls */
+#endif
+#define SLEEPY_POLL_INTERVAL_MS         7500        /* worst case delay for a command (e.g. on/off) to reach a sleepy device */
+#define SLEEP_THRESHOLD_MS              20          /* don't enter light sleep for shorter idle periods */
+
+/* Poll Control cluster, in quarter seconds: commands reach a sleepy device within the long poll interval, or within
+   the short poll interval for the fast poll timeout after a check-in the coordinator answered with fast poll */
+#define POLL_CONTROL_CHECK_IN_INTERVAL_QS   (15 * 60 * 4)
+#define POLL_CONTROL_LONG_POLL_INTERVAL_QS  (SLEEPY_POLL_INTERVAL_MS / 250)
+#define POLL_CONTROL_SHORT_POLL_INTERVAL_QS 1
+#define POLL_CONTROL_FAST_POLL_TIMEOUT_QS   (30 * 4)
+
 #define ED_AGING_TIMEOUT                ESP_ZB_ED_AGING_TIMEOUT_64MIN
+#ifdef SLEEPY_END_DEVICE
+#define ED_KEEP_ALIVE                   SLEEPY_POLL_INTERVAL_MS
+#else
 #define ED_KEEP_ALIVE                   3000    /* 3000 millisecond */
+#endif
 #define MAX_CHILDREN                    10          /* the max amount of connected devices */
 #define INSTALLCODE_POLICY_ENABLE       false       /* enable the install code policy for security */
-#define HA_ONOFF_SWITCH_ENDPOINT        1           /* esp light switch device endpoint */
-#define HA_ESP_SENSOR_1_ENDPOINT        10
-#define HA_ESP_SENSOR_2_ENDPOINT        20
-#define HA_ESP_SENSOR_3_ENDPOINT        30
+/* sensor, zone setpoint and relay endpoints come from the tables in zones.c */
 #define HA_CONSUMPTION_SENSOR_ENDPOINT  40
-#define HA_TARGET_HUMIDITY_ENDPOINT      50
+#define HA_FLOW_METER_ENDPOINT          45          /* metering cluster fed by the flow meter, see flow.h */
+#define HA_HISTORY_ENDPOINT             60          /* history download cluster, see history_cluster.h */
+#define HA_OTA_ENDPOINT                 70          /* OTA upgrade client, see ota.h */
+#define HA_DIAGNOSTICS_ENDPOINT         80          /* runtime metrics, see metrics_cluster.h */
+
+#define REPORTING_CONFIG_CLUSTER_ID             0xFC10  /* manufacturer-specific, on every sensor endpoint */
+#define REPORTING_CONFIG_MIN_INTERVAL_ATTR_ID   0x0000  /* U16, seconds */
+#define REPORTING_CONFIG_MAX_INTERVAL_ATTR_ID   0x0001  /* U16, seconds, 0 - no periodic reports */
+#define REPORTING_CONFIG_CHANGE_ATTR_ID         0x0002  /* U16, in units of the measured value */
+#define REPORTING_CONFIG_SENT_ATTR_ID           0x0003  /* U32, read only */
+#define REPORTING_CONFIG_SUPPRESSED_ATTR_ID     0x0004  /* U32, read only */
+
+#define SENSOR_HEALTH_CLUSTER_ID                0xFC13  /* manufacturer-specific, on every sensor endpoint */
+#define SENSOR_HEALTH_FAULTS_ATTR_ID            0x0000  /* BITMAP8, health_fault_t flags, read only, reportable */
+#define SENSOR_CMD_SET_CALIBRATION              0x00    /* client -> server: U8 count, then count x (S16 mV, S16 1/100 %) */
+#define HUMIDITY_MEASURED_VALUE_UNKNOWN         0xFFFF  /* ZCL invalid measurement, sent for excluded sensors */
+
+/* Metering cluster: litres with three decimals, i.e. summation in ml and instantaneous demand in ml/h */
+#define FLOW_METERING_UNIT_LITRES               0x07
+#define FLOW_METERING_DEVICE_WATER              0x02
+#define FLOW_METERING_DIVISOR                   1000
+#define FLOW_METERING_FORMATTING                ((5 << 3) | 3)  /* 5 integer and 3 decimal digits */
+#define FLOW_METERING_STATUS_PIPE_EMPTY         0x08            /* water meter status bit, set by a dry run */
 
 #define ESP_ZB_PRIMARY_CHANNEL_MASK     ESP_ZB_TRANSCEIVER_ALL_CHANNELS_MASK    /* Zigbee primary channel mask use in the example */
 
 
 #define MEASUREMENT_INTERVAL_S 20*60 // 20 minutes
 
+#define SAMPLE_FLUSH_LOCK_TIMEOUT_MS 50 // samples stay queued for the next cycle if the stack holds its lock longer
+
 #define EXPOSE_RELAY_INPUT 
 
 #define ESP_TEMP_SENSOR_UPDATE_INTERVAL (1)
@@ -0,0 +1,84 @@
+#include "flow.h"
+#include "dlog.h"
+
+static const char *TAG = "FLOW";
+
+static uint32_t restored_ml;
+static uint64_t total_pulses;       // since boot
+static uint32_t last_count;         // hardware count at the last call
+static int64_t started_us;
+static int64_t last_us;
+static int64_t window_us;           // start of the dry-run window
+static uint64_t window_pulses;      // total_pulses at its start
+static uint32_t rate_ml_h;
+static bool running;
+static flow_stats_t stats;
+
+// The hardware count wraps at 32 bit, the difference stays right across one wrap
+static uint32_t fold(uint32_t pulses) {
+    uint32_t delta = pulses - last_count;
+    last_count = pulses;
+    total_pulses += delta;
+    stats.volume_ml = total_pulses * 1000 / FLOW_PULSES_PER_LITRE;
+    return delta;
+}
+
+void flow_restore(uint32_t volume_ml) {
+    restored_ml = volume_ml;
+}
+
+void flow_start(uint32_t pulses, int64_t now_us) {
+    fold(pulses);
+    running = true;
+    started_us = last_us = now_us;
+    rate_ml_h = 0;
+    stats.runs++;
+}
+
+flow_state_t flow_update(uint32_t pulses, int64_t now_us) {
+    uint32_t delta = fold(pulses);
+    if (!running) {
+        return FLOW_PRIMING;
+    }
+    if (now_us > last_us) {
+        rate_ml_h = (uint64_t)delta * 1000 * 3600000000LL / ((uint64_t)FLOW_PULSES_PER_LITRE * (now_us - last_us));
+    }
+    last_us = now_us;
+    if (now_us - started_us < (int64_t)FLOW_PRIME_S * 1000000) {
+        window_us = now_us;
+        window_pulses = total_pulses;
+        return FLOW_PRIMING;
+    }
+    int64_t span_us = now_us - window_us;
+    if (span_us < (int64_t)FLOW_DRY_WINDOW_S * 1000000) {
+        return FLOW_FLOWING;
+    }
+    // pulses * 1000 / FLOW_PULSES_PER_LITRE ml in span_us against FLOW_MIN_ML_MIN, without the division
+    uint64_t counted = total_pulses - window_pulses;
+    window_us = now_us;
+    window_pulses = total_pulses;
+    if (counted * 1000 * 60000000ULL < (uint64_t)FLOW_MIN_ML_MIN * FLOW_PULSES_PER_LITRE * span_us) {
+        DLOGW(TAG, "%lu pulses in %lu ms, running dry", (unsigned long)counted, (unsigned long)(span_us / 1000));
+        stats.dry_runs++;
+        return FLOW_DRY;
+    }
+    return FLOW_FLOWING;
+}
+
+void flow_stop(uint32_t pulses, int64_t now_us) {
+    fold(pulses);
+    running = false;
+    rate_ml_h = 0;
+}
+
+uint32_t flow_volume_ml(void) {
+    return restored_ml + stats.volume_ml;
+}
+
+uint32_t flow_rate_ml_h(void) {
+    return rate_ml_h;
+}
+
+const flow_stats_t *flow_stats(void) {
+    return &stats;
+}
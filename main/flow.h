@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Flow meter on the supply line shared by all pumps. Pulses are counted in hardware (hal_pulse_*), the measure task
+// only reads the running count: every FLOW_CHECK_INTERVAL_MS while a pump is on it integrates the volume, updates
+// the rate estimate and judges the last FLOW_DRY_WINDOW_S. Too little water after the priming time means the
+// reservoir is empty or the intake blocked, and the driver cuts every pump.
+
+#define FLOW_PULSES_PER_LITRE       5880    // YF-S401 hall sensor, 450 for a YF-S201
+#define FLOW_GLITCH_NS              1000    // pulses shorter than this are contact bounce or noise
+#define FLOW_CHECK_INTERVAL_MS      1000
+#define FLOW_PRIME_S                3       // the hose fills before water reaches the meter
+#define FLOW_DRY_WINDOW_S           3
+#define FLOW_MIN_ML_MIN             100     // less than this over a window is running dry
+
+typedef enum {
+    FLOW_PRIMING,   // pumps started less than FLOW_PRIME_S ago, nothing is judged yet
+    FLOW_FLOWING,
+    FLOW_DRY,
+} flow_state_t;
+
+typedef struct {
+    uint32_t runs;          // first pump on to last pump off
+    uint32_t dry_runs;      // runs cut for lack of flow
+    uint32_t volume_ml;     // since boot, without the restored total
+} flow_stats_t;
+
+// Metered total (ml) of earlier boots
+void flow_restore(uint32_t volume_ml);
+// pulses is the running hardware count at the time, the flow functions work out the difference themselves
+void flow_start(uint32_t pulses, int64_t now_us);
+flow_state_t flow_update(uint32_t pulses, int64_t now_us);
+void flow_stop(uint32_t pulses, int64_t now_us);
+// Restored plus metered since boot
+uint32_t flow_volume_ml(void);
+// Over the last check while pumping, 0 otherwise
+uint32_t flow_rate_ml_h(void);
+const flow_stats_t *flow_stats(void);
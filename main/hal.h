@@ -0,0 +1,76 @@
+#pragma once
+
+// Hardware abstraction used by driver.c. The firmware implementation lives in hal_esp32.c,
+// the host simulator provides its own (host/hal_sim.c) so the same control code runs on a virtual clock.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "driver/gpio.h"
+
+// Tasks and the event queue live in static memory sized at build time (task_config.h) instead of on the heap.
+// Everything else the HAL needs is allocated once during start-up, nothing at run time.
+#define HAL_STATIC_ALLOCATION
+
+typedef void (*hal_task_fn_t)(void *arg);
+
+typedef struct {
+    uint16_t type;
+    int32_t arg;
+    uint32_t posted_us;     // low 32 bits of hal_time_us() when posted, set by the poster for latency metrics
+    bool timed;             // the receiver records the latency from posted_us
+} hal_event_t;
+
+typedef struct {
+    uint16_t index;     // position of the channel in the list given to hal_adc_init
+    uint16_t raw;
+} hal_adc_sample_t;
+
+esp_err_t hal_gpio_init_outputs(uint64_t pin_mask);
+esp_err_t hal_gpio_set_level(gpio_num_t pin, uint32_t level);
+
+// Counts rising edges on one input in hardware (PCNT on the device), the CPU is not interrupted per pulse.
+// Counting runs between hal_pulse_start and hal_pulse_stop only and keeps the chip out of light sleep meanwhile.
+esp_err_t hal_pulse_init(gpio_num_t pin, uint32_t glitch_ns);
+esp_err_t hal_pulse_start(void);
+esp_err_t hal_pulse_stop(void);
+// Edges counted since hal_pulse_init, wraps at 32 bit
+uint32_t hal_pulse_count(void);
+
+// Configures the given ADC1 channels for continuous conversion, returns true if every channel got a calibration scheme.
+// Readings are 12-bit codes, hal_adc_raw_to_mv applies the channel's own calibration.
+bool hal_adc_init(const int *channels, int count);
+// Starts round-robin conversion of all channels, freq_hz is the total rate across channels
+esp_err_t hal_adc_stream_start(uint32_t freq_hz);
+// Blocks until at least one sample is available, returns up to max samples
+esp_err_t hal_adc_stream_read(hal_adc_sample_t *samples, int max, int *count);
+esp_err_t hal_adc_stream_stop(void);
+esp_err_t hal_adc_raw_to_mv(int index, int raw, int *mv);
+
+// Raw access to the "history" data partition, offsets are relative to its start
+uint32_t hal_history_size(void);
+esp_err_t hal_history_read(uint32_t offset, void *buf, size_t len);
+esp_err_t hal_history_write(uint32_t offset, const void *buf, size_t len);
+esp_err_t hal_history_erase(uint32_t offset, size_t len);
+
+int64_t hal_time_us(void);
+// Free-running CPU cycle counter for benchmarks, wraps (nanoseconds on the host)
+uint32_t hal_cycle_count(void);
+
+// Single event queue feeding the measure task, plus one-shot timers whose events it delivers. A timer's event is
+// never lost to a full queue: hal_event_wait returns the events of expired timers before the queued ones.
+esp_err_t hal_events_init(int timer_count);
+esp_err_t hal_event_post(const hal_event_t *event, bool urgent);
+bool hal_event_wait(hal_event_t *event);
+// (Re)arms the timer, event is posted when it expires
+esp_err_t hal_timer_schedule(int timer, uint32_t delay_ms, const hal_event_t *event);
+void hal_timer_cancel(int timer);
+// Holds off automatic light sleep while on, e.g. while DMA conversions are running
+void hal_stay_awake(bool on);
+
+// stack_size in bytes; with HAL_STATIC_ALLOCATION at most TASK_COUNT tasks sharing TASK_STACK_ARENA bytes
+esp_err_t hal_task_create(hal_task_fn_t fn, const char *name, uint32_t stack_size, int priority);
+// Runs fn(arg) to completion on a fresh stack of stack_size bytes and blocks until it returns, for benchmarks.
+// stack_used is the peak stack use of the run.
+esp_err_t hal_run_on_stack(hal_task_fn_t fn, void *arg, uint32_t stack_size, uint32_t *stack_used);
@@ -0,0 +1,364 @@
+#include "hal.h"
+#include "task_config.h"
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+#include "esp_pm.h"
+#include "esp_partition.h"
+#include "esp_cpu.h"
+#include "driver/pulse_cnt.h"
+#include "esp_adc/adc_continuous.h"
+#include "esp_adc/adc_cali_scheme.h"
+#include "soc/soc_caps.h"
+
+static const char *TAG = "HAL";
+
+#define ATTN ADC_ATTEN_DB_12
+#define HAL_MAX_ADC_CHANNELS SOC_ADC_CHANNEL_NUM(ADC_UNIT_1)
+#define HAL_ADC_FRAME_BYTES (SOC_ADC_DIGI_RESULT_BYTES * 64)
+#define HAL_ADC_READ_TIMEOUT_MS 20
+#define HAL_EVENT_QUEUE_LENGTH 8
+#define HAL_MAX_TIMERS 4
+#define HAL_EVENT_TIMER_WAKE 0xFFFF     // queued by an expired timer to wake the receiver, never returned
+#define HAL_PULSE_LIMIT 32000   // the unit's own count stays within 16 bit, the driver accumulates past it
+
+static adc_continuous_handle_t adc_stream;
+static adc_cali_handle_t calibration_handles[HAL_MAX_ADC_CHANNELS] = {0};
+static adc_digi_pattern_config_t adc_patterns[HAL_MAX_ADC_CHANNELS];
+static int adc_channel_count;
+static uint8_t adc_frame[HAL_ADC_FRAME_BYTES];
+#ifdef CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t awake_lock;
+#endif
+static pcnt_unit_handle_t pulse_unit;
+static const esp_partition_t *history_partition;
+static QueueHandle_t event_queue;
+static esp_timer_handle_t timers[HAL_MAX_TIMERS];
+static hal_event_t timer_events[HAL_MAX_TIMERS];
+static atomic_uint timers_pending;      // expired timers whose event has not been taken yet, bit per timer
+#ifdef HAL_STATIC_ALLOCATION
+#define HAL_STACK_ALIGN 16
+static StaticQueue_t event_queue_buffer;
+static uint8_t event_queue_storage[HAL_EVENT_QUEUE_LENGTH * sizeof(hal_event_t)];
+static StaticTask_t task_buffers[TASK_COUNT];
+static StackType_t task_stacks[TASK_STACK_ARENA] __attribute__((aligned(HAL_STACK_ALIGN)));
+static int task_count;
+static uint32_t task_stacks_used;
+#endif
+
+static bool adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_atten_t atten, adc_cali_handle_t *out_handle)
+{
+    adc_cali_handle_t handle = NULL;
+    esp_err_t ret = ESP_FAIL;
+    bool calibrated = false;
+
+    ESP_LOGD(TAG, "calibration scheme version is %s", "Curve Fitting");
+    adc_cali_curve_fitting_config_t cali_config = {
+        .unit_id = unit,
+        .chan = channel,
+        .atten = atten,
+        .bitwidth = ADC_BITWIDTH_DEFAULT,
+    };
+    ret = adc_cali_create_scheme_curve_fitting(&cali_config, &handle);
+    if (ret == ESP_OK) {
+        calibrated = true;
+    }
+
+    *out_handle = handle;
+    if (ret == ESP_OK) {
+        ESP_LOGD(TAG, "Calibration Success");
+    } else if (ret == ESP_ERR_NOT_SUPPORTED || !calibrated) {
+        ESP_LOGW(TAG, "eFuse not burnt, skip software calibration");
+    } else {
+        ESP_LOGE(TAG, "Invalid arg or no memory");
+    }
+
+    return calibrated;
+}
+
+esp_err_t hal_gpio_init_outputs(uint64_t pin_mask) {
+    gpio_config_t io_conf = {};
+    io_conf.intr_type = GPIO_INTR_DISABLE;
+    io_conf.mode = GPIO_MODE_INPUT_OUTPUT;
+    io_conf.pin_bit_mask = pin_mask;
+    io_conf.pull_down_en = 0;
+    io_conf.pull_up_en = 0;
+    return gpio_config(&io_conf);
+}
+
+esp_err_t hal_gpio_set_level(gpio_num_t pin, uint32_t level) {
+    return gpio_set_level(pin, level);
+}
+
+/* With power management on, a started unit holds an APB frequency lock, which keeps light sleep off as well */
+esp_err_t hal_pulse_init(gpio_num_t pin, uint32_t glitch_ns) {
+    pcnt_unit_config_t unit_config = {
+        .low_limit = -1,
+        .high_limit = HAL_PULSE_LIMIT,
+        .flags.accum_count = 1,     // the only interrupt is at the limit, where the count is folded into the total
+    };
+    ESP_RETURN_ON_ERROR(pcnt_new_unit(&unit_config, &pulse_unit), TAG, "Failed to create pulse counter");
+    pcnt_glitch_filter_config_t filter_config = { .max_glitch_ns = glitch_ns };
+    ESP_RETURN_ON_ERROR(pcnt_unit_set_glitch_filter(pulse_unit, &filter_config), TAG, "Failed to set glitch filter");
+    pcnt_chan_config_t channel_config = { .edge_gpio_num = pin, .level_gpio_num = -1 };
+    pcnt_channel_handle_t channel;
+    ESP_RETURN_ON_ERROR(pcnt_new_channel(pulse_unit, &channel_config, &channel), TAG, "Failed to create pulse channel");
+    ESP_RETURN_ON_ERROR(pcnt_channel_set_edge_action(channel, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_HOLD),
+                        TAG, "Failed to set pulse edges");
+    ESP_RETURN_ON_ERROR(pcnt_unit_add_watch_point(pulse_unit, HAL_PULSE_LIMIT), TAG, "Failed to add pulse limit");
+    ESP_RETURN_ON_ERROR(pcnt_unit_enable(pulse_unit), TAG, "Failed to enable pulse counter");
+    return pcnt_unit_clear_count(pulse_unit);
+}
+
+esp_err_t hal_pulse_start(void) {
+    return pulse_unit ? pcnt_unit_start(pulse_unit) : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t hal_pulse_stop(void) {
+    return pulse_unit ? pcnt_unit_stop(pulse_unit) : ESP_ERR_INVALID_STATE;
+}
+
+uint32_t hal_pulse_count(void) {
+    int count = 0;
+    if (pulse_unit) {
+        pcnt_unit_get_count(pulse_unit, &count);
+    }
+    return (uint32_t)count;
+}
+
+bool hal_adc_init(const int *channels, int count) {
+    adc_continuous_handle_cfg_t handle_config = {
+        .max_store_buf_size = HAL_ADC_FRAME_BYTES * 4,
+        .conv_frame_size = HAL_ADC_FRAME_BYTES,
+        .flags.flush_pool = 1,  // a full pool drops its oldest frames, reads after a pause return fresh data
+    };
+    ESP_ERROR_CHECK(adc_continuous_new_handle(&handle_config, &adc_stream));
+
+    bool calibrated = true;
+    adc_channel_count = count < HAL_MAX_ADC_CHANNELS ? count : HAL_MAX_ADC_CHANNELS;
+    for (int i = 0; i < adc_channel_count; i++) {
+        adc_patterns[i].atten = ATTN;
+        adc_patterns[i].channel = channels[i] & 0x7;
+        adc_patterns[i].unit = ADC_UNIT_1;
+        adc_patterns[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+        calibrated &= adc_calibration_init(ADC_UNIT_1, channels[i], ATTN, &calibration_handles[i]);
+    }
+    return calibrated;
+}
+
+esp_err_t hal_adc_stream_start(uint32_t freq_hz) {
+    adc_continuous_config_t config = {
+        .pattern_num = adc_channel_count,
+        .adc_pattern = adc_patterns,
+        .sample_freq_hz = freq_hz,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
+    };
+    esp_err_t ret = adc_continuous_config(adc_stream, &config);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    return adc_continuous_start(adc_stream);
+}
+
+esp_err_t hal_adc_stream_read(hal_adc_sample_t *samples, int max, int *count) {
+    uint32_t length = 0;
+    uint32_t wanted = max * SOC_ADC_DIGI_RESULT_BYTES;
+    if (wanted > HAL_ADC_FRAME_BYTES) {
+        wanted = HAL_ADC_FRAME_BYTES;
+    }
+    *count = 0;
+    esp_err_t ret = adc_continuous_read(adc_stream, adc_frame, wanted, &length, HAL_ADC_READ_TIMEOUT_MS);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    for (uint32_t offset = 0; offset < length; offset += SOC_ADC_DIGI_RESULT_BYTES) {
+        adc_digi_output_data_t *data = (adc_digi_output_data_t *)&adc_frame[offset];
+        for (int i = 0; i < adc_channel_count; i++) {
+            if (adc_patterns[i].channel == data->type2.channel) {
+                samples[*count].index = i;
+                samples[*count].raw = data->type2.data;
+                (*count)++;
+                break;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t hal_adc_stream_stop(void) {
+    return adc_continuous_stop(adc_stream);
+}
+
+esp_err_t hal_adc_raw_to_mv(int index, int raw, int *mv) {
+    if (!calibration_handles[index]) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return adc_cali_raw_to_voltage(calibration_handles[index], raw, mv);
+}
+
+static const esp_partition_t *history_part(void) {
+    if (!history_partition) {
+        history_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "history");
+    }
+    return history_partition;
+}
+
+uint32_t hal_history_size(void) {
+    return history_part() ? history_part()->size : 0;
+}
+
+esp_err_t hal_history_read(uint32_t offset, void *buf, size_t len) {
+    return history_part() ? esp_partition_read(history_part(), offset, buf, len) : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t hal_history_write(uint32_t offset, const void *buf, size_t len) {
+    return history_part() ? esp_partition_write(history_part(), offset, buf, len) : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t hal_history_erase(uint32_t offset, size_t len) {
+    return history_part() ? esp_partition_erase_range(history_part(), offset, len) : ESP_ERR_NOT_FOUND;
+}
+
+int64_t hal_time_us(void) {
+    return esp_timer_get_time();
+}
+
+uint32_t hal_cycle_count(void) {
+    return esp_cpu_get_cycle_count();
+}
+
+/* The event itself is not queued, so a queue full of commands cannot lose it: the bit is taken by the next
+   hal_event_wait, and a full queue means the receiver is awake anyway */
+static void timer_expired(void *arg) {
+    int timer = (int)arg;
+    atomic_fetch_or(&timers_pending, 1u << timer);
+    hal_event_t wake = { .type = HAL_EVENT_TIMER_WAKE };
+    xQueueSend(event_queue, &wake, 0);
+}
+
+esp_err_t hal_events_init(int timer_count) {
+    if (event_queue) {
+        return ESP_OK;
+    }
+    ESP_RETURN_ON_FALSE(timer_count <= HAL_MAX_TIMERS, ESP_ERR_INVALID_ARG, TAG, "Too many timers (%d)", timer_count);
+#ifdef HAL_STATIC_ALLOCATION
+    event_queue = xQueueCreateStatic(HAL_EVENT_QUEUE_LENGTH, sizeof(hal_event_t), event_queue_storage, &event_queue_buffer);
+#else
+    event_queue = xQueueCreate(HAL_EVENT_QUEUE_LENGTH, sizeof(hal_event_t));
+#endif
+    ESP_RETURN_ON_FALSE(event_queue, ESP_ERR_NO_MEM, TAG, "No memory for event queue");
+#ifdef CONFIG_PM_ENABLE
+    ESP_RETURN_ON_ERROR(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "measure", &awake_lock), TAG, "Failed to create PM lock");
+#endif
+    for (int i = 0; i < timer_count; i++) {
+        esp_timer_create_args_t args = {
+            .callback = timer_expired,
+            .arg = (void *)i,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "driver",
+        };
+        ESP_RETURN_ON_ERROR(esp_timer_create(&args, &timers[i]), TAG, "Failed to create timer %d", i);
+    }
+    return ESP_OK;
+}
+
+esp_err_t hal_event_post(const hal_event_t *event, bool urgent) {
+    BaseType_t ok = urgent ? xQueueSendToFront(event_queue, event, 0) : xQueueSend(event_queue, event, 0);
+    return ok == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+/* Expired timers first, lowest number first, then the queue */
+bool hal_event_wait(hal_event_t *event) {
+    while (true) {
+        unsigned pending = atomic_load(&timers_pending);
+        if (pending) {
+            int timer = __builtin_ctz(pending);
+            atomic_fetch_and(&timers_pending, ~(1u << timer));
+            *event = timer_events[timer];
+            return true;
+        }
+        if (xQueueReceive(event_queue, event, portMAX_DELAY) != pdTRUE) {
+            return false;
+        }
+        if (event->type != HAL_EVENT_TIMER_WAKE) {
+            return true;
+        }
+    }
+}
+
+esp_err_t hal_timer_schedule(int timer, uint32_t delay_ms, const hal_event_t *event) {
+    esp_timer_stop(timers[timer]);  // not running is fine
+    atomic_fetch_and(&timers_pending, ~(1u << timer));
+    timer_events[timer] = *event;
+    return esp_timer_start_once(timers[timer], (uint64_t)delay_ms * 1000);
+}
+
+void hal_timer_cancel(int timer) {
+    esp_timer_stop(timers[timer]);
+    atomic_fetch_and(&timers_pending, ~(1u << timer));
+}
+
+void hal_stay_awake(bool on) {
+#ifdef CONFIG_PM_ENABLE
+    if (!awake_lock) {
+        return;     // before hal_events_init
+    }
+    if (on) {
+        esp_pm_lock_acquire(awake_lock);
+    } else {
+        esp_pm_lock_release(awake_lock);
+    }
+#endif
+}
+
+esp_err_t hal_task_create(hal_task_fn_t fn, const char *name, uint32_t stack_size, int priority) {
+#ifdef HAL_STATIC_ALLOCATION
+    uint32_t size = (stack_size + HAL_STACK_ALIGN - 1) & ~(HAL_STACK_ALIGN - 1);
+    ESP_RETURN_ON_FALSE(task_count < TASK_COUNT && task_stacks_used + size <= TASK_STACK_ARENA, ESP_ERR_NO_MEM, TAG,
+                        "No static stack left for %s (%lu bytes), see task_config.h", name, (unsigned long)stack_size);
+    /* StackType_t is a byte on ESP-IDF, sizes are in bytes throughout */
+    TaskHandle_t task = xTaskCreateStatic(fn, name, size, NULL, priority, &task_stacks[task_stacks_used], &task_buffers[task_count]);
+    ESP_RETURN_ON_FALSE(task, ESP_FAIL, TAG, "Failed to create %s", name);
+    task_count++;
+    task_stacks_used += size;
+    return ESP_OK;
+#else
+    return (xTaskCreate(fn, name, stack_size, NULL, priority, NULL) == pdPASS) ? ESP_OK : ESP_FAIL;
+#endif
+}
+
+typedef struct {
+    hal_task_fn_t fn;
+    void *arg;
+    uint32_t stack_size;
+    uint32_t stack_used;
+    SemaphoreHandle_t done;
+} stack_run_t;
+
+static void stack_run_task(void *pvParameters) {
+    stack_run_t *run = pvParameters;
+    run->fn(run->arg);
+    run->stack_used = run->stack_size - uxTaskGetStackHighWaterMark(NULL);    // bytes on ESP-IDF
+    xSemaphoreGive(run->done);
+    vTaskDelete(NULL);
+}
+
+esp_err_t hal_run_on_stack(hal_task_fn_t fn, void *arg, uint32_t stack_size, uint32_t *stack_used) {
+    stack_run_t run = { .fn = fn, .arg = arg, .stack_size = stack_size, .done = xSemaphoreCreateBinary() };
+    ESP_RETURN_ON_FALSE(run.done, ESP_ERR_NO_MEM, TAG, "No semaphore for the stack run");
+    // same priority as the caller, which blocks right away
+    if (xTaskCreate(stack_run_task, "stack_run", stack_size, &run, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+        vSemaphoreDelete(run.done);
+        return ESP_ERR_NO_MEM;
+    }
+    xSemaphoreTake(run.done, portMAX_DELAY);
+    vSemaphoreDelete(run.done);
+    *stack_used = run.stack_used;
+    return ESP_OK;
+}
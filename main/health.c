@@ -0,0 +1,180 @@
+#include "health.h"
+#include "conversion.h"
+#include "zones.h"
+#include "dlog.h"
+#include <stdlib.h>
+
+static const char *TAG = "HEALTH";
+
+typedef struct {
+    int last_raw;
+    uint16_t same_count;        // readings in a row with the code of the one before
+    uint8_t low_count;
+    uint8_t high_count;
+    uint8_t good_count;         // neither low nor high
+    uint8_t faults;
+    bool drift_excluded;
+    bool held;                  // the previous reading was held back
+    int16_t last_humidity;      // previous valid reading, for the step statistics
+    int16_t accepted;           // last reading handed to the decision
+    uint32_t step_square;       // weighted mean of the squared step, (1/100 %)^2
+    int32_t deviation;          // weighted mean deviation from the zone's other sensors, 1/100 %
+} channel_health_t;
+
+static channel_health_t channels[SENSOR_COUNT];
+static health_stats_t stats;
+
+static uint8_t count_up(uint8_t count) {
+    return count < UINT8_MAX ? count + 1 : count;
+}
+
+static uint8_t channel_faults(channel_health_t *c, int raw, int16_t humidity) {
+    uint8_t faults = c->faults;
+
+    bool low = raw <= HEALTH_RAIL_CODES;
+    bool high = raw >= CONVERSION_RAW_MAX - HEALTH_RAIL_CODES;
+    c->low_count = low ? count_up(c->low_count) : 0;
+    c->high_count = high ? count_up(c->high_count) : 0;
+    c->good_count = low || high ? 0 : count_up(c->good_count);
+    if (c->low_count >= HEALTH_RAIL_READINGS) {
+        faults |= HEALTH_OPEN;
+    }
+    if (c->high_count >= HEALTH_RAIL_READINGS) {
+        faults |= HEALTH_SATURATED;
+    }
+    if (c->good_count >= HEALTH_CLEAR_READINGS) {
+        faults &= ~(HEALTH_OPEN | HEALTH_SATURATED);
+    }
+
+    // a railed input repeats its code as well, that is reported as open or saturated only
+    c->same_count = raw == c->last_raw && c->same_count < UINT16_MAX ? c->same_count + 1 : 0;
+    c->last_raw = raw;
+    if (c->same_count + 1 >= HEALTH_STUCK_READINGS && !low && !high) {
+        faults |= HEALTH_STUCK;
+    } else {
+        faults &= ~HEALTH_STUCK;
+    }
+
+    if (humidity != CONVERSION_INVALID) {
+        if (c->last_humidity != CONVERSION_INVALID) {
+            int32_t step = humidity - c->last_humidity;
+            c->step_square += ((uint32_t)(step * step) >> HEALTH_NOISE_SHIFT) - (c->step_square >> HEALTH_NOISE_SHIFT);
+        }
+        c->last_humidity = humidity;
+    }
+    if (c->step_square > (uint32_t)HEALTH_NOISE_MAX * HEALTH_NOISE_MAX) {
+        faults |= HEALTH_NOISY;
+    } else if (c->step_square < (uint32_t)HEALTH_NOISE_MAX * HEALTH_NOISE_MAX / 4) {
+        faults &= ~HEALTH_NOISY;
+    }
+    return faults;
+}
+
+// A fall the soil cannot dry in one interval is held back once, the next reading either confirms it or not
+static int16_t channel_accept(channel_health_t *c, int16_t humidity) {
+    if (humidity == CONVERSION_INVALID) {
+        return humidity;
+    }
+    bool drop = c->accepted != CONVERSION_INVALID && humidity < c->accepted - HEALTH_MAX_DROP;
+    if (drop && !c->held) {
+        c->held = true;
+        stats.outliers++;
+        return CONVERSION_INVALID;
+    }
+    if (drop) {
+        stats.confirmed++;
+    }
+    c->held = false;
+    c->accepted = humidity;
+    return humidity;
+}
+
+// Drift needs two usable sensors in a zone. With only two both deviate alike, so they are flagged but kept.
+static void zone_drift(int zone, int16_t *usable) {
+    uint32_t mask = zones_get(zone)->sensor_mask;
+    int32_t sum = 0;
+    int n = 0;
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        if (!(mask & (1u << i))) {
+            continue;
+        }
+        channels[i].drift_excluded = false;
+        if (usable[i] != CONVERSION_INVALID) {
+            sum += usable[i];
+            n++;
+        }
+    }
+    if (n < 2) {
+        return;
+    }
+    bool agreeing = false;
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        channel_health_t *c = &channels[i];
+        if (!(mask & (1u << i)) || usable[i] == CONVERSION_INVALID) {
+            continue;
+        }
+        int32_t deviation = usable[i] - (sum - usable[i]) / (n - 1);
+        c->deviation += (deviation - c->deviation) / (1 << HEALTH_DRIFT_SHIFT);
+        if (abs(c->deviation) > HEALTH_DRIFT_MAX) {
+            c->faults |= HEALTH_DRIFT;
+        } else if (abs(c->deviation) < HEALTH_DRIFT_MAX * 2 / 3) {
+            c->faults &= ~HEALTH_DRIFT;
+        }
+        agreeing |= !(c->faults & HEALTH_DRIFT);
+    }
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        channel_health_t *c = &channels[i];
+        if ((mask & (1u << i)) && usable[i] != CONVERSION_INVALID && agreeing && (c->faults & HEALTH_DRIFT)) {
+            c->drift_excluded = true;
+            usable[i] = CONVERSION_INVALID;
+        }
+    }
+}
+
+void health_init(void) {
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        channels[i] = (channel_health_t) {
+            .last_raw = -1,
+            .last_humidity = CONVERSION_INVALID,
+            .accepted = CONVERSION_INVALID,
+        };
+    }
+    stats = (health_stats_t) {0};
+}
+
+uint32_t health_update(const int *raw, const int16_t *humidity, int16_t *usable) {
+    uint8_t before[SENSOR_COUNT];
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        channel_health_t *c = &channels[i];
+        before[i] = c->faults;
+        c->faults = channel_faults(c, raw[i], humidity[i]);
+        usable[i] = c->faults & HEALTH_EXCLUDING ? CONVERSION_INVALID : channel_accept(c, humidity[i]);
+    }
+    for (int z = 0; z < zones_count(); z++) {
+        zone_drift(z, usable);
+    }
+    uint32_t changed = 0;
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        uint8_t raised = channels[i].faults & ~before[i];
+        for (; raised; raised &= raised - 1) {
+            stats.faults_raised++;
+        }
+        if (channels[i].faults != before[i]) {
+            DLOGW(TAG, "Sensor %d: faults 0x%02x (were 0x%02x)", i, channels[i].faults, before[i]);
+            changed |= 1u << i;
+        }
+    }
+    return changed;
+}
+
+uint8_t health_faults(int channel) {
+    return channels[channel].faults;
+}
+
+bool health_excluded(int channel) {
+    return (channels[channel].faults & HEALTH_EXCLUDING) || channels[channel].drift_excluded;
+}
+
+const health_stats_t *health_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver.h"
+
+// Streaming sensor health. Every acquisition cycle updates a few integers per channel: run lengths for stuck and
+// railed readings and exponentially weighted statistics (mean squared step between readings, deviation from the
+// other sensors of the zone), so the memory stays constant however long the window. Faulty channels are left out
+// of the watering decision, a single implausible drop is held back until the next reading confirms it.
+
+#define HEALTH_RAIL_CODES           40      // ADC codes from either end of the range, about 32 mV
+#define HEALTH_RAIL_READINGS        2       // open / saturated after this many railed readings in a row
+#define HEALTH_CLEAR_READINGS       3       // rail faults clear after this many good readings in a row
+#define HEALTH_STUCK_READINGS       24      // identical codes in a row, a live probe always shows a few codes of noise
+#define HEALTH_NOISE_SHIFT          3       // weight 1/8 for the newest step
+#define HEALTH_NOISE_MAX            1000    // 1/100 %, rms step between readings above which a channel is noisy
+#define HEALTH_MAX_DROP             1500    // 1/100 %, a larger fall since the last accepted reading needs confirming
+#define HEALTH_DRIFT_SHIFT          4       // weight 1/16 for the newest deviation
+#define HEALTH_DRIFT_MAX            3000    // 1/100 %, deviation from the zone's other sensors
+
+typedef enum {
+    HEALTH_STUCK        = 1 << 0,
+    HEALTH_OPEN         = 1 << 1,   // reads close to 0 V: signal or supply wire broken
+    HEALTH_SATURATED    = 1 << 2,   // reads close to full scale: shorted to supply or probe broken
+    HEALTH_NOISY        = 1 << 3,
+    HEALTH_DRIFT        = 1 << 4,   // excluded only while another sensor of the zone agrees with the rest
+} health_fault_t;
+
+#define HEALTH_EXCLUDING    (HEALTH_STUCK | HEALTH_OPEN | HEALTH_SATURATED | HEALTH_NOISY)
+
+typedef struct {
+    uint32_t faults_raised;     // fault flags set, over all channels
+    uint32_t outliers;          // readings held back for confirmation
+    uint32_t confirmed;         // of those, confirmed by the next reading
+} health_stats_t;
+
+void health_init(void);
+// One acquisition cycle: raw codes and converted humidity (1/100 %) of every sensor. usable gets what the watering
+// decision may use, CONVERSION_INVALID for excluded channels and held back readings. Returns the mask of channels
+// whose fault flags changed.
+uint32_t health_update(const int *raw, const int16_t *humidity, int16_t *usable);
+uint8_t health_faults(int channel);
+bool health_excluded(int channel);
+const health_stats_t *health_stats(void);
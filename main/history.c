@@ -0,0 +1,569 @@
+#include "history.h"
+#include "driver.h"
+#include "hal.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "HISTORY";
+
+#define HISTORY_REPEAT_MAX 62   // 0xFF must never start a record
+#define HISTORY_READ_CACHE 64
+
+typedef struct {
+    uint32_t anchor_s;                  // time of the last humidity frame, sector base before the first one
+    uint32_t last_dt;
+    int32_t values[SENSOR_COUNT];       // in stored steps
+    bool have_frame;
+} codec_state_t;
+
+typedef struct {
+    uint32_t seq;
+    uint32_t first_s;
+    uint32_t last_s;
+    uint32_t length;                    // header plus flushed records
+    bool valid;
+} sector_index_t;
+
+typedef struct {
+    const uint8_t *mem;                 // memory image, or NULL to read the flash sector
+    uint32_t sector;
+    uint32_t len;
+    uint32_t pos;
+    uint8_t cache[HISTORY_READ_CACHE];
+    uint32_t cache_start;
+    uint32_t cache_len;
+} reader_t;
+
+static sector_index_t sector_index[HISTORY_MAX_SECTORS];
+static int sector_count;
+static int head = -1;                   // sector being appended to
+static codec_state_t enc;
+static uint8_t write_buffer[HISTORY_WRITE_BUFFER_SIZE];
+static uint32_t write_len;
+static uint32_t unflushed_since_s;
+static uint32_t repeat;
+static int32_t stored_values[SENSOR_COUNT];
+static bool stored_valid;
+static int32_t frame_values[SENSOR_COUNT];
+static uint32_t frame_mask;
+static int64_t frame_time_us;
+static uint32_t epoch_offset_s;
+static history_stats_t stats;
+
+/****** DECODING */
+
+static int reader_byte(reader_t *r) {
+    if (r->pos >= r->len) {
+        return -1;
+    }
+    if (r->mem) {
+        return r->mem[r->pos++];
+    }
+    if (r->pos < r->cache_start || r->pos >= r->cache_start + r->cache_len) {
+        uint32_t chunk = r->len - r->pos < HISTORY_READ_CACHE ? r->len - r->pos : HISTORY_READ_CACHE;
+        if (hal_history_read(r->sector * HISTORY_SECTOR_SIZE + r->pos, r->cache, chunk) != ESP_OK) {
+            return -1;
+        }
+        r->cache_start = r->pos;
+        r->cache_len = chunk;
+    }
+    return r->cache[r->pos++ - r->cache_start];
+}
+
+static bool read_varint(reader_t *r, uint32_t *out) {
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int b = reader_byte(r);
+        if (b < 0) {
+            return false;
+        }
+        value |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *out = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static bool emit_frame(const codec_state_t *st, int channels, history_visitor_t visitor, void *ctx) {
+    for (int i = 0; i < channels; i++) {
+        history_record_t record = {
+            .time_s = st->anchor_s, .kind = HISTORY_HUMIDITY, .channel = i,
+            .value = st->values[i] * HISTORY_HUMIDITY_RESOLUTION,
+        };
+        if (visitor && !visitor(&record, ctx)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decodes records until the end of the sector, leaves the codec state and the end offset behind for the encoder
+static esp_err_t decode_sector(reader_t *r, history_visitor_t visitor, void *ctx, codec_state_t *st, uint32_t *end, uint32_t *last_s) {
+    history_sector_header_t header;
+    uint8_t *raw = (uint8_t *)&header;
+    for (int i = 0; i < sizeof(header); i++) {
+        int b = reader_byte(r);
+        if (b < 0) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        raw[i] = b;
+    }
+    if (header.magic != HISTORY_MAGIC || header.version != HISTORY_VERSION || header.channels != SENSOR_COUNT) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->anchor_s = header.base_time_s;
+    *last_s = header.base_time_s;
+    bool visiting = true;
+
+    while (true) {
+        *end = r->pos;
+        int b = reader_byte(r);
+        if (b < 0 || b == 0xFF) {
+            break;
+        }
+        uint32_t dt, v;
+        switch (b >> 6) {
+        case 0:
+            if (b & 0x20) {
+                if (!st->have_frame) {
+                    return ESP_ERR_INVALID_STATE;
+                }
+                dt = st->last_dt;
+            } else if (!read_varint(r, &dt)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            if (b & 0x10) {
+                for (int i = 0; i < SENSOR_COUNT; i += 2) {
+                    int packed = reader_byte(r);
+                    if (packed < 0) {
+                        return ESP_ERR_INVALID_SIZE;
+                    }
+                    st->values[i] += (int8_t)(packed << 4) >> 4;
+                    if (i + 1 < SENSOR_COUNT) {
+                        st->values[i + 1] += (int8_t)packed >> 4;
+                    }
+                }
+            } else {
+                for (int i = 0; i < SENSOR_COUNT; i++) {
+                    if (!read_varint(r, &v)) {
+                        return ESP_ERR_INVALID_SIZE;
+                    }
+                    st->values[i] += unzigzag(v);
+                }
+            }
+            st->anchor_s += dt;
+            st->last_dt = dt;
+            st->have_frame = true;
+            visiting = visiting && emit_frame(st, SENSOR_COUNT, visitor, ctx);
+            *last_s = st->anchor_s;
+            break;
+        case 1:
+        case 2:
+            if (!read_varint(r, &dt) || !read_varint(r, &v)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            if (visiting && visitor) {
+                history_record_t record = {
+                    .time_s = st->anchor_s + dt, .kind = (b >> 6) == 1 ? HISTORY_CONSUMPTION : HISTORY_PUMP,
+                    .channel = b & 0x3F, .value = unzigzag(v),
+                };
+                visiting = visitor(&record, ctx);
+            }
+            if (st->anchor_s + dt > *last_s) {
+                *last_s = st->anchor_s + dt;
+            }
+            break;
+        case 3:
+            if (!st->have_frame) {
+                return ESP_ERR_INVALID_STATE;
+            }
+            for (int n = b & 0x3F; n > 0; n--) {
+                st->anchor_s += st->last_dt;
+                visiting = visiting && emit_frame(st, SENSOR_COUNT, visitor, ctx);
+            }
+            *last_s = st->anchor_s;
+            break;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t history_decode(const uint8_t *data, size_t len, history_visitor_t visitor, void *ctx) {
+    reader_t r = { .mem = data, .len = len };
+    codec_state_t st;
+    uint32_t end, last_s;
+    return decode_sector(&r, visitor, ctx, &st, &end, &last_s);
+}
+
+/****** ENCODING */
+
+static int put_varint(uint8_t *out, uint32_t value) {
+    int n = 0;
+    do {
+        uint8_t b = value & 0x7F;
+        value >>= 7;
+        out[n++] = b | (value ? 0x80 : 0);
+    } while (value);
+    return n;
+}
+
+static uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static esp_err_t write_out(void) {
+    if (!write_len) {
+        return ESP_OK;
+    }
+    sector_index_t *s = &sector_index[head];
+    esp_err_t ret = hal_history_write(head * HISTORY_SECTOR_SIZE + s->length, write_buffer, write_len);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Flash write failed: %s", esp_err_to_name(ret));
+    }
+    s->length += write_len;
+    stats.bytes_used += write_len;
+    stats.flash_writes++;
+    write_len = 0;
+    return ret;
+}
+
+// Room left in the head sector, the byte needed to close a pending repeat is already taken off
+static int32_t space_left(void) {
+    if (head < 0) {
+        return -1;
+    }
+    return HISTORY_SECTOR_SIZE - (int32_t)(sector_index[head].length + write_len + (repeat ? 1 : 0));
+}
+
+static void buffer_bytes(const uint8_t *data, uint32_t len, uint32_t time_s) {
+    if (write_len + len > HISTORY_WRITE_BUFFER_SIZE) {
+        write_out();
+    }
+    if (!write_len) {
+        unflushed_since_s = time_s;
+    }
+    memcpy(&write_buffer[write_len], data, len);
+    write_len += len;
+}
+
+static void close_repeat(void) {
+    if (repeat) {
+        uint8_t b = 0xC0 | repeat;
+        buffer_bytes(&b, 1, enc.anchor_s);
+        repeat = 0;
+    }
+}
+
+static void open_sector(uint32_t time_s) {
+    close_repeat();
+    write_out();
+
+    int next = head < 0 ? 0 : (head + 1) % sector_count;
+    uint32_t seq = head < 0 ? 1 : sector_index[head].seq + 1;
+    sector_index_t *s = &sector_index[next];
+    if (s->valid) {
+        stats.bytes_used -= s->length;
+        stats.sectors_used--;
+    }
+    if (hal_history_erase(next * HISTORY_SECTOR_SIZE, HISTORY_SECTOR_SIZE) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to erase sector %d", next);
+    }
+    stats.sector_erases++;
+
+    history_sector_header_t header = {
+        .magic = HISTORY_MAGIC, .version = HISTORY_VERSION, .channels = SENSOR_COUNT,
+        .seq = seq, .base_time_s = time_s,
+    };
+    hal_history_write(next * HISTORY_SECTOR_SIZE, &header, sizeof(header));
+    stats.flash_writes++;
+
+    *s = (sector_index_t) { .seq = seq, .first_s = time_s, .last_s = time_s, .length = sizeof(header), .valid = true };
+    stats.bytes_used += sizeof(header);
+    stats.sectors_used++;
+    head = next;
+    memset(&enc, 0, sizeof(enc));
+    enc.anchor_s = time_s;
+}
+
+static void maybe_flush(uint32_t time_s) {
+    if (write_len && time_s - unflushed_since_s >= HISTORY_FLUSH_INTERVAL_S) {
+        close_repeat();
+        write_out();
+    }
+}
+
+static void append_frame(uint32_t time_s, const int32_t *values) {
+    uint8_t record[2 + 5 + 5 * SENSOR_COUNT];
+
+    while (true) {
+        if (head < 0) {
+            open_sector(time_s);
+        }
+        uint32_t dt = time_s > enc.anchor_s ? time_s - enc.anchor_s : 0;
+        int32_t deltas[SENSOR_COUNT];
+        bool unchanged = true;
+        bool small = true;
+        for (int i = 0; i < SENSOR_COUNT; i++) {
+            deltas[i] = values[i] - enc.values[i];
+            unchanged &= deltas[i] == 0;
+            small &= deltas[i] >= -8 && deltas[i] <= 7;
+        }
+        bool same_dt = enc.have_frame && dt == enc.last_dt;
+
+        if (same_dt && unchanged) {
+            if (!repeat || repeat == HISTORY_REPEAT_MAX) {
+                // starting a repeat takes the byte that closes it later
+                if (space_left() < 1) {
+                    open_sector(time_s);
+                    continue;
+                }
+                close_repeat();
+            }
+            repeat++;
+            enc.anchor_s += dt;
+            break;
+        }
+
+        int len = 1;
+        record[0] = (same_dt ? 0x20 : 0) | (small ? 0x10 : 0);
+        if (!same_dt) {
+            len += put_varint(&record[len], dt);
+        }
+        if (small) {
+            for (int i = 0; i < SENSOR_COUNT; i += 2) {
+                record[len++] = (deltas[i] & 0x0F) | (i + 1 < SENSOR_COUNT ? (deltas[i + 1] & 0x0F) << 4 : 0);
+            }
+        } else {
+            for (int i = 0; i < SENSOR_COUNT; i++) {
+                len += put_varint(&record[len], zigzag(deltas[i]));
+            }
+        }
+
+        if (len > space_left()) {
+            // sector full, deltas restart against the fresh one
+            open_sector(time_s);
+            continue;
+        }
+        close_repeat();
+        buffer_bytes(record, len, time_s);
+        memcpy(enc.values, values, sizeof(enc.values));
+        enc.anchor_s += dt;
+        enc.last_dt = dt;
+        enc.have_frame = true;
+        break;
+    }
+    sector_index[head].last_s = time_s;
+    stats.records++;
+    maybe_flush(time_s);
+}
+
+static void append_event(uint32_t time_s, history_kind_t kind, int channel, int32_t value) {
+    uint8_t record[1 + 5 + 5];
+
+    while (true) {
+        if (head < 0) {
+            open_sector(time_s);
+        }
+        uint32_t dt = time_s > enc.anchor_s ? time_s - enc.anchor_s : 0;
+        int len = 1;
+        record[0] = (kind == HISTORY_CONSUMPTION ? 0x40 : 0x80) | (channel & 0x3F);
+        len += put_varint(&record[len], dt);
+        len += put_varint(&record[len], zigzag(value));
+        if (len > space_left()) {
+            open_sector(time_s);
+            continue;
+        }
+        close_repeat();
+        buffer_bytes(record, len, time_s);
+        break;
+    }
+    if (time_s > sector_index[head].last_s) {
+        sector_index[head].last_s = time_s;
+    }
+    stats.records++;
+    maybe_flush(time_s);
+}
+
+/****** PUBLIC */
+
+esp_err_t history_init(void) {
+    uint32_t size = hal_history_size();
+    sector_count = size / HISTORY_SECTOR_SIZE;
+    if (sector_count > HISTORY_MAX_SECTORS) {
+        sector_count = HISTORY_MAX_SECTORS;
+    }
+    if (sector_count < 2) {
+        ESP_LOGW(TAG, "No usable history partition (%lu bytes)", (unsigned long)size);
+        sector_count = 0;
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    head = -1;
+    for (int i = 0; i < sector_count; i++) {
+        reader_t r = { .sector = i, .len = HISTORY_SECTOR_SIZE };
+        codec_state_t st;
+        uint32_t end, last_s;
+        sector_index_t *s = &sector_index[i];
+        memset(s, 0, sizeof(*s));
+        if (decode_sector(&r, NULL, NULL, &st, &end, &last_s) != ESP_OK) {
+            continue;
+        }
+        history_sector_header_t header;
+        hal_history_read(i * HISTORY_SECTOR_SIZE, &header, sizeof(header));
+        *s = (sector_index_t) { .seq = header.seq, .first_s = header.base_time_s, .last_s = last_s, .length = end, .valid = true };
+        stats.sectors_used++;
+        stats.bytes_used += end;
+        if (head < 0 || s->seq > sector_index[head].seq) {
+            head = i;
+            enc = st;
+        }
+    }
+
+    if (head >= 0) {
+        epoch_offset_s = sector_index[head].last_s + 1 - (uint32_t)(hal_time_us() / 1000000);
+    }
+    ESP_LOGI(TAG, "History: %lu sectors of %d, %lu bytes used", (unsigned long)stats.sectors_used, sector_count,
+             (unsigned long)stats.bytes_used);
+    return ESP_OK;
+}
+
+uint32_t history_time(int64_t time_us) {
+    return epoch_offset_s + (uint32_t)(time_us / 1000000);
+}
+
+void history_append_sample(const sample_t *sample) {
+    if (!sector_count) {
+        return;
+    }
+    if (sample->kind == SAMPLE_CONSUMPTION || sample->kind == SAMPLE_PUMP) {
+        append_event(history_time(sample->time_us), sample->kind == SAMPLE_PUMP ? HISTORY_PUMP : HISTORY_CONSUMPTION,
+                     sample->channel, sample->value);
+        return;
+    }
+    if (sample->kind != SAMPLE_HUMIDITY || sample->channel >= SENSOR_COUNT) {
+        return;
+    }
+    if (!frame_mask) {
+        frame_time_us = sample->time_us;
+    }
+    // round half away from zero to the stored resolution
+    int32_t v = sample->value;
+    frame_values[sample->channel] = (v >= 0 ? v + HISTORY_HUMIDITY_RESOLUTION / 2 : v - HISTORY_HUMIDITY_RESOLUTION / 2) / HISTORY_HUMIDITY_RESOLUTION;
+    frame_mask |= 1u << sample->channel;
+    if (frame_mask != (1u << SENSOR_COUNT) - 1) {
+        return;
+    }
+
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        int32_t diff = frame_values[i] - stored_values[i];
+        if (!stored_valid || diff >= HISTORY_HUMIDITY_DEADBAND || diff <= -HISTORY_HUMIDITY_DEADBAND) {
+            stored_values[i] = frame_values[i];
+        }
+    }
+    stored_valid = true;
+    frame_mask = 0;
+    append_frame(history_time(frame_time_us), stored_values);
+}
+
+esp_err_t history_flush(void) {
+    if (head < 0) {
+        return ESP_OK;
+    }
+    close_repeat();
+    return write_out();
+}
+
+// Valid sectors overlapping [from_s, to_s], oldest first
+static int select_sectors(uint32_t from_s, uint32_t to_s, uint16_t *out, int max) {
+    uint16_t found[HISTORY_MAX_SECTORS];
+    int n = 0;
+    for (int i = 0; i < sector_count; i++) {
+        sector_index_t *s = &sector_index[i];
+        if (!s->valid || s->last_s < from_s || s->first_s > to_s) {
+            continue;
+        }
+        int j = n++;
+        while (j > 0 && sector_index[found[j - 1]].seq > s->seq) {
+            found[j] = found[j - 1];
+            j--;
+        }
+        found[j] = i;
+    }
+    if (n > max) {
+        n = max;
+    }
+    memcpy(out, found, n * sizeof(out[0]));
+    return n;
+}
+
+typedef struct {
+    uint32_t from_s;
+    uint32_t to_s;
+    history_visitor_t visitor;
+    void *ctx;
+    bool stopped;
+} query_ctx_t;
+
+static bool query_filter(const history_record_t *record, void *ctx) {
+    query_ctx_t *q = ctx;
+    if (record->time_s < q->from_s || record->time_s > q->to_s) {
+        return true;
+    }
+    q->stopped = !q->visitor(record, q->ctx);
+    return !q->stopped;
+}
+
+esp_err_t history_query(uint32_t from_s, uint32_t to_s, history_visitor_t visitor, void *ctx) {
+    uint16_t sectors[HISTORY_MAX_SECTORS];
+    query_ctx_t q = { .from_s = from_s, .to_s = to_s, .visitor = visitor, .ctx = ctx };
+
+    history_flush();
+    int n = select_sectors(from_s, to_s, sectors, HISTORY_MAX_SECTORS);
+    for (int i = 0; i < n && !q.stopped; i++) {
+        reader_t r = { .sector = sectors[i], .len = sector_index[sectors[i]].length };
+        codec_state_t st;
+        uint32_t end, last_s;
+        esp_err_t ret = decode_sector(&r, query_filter, &q, &st, &end, &last_s);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Sector %d failed to decode: %s", sectors[i], esp_err_to_name(ret));
+        }
+    }
+    return ESP_OK;
+}
+
+const history_stats_t *history_stats(void) {
+    int oldest = -1;
+    for (int i = 0; i < sector_count; i++) {
+        if (sector_index[i].valid && (oldest < 0 || sector_index[i].seq < sector_index[oldest].seq)) {
+            oldest = i;
+        }
+    }
+    stats.oldest_s = oldest < 0 ? 0 : sector_index[oldest].first_s;
+    stats.newest_s = head < 0 ? 0 : sector_index[head].last_s;
+    return &stats;
+}
+
+int history_find_sectors(uint32_t from_s, uint32_t to_s, uint16_t *sectors, int max) {
+    history_flush();
+    return select_sectors(from_s, to_s, sectors, max);
+}
+
+uint32_t history_sector_length(uint16_t sector) {
+    return sector < sector_count && sector_index[sector].valid ? sector_index[sector].length : 0;
+}
+
+esp_err_t history_read_raw(uint16_t sector, uint32_t offset, void *buf, size_t len) {
+    if (sector >= sector_count || offset + len > sector_index[sector].length) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return hal_history_read(sector * HISTORY_SECTOR_SIZE + offset, buf, len);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sample_queue.h"
+
+// Append-only telemetry history in the "history" data partition.
+//
+// The partition is used as a ring of 4 KB sectors, each erased only when the ring wraps onto it, so wear is spread
+// evenly. A sector starts with a history_sector_header_t and is followed by variable-length records, delta-encoded
+// against the previous record of the same sector so every sector decodes on its own:
+//
+//   00sn rrrr  humidity frame: s - interval equals the previous frame's (no dt follows), n - deltas are packed as
+//              4-bit two's complement nibbles, otherwise one zigzag varint per channel; then [varint dt] deltas
+//   01cc cccc  consumption of channel c: varint dt, zigzag varint value
+//   10cc cccc  pump run of zone c: varint dt, zigzag varint seconds
+//   11cc cccc  previous humidity frame repeated c (1..62) times with the same interval and no change
+//
+// dt is in seconds since the previous humidity frame (the sector base time for the first one), unwritten flash
+// reads 0xFF which ends a sector. Humidity is stored in HISTORY_HUMIDITY_RESOLUTION steps and a channel keeps its
+// stored value until it moves by HISTORY_HUMIDITY_DEADBAND steps, so slowly drying soil collapses into repeats.
+
+#define HISTORY_SECTOR_SIZE             4096
+#define HISTORY_MAX_SECTORS             64
+#define HISTORY_WRITE_BUFFER_SIZE       256     // records are collected in RAM and written in one go
+#define HISTORY_FLUSH_INTERVAL_S        3600    // upper bound for how long records stay in RAM
+#define HISTORY_HUMIDITY_RESOLUTION     10      // 1/100 % per stored step
+#define HISTORY_HUMIDITY_DEADBAND       5       // stored steps
+
+#define HISTORY_MAGIC                   0x4857
+#define HISTORY_VERSION                 1
+
+typedef enum {
+    HISTORY_HUMIDITY,       // value in 1/100 % (rounded to HISTORY_HUMIDITY_RESOLUTION)
+    HISTORY_CONSUMPTION,    // value in total pump seconds since boot
+    HISTORY_PUMP,           // value in seconds the pump ran, channel is the zone
+} history_kind_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t channels;
+    uint32_t seq;
+    uint32_t base_time_s;
+} history_sector_header_t;
+
+typedef struct {
+    uint32_t time_s;
+    uint8_t kind;
+    uint8_t channel;
+    int32_t value;
+} history_record_t;
+
+typedef struct {
+    uint32_t sectors_used;
+    uint32_t bytes_used;
+    uint32_t oldest_s;
+    uint32_t newest_s;
+    uint32_t records;           // appended since boot
+    uint32_t flash_writes;      // since boot
+    uint32_t sector_erases;     // since boot
+} history_stats_t;
+
+// Returns false to stop the query
+typedef bool (*history_visitor_t)(const history_record_t *record, void *ctx);
+
+esp_err_t history_init(void);
+// History clock in seconds, continues from the newest stored record across reboots
+uint32_t history_time(int64_t time_us);
+void history_append_sample(const sample_t *sample);
+esp_err_t history_flush(void);
+esp_err_t history_query(uint32_t from_s, uint32_t to_s, history_visitor_t visitor, void *ctx);
+const history_stats_t *history_stats(void);
+
+// Raw access for bulk transfer: sectors overlapping the range, oldest first, and their encoded bytes
+int history_find_sectors(uint32_t from_s, uint32_t to_s, uint16_t *sectors, int max);
+uint32_t history_sector_length(uint16_t sector);
+esp_err_t history_read_raw(uint16_t sector, uint32_t offset, void *buf, size_t len);
+
+// Decodes one sector image (header included), used by history_query and by host-side tools
+esp_err_t history_decode(const uint8_t *data, size_t len, history_visitor_t visitor, void *ctx);
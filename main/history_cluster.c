@@ -0,0 +1,150 @@
+#include "history_cluster.h"
+#include "history.h"
+#include "esp_zb_waterer.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+#include <string.h>
+
+static const char *TAG = "HISTORY_ZB";
+
+typedef struct {
+    bool active;
+    uint16_t dst_addr;
+    uint8_t dst_endpoint;
+    uint8_t src_endpoint;
+    uint16_t sectors[HISTORY_MAX_SECTORS];
+    int sector_count;
+    int current;
+    uint32_t offset;
+    uint16_t chunks;
+} history_transfer_t;
+
+static history_transfer_t transfer;
+
+static void put_u16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put_u32(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static uint32_t get_u32(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+static void send_command(uint8_t cmd_id, uint8_t *payload, uint16_t size)
+{
+    esp_zb_zcl_custom_cluster_cmd_req_t req = {
+        .zcl_basic_cmd = {
+            .dst_addr_u.addr_short = transfer.dst_addr,
+            .dst_endpoint = transfer.dst_endpoint,
+            .src_endpoint = transfer.src_endpoint,
+        },
+        .address_mode = ESP_ZB_APS_ADDR_MODE_16_ENDP_PRESENT,
+        .profile_id = ESP_ZB_AF_HA_PROFILE_ID,
+        .cluster_id = HISTORY_CLUSTER_ID,
+        .custom_cmd_id = cmd_id,
+        .direction = ESP_ZB_ZCL_CMD_DIRECTION_TO_CLI,
+        .data = {
+            .type = ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING,
+            .size = size,
+            .value = payload,
+        },
+    };
+    esp_zb_zcl_custom_cluster_cmd_req(&req);
+}
+
+static void transfer_finish(uint8_t status)
+{
+    uint8_t payload[1 + 3];
+    payload[0] = 3;     /* octet string length */
+    payload[1] = status;
+    put_u16(&payload[2], transfer.chunks);
+    send_command(HISTORY_CMD_DONE, payload, sizeof(payload));
+    ESP_LOGI(TAG, "History transfer finished, %u chunks", transfer.chunks);
+    transfer.active = false;
+}
+
+/* Runs on the Zigbee task, one chunk per invocation so the stack keeps breathing in between */
+static void transfer_step(uint8_t param)
+{
+    if (!transfer.active) {
+        return;
+    }
+    if (transfer.current >= transfer.sector_count) {
+        transfer_finish(ESP_ZB_ZCL_STATUS_SUCCESS);
+        return;
+    }
+
+    uint16_t sector = transfer.sectors[transfer.current];
+    uint32_t length = history_sector_length(sector);
+    if (transfer.offset >= length) {
+        transfer.current++;
+        transfer.offset = 0;
+        esp_zb_scheduler_alarm(transfer_step, 0, 0);
+        return;
+    }
+
+    uint8_t payload[1 + 6 + HISTORY_CHUNK_DATA_SIZE];
+    uint32_t size = length - transfer.offset;
+    if (size > HISTORY_CHUNK_DATA_SIZE) {
+        size = HISTORY_CHUNK_DATA_SIZE;
+    }
+    history_sector_header_t header;
+    if (history_read_raw(sector, 0, &header, sizeof(header)) != ESP_OK ||
+        history_read_raw(sector, transfer.offset, &payload[7], size) != ESP_OK) {
+        transfer_finish(ESP_ZB_ZCL_STATUS_FAIL);
+        return;
+    }
+    payload[0] = 6 + size;
+    put_u32(&payload[1], header.seq);
+    put_u16(&payload[5], transfer.offset);
+    send_command(HISTORY_CMD_CHUNK, payload, 7 + size);
+
+    transfer.offset += size;
+    transfer.chunks++;
+    esp_zb_scheduler_alarm(transfer_step, 0, HISTORY_CHUNK_INTERVAL_MS);
+}
+
+esp_zb_attribute_list_t *history_cluster_create(void)
+{
+    uint32_t zero = 0;
+    uint8_t ro = ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY;
+    esp_zb_attribute_list_t *attrs = esp_zb_zcl_attr_list_create(HISTORY_CLUSTER_ID);
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, HISTORY_NOW_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, HISTORY_OLDEST_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, HISTORY_NEWEST_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, HISTORY_BYTES_USED_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    return attrs;
+}
+
+void history_cluster_update(void)
+{
+    const history_stats_t *stats = history_stats();
+    uint32_t now = history_time(esp_timer_get_time());
+    uint32_t oldest = stats->oldest_s;
+    uint32_t newest = stats->newest_s;
+    uint32_t used = stats->bytes_used;
+    esp_zb_zcl_set_attribute_val(HA_HISTORY_ENDPOINT, HISTORY_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, HISTORY_NOW_ATTR_ID, &now, false);
+    esp_zb_zcl_set_attribute_val(HA_HISTORY_ENDPOINT, HISTORY_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, HISTORY_OLDEST_ATTR_ID, &oldest, false);
+    esp_zb_zcl_set_attribute_val(HA_HISTORY_ENDPOINT, HISTORY_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, HISTORY_NEWEST_ATTR_ID, &newest, false);
+    esp_zb_zcl_set_attribute_val(HA_HISTORY_ENDPOINT, HISTORY_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, HISTORY_BYTES_USED_ATTR_ID, &used, false);
+}
+
+esp_err_t history_cluster_handle_command(uint8_t endpoint, const esp_zb_zcl_custom_cluster_command_message_t *message)
+{
+    ESP_RETURN_ON_FALSE(message->info.command.id == HISTORY_CMD_READ_RANGE, ESP_ERR_NOT_SUPPORTED, TAG,
+                        "Unsupported history command 0x%x", message->info.command.id);
+    ESP_RETURN_ON_FALSE(message->data.size >= 8 && message->data.value, ESP_ERR_INVALID_ARG, TAG, "Short read range request");
+    ESP_RETURN_ON_FALSE(!transfer.active, ESP_ERR_INVALID_STATE, TAG, "History transfer already running");
+
+    const uint8_t *data = message->data.value;
+    uint32_t from_s = get_u32(&data[0]);
+    uint32_t to_s = get_u32(&data[4]);
+
+    transfer = (history_transfer_t) {
+        .active = true,
+        .dst_addr = message->info.src_address.u.short_addr,
+        .dst_endpoint = message->info.src_endpoint,
+        .src_endpoint = endpoint,
+    };
+    transfer.sector_count = history_find_sectors(from_s, to_s, transfer.sectors, HISTORY_MAX_SECTORS);
+    ESP_LOGI(TAG, "History transfer %lu..%lu to 0x%04x: %d sectors", (unsigned long)from_s, (unsigned long)to_s,
+             transfer.dst_addr, transfer.sector_count);
+    esp_zb_scheduler_alarm(transfer_step, 0, 0);
+    return ESP_OK;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "esp_zigbee_core.h"
+
+// Manufacturer-specific cluster streaming the on-flash history back in bulk.
+//
+// The client sends HISTORY_CMD_READ_RANGE (from, to: U32 history seconds). The server answers with
+// HISTORY_CMD_CHUNK commands carrying the raw encoded sector bytes overlapping the range (sector seq U32,
+// offset U16, data) paced HISTORY_CHUNK_INTERVAL_MS apart, followed by HISTORY_CMD_DONE (status U8, chunk count U16).
+// Chunks are sent compressed exactly as stored, the client decodes them with the format described in history.h.
+
+#define HISTORY_CLUSTER_ID                  0xFC11
+#define HISTORY_NOW_ATTR_ID                 0x0000  /* U32, current history clock, maps device time to wall time */
+#define HISTORY_OLDEST_ATTR_ID              0x0001  /* U32 */
+#define HISTORY_NEWEST_ATTR_ID              0x0002  /* U32 */
+#define HISTORY_BYTES_USED_ATTR_ID          0x0003  /* U32 */
+
+#define HISTORY_CMD_READ_RANGE              0x00    /* client -> server */
+#define HISTORY_CMD_CHUNK                   0x01    /* server -> client */
+#define HISTORY_CMD_DONE                    0x02    /* server -> client */
+
+#define HISTORY_CHUNK_DATA_SIZE             64      /* fits an unfragmented APS frame with the chunk header */
+#define HISTORY_CHUNK_INTERVAL_MS           50
+
+esp_zb_attribute_list_t *history_cluster_create(void);
+// Refreshes the read-only attributes, must be called with the Zigbee lock held
+void history_cluster_update(void);
+esp_err_t history_cluster_handle_command(uint8_t endpoint, const esp_zb_zcl_custom_cluster_command_message_t *message);
@@ -0,0 +1,72 @@
+#include "metrics.h"
+#include "hal.h"
+
+static metrics_histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+static uint32_t counters[METRIC_COUNTER_COUNT];
+static uint32_t gauges[METRIC_GAUGE_COUNT];
+
+static void histogram_add(metrics_histogram_t *h, uint32_t value_us) {
+    int bucket = 0;
+    uint32_t limit = METRICS_FIRST_BUCKET_US;
+    while (value_us >= limit && bucket < METRICS_BUCKETS - 1) {
+        bucket++;
+        limit <<= 2;
+    }
+    h->buckets[bucket]++;
+    h->count++;
+    if (value_us > h->max) {
+        h->max = value_us;
+    }
+}
+
+void metrics_record(metric_histogram_id_t id, uint32_t value_us) {
+    histogram_add(&histograms[id], value_us);
+}
+
+void metrics_count(metric_counter_id_t id) {
+    counters[id]++;
+}
+
+void metrics_set(metric_gauge_id_t id, uint32_t value) {
+    gauges[id] = value;
+}
+
+const metrics_histogram_t *metrics_histogram(metric_histogram_id_t id) {
+    return &histograms[id];
+}
+
+uint32_t metrics_counter(metric_counter_id_t id) {
+    return counters[id];
+}
+
+uint32_t metrics_gauge(metric_gauge_id_t id) {
+    return gauges[id];
+}
+
+uint32_t metrics_percentile(metric_histogram_id_t id, unsigned percent) {
+    const metrics_histogram_t *h = &histograms[id];
+    if (!h->count) {
+        return 0;
+    }
+    uint64_t rank = ((uint64_t)h->count * percent + 99) / 100;
+    uint32_t seen = 0;
+    uint32_t limit = METRICS_FIRST_BUCKET_US;
+    for (int i = 0; i < METRICS_BUCKETS - 1; i++, limit <<= 2) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            return limit < h->max ? limit : h->max;
+        }
+    }
+    return h->max;
+}
+
+void metrics_benchmark(uint32_t records, metrics_benchmark_t *result) {
+    static metrics_histogram_t scratch;
+    metrics_histogram_t *volatile target = &scratch;   // keeps the stores from being optimised away
+    uint32_t start = hal_cycle_count();
+    for (uint32_t i = 0; i < records; i++) {
+        histogram_add(target, (i * 2654435761u) >> 12);  // spread over all buckets
+    }
+    result->cycles = hal_cycle_count() - start;
+    result->records = records;
+}
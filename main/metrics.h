@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+// Always-on runtime counters and latency histograms, read out through the diagnostics cluster (metrics_cluster.h).
+//
+// Recording is a handful of integer operations and no locks: every metric has a single writer task, readers on
+// other tasks may see a histogram between two of its updates. Histogram buckets grow by 4x from METRICS_FIRST_BUCKET_US,
+// bucket i counts values below METRICS_FIRST_BUCKET_US << 2i, the last one everything above.
+
+#define METRICS_BUCKETS             8
+#define METRICS_FIRST_BUCKET_US     64      // buckets end at 64 us, 256 us, ... 262 ms, then unbounded
+
+typedef enum {
+    METRIC_ACQUISITION,     // measure task: sensor power-up and ADC read of one wakeup
+    METRIC_LOCK_WAIT,       // measure task: esp_zb_lock_acquire wait before scheduling the drain
+    METRIC_REPORT_DELAY,    // Zigbee task: measure task wakeup to the humidity attribute update
+    METRIC_COMMAND_LATENCY, // measure task: command posted to acted on (relay switched, sensors powered up)
+    METRIC_HISTOGRAM_COUNT,
+} metric_histogram_id_t;
+
+typedef enum {
+    METRIC_PUMP_STARTS,     // measure task
+    METRIC_LOCK_TIMEOUTS,   // measure task
+    METRIC_DRY_RUNS,        // measure task: pumps cut for lack of flow
+    METRIC_COUNTER_COUNT,
+} metric_counter_id_t;
+
+typedef enum {
+    METRIC_FIRST_DECISION_MS,   // measure task: boot to the first watering decision
+    METRIC_REGISTER_US,         // Zigbee task: building and registering the endpoints of the device description
+    METRIC_REGISTER_HEAP,       // Zigbee task: heap that took, bytes
+    METRIC_GAUGE_COUNT,
+} metric_gauge_id_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max;
+    uint32_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+typedef struct {
+    uint32_t records;
+    uint32_t cycles;
+} metrics_benchmark_t;
+
+void metrics_record(metric_histogram_id_t id, uint32_t value_us);
+void metrics_count(metric_counter_id_t id);
+void metrics_set(metric_gauge_id_t id, uint32_t value);
+const metrics_histogram_t *metrics_histogram(metric_histogram_id_t id);
+uint32_t metrics_counter(metric_counter_id_t id);
+uint32_t metrics_gauge(metric_gauge_id_t id);
+// Upper bound of the bucket holding the given percentile, the maximum for the last bucket, 0 while empty
+uint32_t metrics_percentile(metric_histogram_id_t id, unsigned percent);
+// Cost of metrics_record, into a scratch histogram so the real ones are left alone
+void metrics_benchmark(uint32_t records, metrics_benchmark_t *result);
@@ -0,0 +1,157 @@
+#include "metrics_cluster.h"
+#include "esp_zb_waterer.h"
+#include "health.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include <string.h>
+
+static const char *TAG = "METRICS_ZB";
+
+typedef struct {
+    const char *name;
+    uint16_t attr_base;     // stack free, CPU time and CPU load follow each other
+    bool seen;
+    uint32_t last_counter;
+    uint64_t cpu_us;
+} tracked_task_t;
+
+static tracked_task_t tracked_tasks[] = {
+    { .name = "Measure_main", .attr_base = METRICS_MEASURE_STACK_FREE_ATTR_ID },
+    { .name = "Zigbee_main", .attr_base = METRICS_ZIGBEE_STACK_FREE_ATTR_ID },
+    { .name = "Log_main", .attr_base = METRICS_LOG_STACK_FREE_ATTR_ID },
+};
+
+static TaskStatus_t task_status[METRICS_MAX_TASKS];
+static uint32_t last_total_run_time;
+static uint32_t refresh_cost_us;
+
+static void set_attr(uint16_t attr_id, void *value)
+{
+    esp_zb_zcl_set_attribute_val(HA_DIAGNOSTICS_ENDPOINT, METRICS_CLUSTER_ID, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, attr_id, value, false);
+}
+
+/* Counters are 32 bit, deltas stay right as long as refreshes are less than a wrap apart */
+static void tasks_update(void)
+{
+    uint32_t total_run_time;
+    UBaseType_t count = uxTaskGetSystemState(task_status, METRICS_MAX_TASKS, &total_run_time);
+    if (!count) {
+        ESP_LOGW(TAG, "More than %d tasks, task metrics not updated", METRICS_MAX_TASKS);
+        return;
+    }
+    uint32_t total_delta = total_run_time - last_total_run_time;
+    last_total_run_time = total_run_time;
+
+    for (int t = 0; t < sizeof(tracked_tasks) / sizeof(tracked_tasks[0]); t++) {
+        tracked_task_t *task = &tracked_tasks[t];
+        for (UBaseType_t i = 0; i < count; i++) {
+            if (strcmp(task_status[i].pcTaskName, task->name)) {
+                continue;
+            }
+            uint32_t delta = task->seen ? task_status[i].ulRunTimeCounter - task->last_counter : task_status[i].ulRunTimeCounter;
+            task->seen = true;
+            task->last_counter = task_status[i].ulRunTimeCounter;
+            task->cpu_us += delta;
+
+            uint32_t stack_free = task_status[i].usStackHighWaterMark;     /* bytes on ESP-IDF */
+            uint32_t cpu_ms = task->cpu_us / 1000;
+            uint16_t load = total_delta ? (uint64_t)delta * 10000 / total_delta : 0;
+            set_attr(task->attr_base, &stack_free);
+            set_attr(task->attr_base + 1, &cpu_ms);
+            set_attr(task->attr_base + 2, &load);
+            break;
+        }
+    }
+}
+
+static void histograms_update(void)
+{
+    for (int id = 0; id < METRIC_HISTOGRAM_COUNT; id++) {
+        uint16_t base = METRICS_HISTOGRAM_ATTR_BASE + 0x10 * id;
+        uint32_t values[4] = {
+            metrics_histogram(id)->count,
+            metrics_percentile(id, 50),
+            metrics_percentile(id, 90),
+            metrics_histogram(id)->max,
+        };
+        for (int i = 0; i < 4; i++) {
+            set_attr(base + i, &values[i]);
+        }
+    }
+}
+
+static void periodic_refresh(uint8_t param)
+{
+    metrics_cluster_update();
+    esp_zb_scheduler_alarm(periodic_refresh, 0, METRICS_REFRESH_INTERVAL_S * 1000);
+}
+
+esp_zb_attribute_list_t *metrics_cluster_create(void)
+{
+    uint8_t reason = esp_reset_reason();
+    uint32_t zero = 0;
+    uint16_t zero16 = 0;
+    uint8_t ro = ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY;
+    esp_zb_attribute_list_t *attrs = esp_zb_zcl_attr_list_create(METRICS_CLUSTER_ID);
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_RESET_REASON_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U8, ro, &reason));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_UPTIME_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_HEAP_MIN_FREE_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_REFRESH_COST_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_FIRST_DECISION_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_REGISTER_TIME_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_REGISTER_HEAP_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    for (int t = 0; t < sizeof(tracked_tasks) / sizeof(tracked_tasks[0]); t++) {
+        uint16_t base = tracked_tasks[t].attr_base;
+        ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, base, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+        ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, base + 1, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+        ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, base + 2, ESP_ZB_ZCL_ATTR_TYPE_U16, ro, &zero16));
+    }
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_PUMP_STARTS_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_LOCK_TIMEOUTS_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_DRY_RUNS_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_OUTLIERS_ATTR_ID, ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+    for (int id = 0; id < METRIC_HISTOGRAM_COUNT; id++) {
+        for (int i = 0; i < 4; i++) {
+            ESP_ERROR_CHECK(esp_zb_custom_cluster_add_custom_attr(attrs, METRICS_HISTOGRAM_ATTR_BASE + 0x10 * id + i,
+                                                                  ESP_ZB_ZCL_ATTR_TYPE_U32, ro, &zero));
+        }
+    }
+    ESP_LOGI(TAG, "Reset reason %d", reason);
+    return attrs;
+}
+
+void metrics_cluster_start(void)
+{
+    esp_zb_scheduler_alarm(periodic_refresh, 0, METRICS_REFRESH_INTERVAL_S * 1000);
+}
+
+void metrics_cluster_update(void)
+{
+    int64_t start = esp_timer_get_time();
+    uint32_t uptime = start / 1000000;
+    uint32_t heap_min_free = esp_get_minimum_free_heap_size();
+    uint32_t pump_starts = metrics_counter(METRIC_PUMP_STARTS);
+    uint32_t lock_timeouts = metrics_counter(METRIC_LOCK_TIMEOUTS);
+    uint32_t dry_runs = metrics_counter(METRIC_DRY_RUNS);
+    uint32_t outliers = health_stats()->outliers;     /* counted where readings are held back */
+    uint32_t first_decision_ms = metrics_gauge(METRIC_FIRST_DECISION_MS);
+    uint32_t register_us = metrics_gauge(METRIC_REGISTER_US);
+    uint32_t register_heap = metrics_gauge(METRIC_REGISTER_HEAP);
+    set_attr(METRICS_UPTIME_ATTR_ID, &uptime);
+    set_attr(METRICS_HEAP_MIN_FREE_ATTR_ID, &heap_min_free);
+    set_attr(METRICS_PUMP_STARTS_ATTR_ID, &pump_starts);
+    set_attr(METRICS_LOCK_TIMEOUTS_ATTR_ID, &lock_timeouts);
+    set_attr(METRICS_DRY_RUNS_ATTR_ID, &dry_runs);
+    set_attr(METRICS_OUTLIERS_ATTR_ID, &outliers);
+    set_attr(METRICS_FIRST_DECISION_ATTR_ID, &first_decision_ms);
+    set_attr(METRICS_REGISTER_TIME_ATTR_ID, &register_us);
+    set_attr(METRICS_REGISTER_HEAP_ATTR_ID, &register_heap);
+    tasks_update();
+    histograms_update();
+    /* what this refresh cost is visible from the next one on */
+    set_attr(METRICS_REFRESH_COST_ATTR_ID, &refresh_cost_us);
+    refresh_cost_us = esp_timer_get_time() - start;
+}
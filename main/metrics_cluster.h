@@ -0,0 +1,43 @@
+#pragma once
+
+#include "esp_zigbee_core.h"
+#include "metrics.h"
+
+// Manufacturer-specific diagnostics cluster, read-only attributes refreshed after every sample drain and every
+// METRICS_REFRESH_INTERVAL_S. Task CPU figures come from the FreeRTOS run-time counters (esp_timer microseconds,
+// 32 bit), the refresh interval keeps their deltas short of the 71 minute wrap.
+//
+// Latency histograms (see metrics.h) are summarised per METRIC_x id at METRICS_HISTOGRAM_ATTR_BASE + 0x10 * id:
+// + 0 count, + 1 p50, + 2 p90, + 3 max, all U32 microseconds; percentiles are bucket upper bounds.
+
+#define METRICS_CLUSTER_ID                      0xFC12
+#define METRICS_RESET_REASON_ATTR_ID            0x0000  /* U8, esp_reset_reason_t of the last boot */
+#define METRICS_UPTIME_ATTR_ID                  0x0001  /* U32, seconds */
+#define METRICS_HEAP_MIN_FREE_ATTR_ID           0x0002  /* U32, bytes, lowest since boot */
+#define METRICS_REFRESH_COST_ATTR_ID            0x0003  /* U32, microseconds the last refresh took */
+#define METRICS_FIRST_DECISION_ATTR_ID          0x0004  /* U32, ms from boot to the first watering decision */
+#define METRICS_REGISTER_TIME_ATTR_ID           0x0005  /* U32, microseconds to build and register the endpoints */
+#define METRICS_REGISTER_HEAP_ATTR_ID           0x0006  /* U32, bytes of heap that took */
+#define METRICS_MEASURE_STACK_FREE_ATTR_ID      0x0010  /* U32, bytes, Measure_main stack high-water mark */
+#define METRICS_MEASURE_CPU_TIME_ATTR_ID        0x0011  /* U32, milliseconds since boot */
+#define METRICS_MEASURE_CPU_LOAD_ATTR_ID        0x0012  /* U16, 1/100 % since the previous refresh */
+#define METRICS_ZIGBEE_STACK_FREE_ATTR_ID       0x0020  /* Zigbee_main, as above */
+#define METRICS_ZIGBEE_CPU_TIME_ATTR_ID         0x0021
+#define METRICS_ZIGBEE_CPU_LOAD_ATTR_ID         0x0022
+#define METRICS_PUMP_STARTS_ATTR_ID             0x0030  /* U32 */
+#define METRICS_LOCK_TIMEOUTS_ATTR_ID           0x0031  /* U32 */
+#define METRICS_DRY_RUNS_ATTR_ID                0x0032  /* U32 */
+#define METRICS_OUTLIERS_ATTR_ID                0x0033  /* U32 */
+#define METRICS_LOG_STACK_FREE_ATTR_ID          0x0040  /* Log_main, as 0x0010 */
+#define METRICS_LOG_CPU_TIME_ATTR_ID            0x0041
+#define METRICS_LOG_CPU_LOAD_ATTR_ID            0x0042
+#define METRICS_HISTOGRAM_ATTR_BASE             0x0100
+
+#define METRICS_REFRESH_INTERVAL_S              (15 * 60)
+#define METRICS_MAX_TASKS                       16
+
+esp_zb_attribute_list_t *metrics_cluster_create(void);
+// Starts the periodic refresh, call once the device is registered
+void metrics_cluster_start(void);
+// Refreshes the read-only attributes, must be called with the Zigbee lock held
+void metrics_cluster_update(void);
@@ -0,0 +1,132 @@
+#include "ota.h"
+#include "ota_image.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+
+static const char *TAG = "OTA";
+
+static const esp_partition_t *ota_partition;
+static esp_ota_handle_t ota_handle;
+static bool ota_active;
+static bool payload_started;
+static int64_t started_us;
+static uint32_t blocks;
+
+static esp_err_t ota_write(const void *data, size_t len, void *ctx)
+{
+    return esp_ota_write(ota_handle, data, len);
+}
+
+static void ota_abort(void)
+{
+    if (ota_active) {
+        esp_ota_abort(ota_handle);
+        ota_active = false;
+    }
+}
+
+esp_zb_attribute_list_t *ota_cluster_create(void)
+{
+    esp_zb_ota_cluster_cfg_t config = {
+        .ota_upgrade_file_version = OTA_UPGRADE_FILE_VERSION,
+        .ota_upgrade_downloaded_file_ver = ESP_ZB_ZCL_OTA_UPGRADE_DOWNLOADED_FILE_VERSION_DEF_VALUE,
+        .ota_upgrade_manufacturer = OTA_UPGRADE_MANUFACTURER,
+        .ota_upgrade_image_type = OTA_UPGRADE_IMAGE_TYPE,
+    };
+    esp_zb_attribute_list_t *attrs = esp_zb_ota_cluster_create(&config);
+    esp_zb_zcl_ota_upgrade_client_variable_t variables = {
+        .timer_query = ESP_ZB_ZCL_OTA_UPGRADE_QUERY_TIMER_COUNT_DEF,
+        .hw_version = OTA_UPGRADE_HW_VERSION,
+        .max_data_size = OTA_UPGRADE_MAX_DATA_SIZE,
+    };
+    uint16_t server_addr = 0xffff;
+    uint8_t server_endpoint = 0xff;
+    ESP_ERROR_CHECK(esp_zb_ota_cluster_add_attr(attrs, ESP_ZB_ZCL_ATTR_OTA_UPGRADE_CLIENT_DATA_ID, &variables));
+    ESP_ERROR_CHECK(esp_zb_ota_cluster_add_attr(attrs, ESP_ZB_ZCL_ATTR_OTA_UPGRADE_SERVER_ADDR_ID, &server_addr));
+    ESP_ERROR_CHECK(esp_zb_ota_cluster_add_attr(attrs, ESP_ZB_ZCL_ATTR_OTA_UPGRADE_SERVER_ENDPOINT_ID, &server_endpoint));
+    return attrs;
+}
+
+esp_err_t ota_handle_upgrade_value(const esp_zb_zcl_ota_upgrade_value_message_t *message)
+{
+    esp_err_t ret = ESP_OK;
+    ESP_RETURN_ON_FALSE(message->info.status == ESP_ZB_ZCL_STATUS_SUCCESS, ESP_ERR_INVALID_ARG, TAG, "OTA error status(%d)",
+                        message->info.status);
+
+    switch (message->upgrade_status) {
+    case ESP_ZB_ZCL_OTA_UPGRADE_STATUS_START:
+        ota_abort();
+        ota_partition = esp_ota_get_next_update_partition(NULL);
+        ESP_RETURN_ON_FALSE(ota_partition, ESP_ERR_NOT_FOUND, TAG, "No OTA slot to download into");
+        ESP_RETURN_ON_ERROR(esp_ota_begin(ota_partition, OTA_WITH_SEQUENTIAL_WRITES, &ota_handle), TAG, "OTA begin failed");
+        ota_active = true;
+        payload_started = false;
+        blocks = 0;
+        started_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "Upgrade started into %s", ota_partition->label);
+        break;
+    case ESP_ZB_ZCL_OTA_UPGRADE_STATUS_RECEIVE:
+        ESP_RETURN_ON_FALSE(ota_active, ESP_ERR_INVALID_STATE, TAG, "Image block outside of an upgrade");
+        if (!payload_started) {
+            /* the stack strips the OTA file header, image_size is what follows it */
+            ota_image_begin(message->ota_header.image_size, ota_write, NULL);
+            payload_started = true;
+        }
+        blocks++;
+        if (message->payload_size && message->payload) {
+            ret = ota_image_feed(message->payload, message->payload_size);
+        }
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Image rejected at %lu bytes: %s", (unsigned long)ota_image_stats()->received, esp_err_to_name(ret));
+            ota_abort();
+        } else if (blocks % 1024 == 0) {
+            ESP_LOGI(TAG, "Received %lu of %lu bytes", (unsigned long)ota_image_stats()->received,
+                     (unsigned long)message->ota_header.image_size);
+        }
+        break;
+    case ESP_ZB_ZCL_OTA_UPGRADE_STATUS_APPLY:
+        ESP_LOGI(TAG, "Applying upgrade");
+        break;
+    case ESP_ZB_ZCL_OTA_UPGRADE_STATUS_CHECK:
+        ret = ota_active ? ota_image_finish() : ESP_ERR_INVALID_STATE;
+        if (ret != ESP_OK) {
+            ota_abort();
+        }
+        ESP_LOGI(TAG, "Image check: %s", esp_err_to_name(ret));
+        break;
+    case ESP_ZB_ZCL_OTA_UPGRADE_STATUS_FINISH: {
+        ESP_RETURN_ON_FALSE(ota_active, ESP_ERR_INVALID_STATE, TAG, "Nothing downloaded");
+        const ota_image_stats_t *stats = ota_image_stats();
+        ESP_LOGI(TAG, "Version 0x%lx downloaded in %lld s: %lu blocks, %lu bytes over the air for a %lu byte %s image",
+                 (unsigned long)message->ota_header.file_version, (esp_timer_get_time() - started_us) / 1000000,
+                 (unsigned long)blocks, (unsigned long)stats->received, (unsigned long)stats->written,
+                 stats->compressed ? "compressed" : "plain");
+        ota_active = false;
+        ESP_RETURN_ON_ERROR(esp_ota_end(ota_handle), TAG, "Image validation failed");
+        ESP_RETURN_ON_ERROR(esp_ota_set_boot_partition(ota_partition), TAG, "Failed to select the new image");
+        ESP_LOGW(TAG, "Restarting into the new image");
+        esp_restart();
+        break;
+    }
+    case ESP_ZB_ZCL_OTA_UPGRADE_STATUS_ABORT:
+        ESP_LOGW(TAG, "Upgrade aborted");
+        ota_abort();
+        break;
+    default:
+        ESP_LOGI(TAG, "OTA status %d", message->upgrade_status);
+        break;
+    }
+    return ret;
+}
+
+void ota_confirm_image(void)
+{
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY) {
+        ESP_LOGI(TAG, "New image rejoined the network, cancelling rollback");
+        esp_ota_mark_app_valid_cancel_rollback();
+    }
+}
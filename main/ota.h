@@ -0,0 +1,16 @@
+#pragma once
+
+#include "esp_zigbee_core.h"
+#include "ota_image.h"
+
+// Zigbee OTA upgrade client. Images are written into the inactive ota_0/ota_1 slot while they download, compressed
+// ones (OTA_TAG_COMPRESSED_IMAGE, see ota_image.h) are unpacked on the way so only the compressed bytes go over
+// the air. A new image boots pending verification: unless it makes it back onto the network and calls
+// ota_confirm_image() the bootloader returns to the previous slot on the next reset.
+
+#define OTA_UPGRADE_HW_VERSION          0x0001
+
+esp_zb_attribute_list_t *ota_cluster_create(void);
+esp_err_t ota_handle_upgrade_value(const esp_zb_zcl_ota_upgrade_value_message_t *message);
+// Call once the device is back on the network, accepts a freshly installed image and cancels the rollback
+void ota_confirm_image(void);
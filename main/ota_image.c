@@ -0,0 +1,271 @@
+#include "ota_image.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "OTA_IMAGE";
+
+typedef enum {
+    PART_ELEMENT_HEADER,
+    PART_COMPRESSED_HEADER,
+    PART_PLAIN,
+    PART_COMPRESSED,
+    PART_SKIP,
+} image_part_t;
+
+typedef enum {
+    BITS_TAG,
+    BITS_LITERAL,
+    BITS_INDEX,
+    BITS_COUNT,
+} bits_state_t;
+
+static ota_image_sink_t sink;
+static void *sink_ctx;
+static uint32_t payload_size;
+static esp_err_t status;
+static ota_image_stats_t stats;
+static bool image_seen;
+
+static image_part_t part;
+static uint8_t header[OTA_ELEMENT_HEADER_SIZE];
+static int header_len;
+static uint32_t element_left;
+
+// heatshrink decoder
+static uint8_t window[1 << OTA_MAX_WINDOW_BITS];
+static uint16_t window_pos;
+static uint16_t window_mask;
+static uint8_t window_bits;
+static uint8_t lookahead_bits;
+static uint32_t bit_buf;
+static int bit_count;
+static bits_state_t bits_state;
+static uint16_t backref_index;
+static uint8_t out[OTA_OUTPUT_CHUNK];
+static int out_len;
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static esp_err_t write_out(const void *data, size_t len) {
+    if (stats.written + len > stats.image_size) {
+        ESP_LOGW(TAG, "Image larger than the announced %lu bytes", (unsigned long)stats.image_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t ret = sink(data, len, sink_ctx);
+    if (ret == ESP_OK) {
+        stats.written += len;
+    }
+    return ret;
+}
+
+static esp_err_t flush_out(void) {
+    esp_err_t ret = out_len ? write_out(out, out_len) : ESP_OK;
+    out_len = 0;
+    return ret;
+}
+
+static esp_err_t emit(uint8_t b) {
+    window[window_pos] = b;
+    window_pos = (window_pos + 1) & window_mask;
+    out[out_len++] = b;
+    return out_len == OTA_OUTPUT_CHUNK ? flush_out() : ESP_OK;
+}
+
+static int bits_needed(void) {
+    switch (bits_state) {
+    case BITS_TAG: return 1;
+    case BITS_LITERAL: return 8;
+    case BITS_INDEX: return window_bits;
+    case BITS_COUNT:
+    default: return lookahead_bits;
+    }
+}
+
+static esp_err_t decode_byte(uint8_t b) {
+    bit_buf = bit_buf << 8 | b;
+    bit_count += 8;
+    while (bit_count >= bits_needed()) {
+        int need = bits_needed();
+        uint16_t v = (bit_buf >> (bit_count - need)) & ((1u << need) - 1);
+        bit_count -= need;
+        esp_err_t ret = ESP_OK;
+        switch (bits_state) {
+        case BITS_TAG:
+            bits_state = v ? BITS_LITERAL : BITS_INDEX;
+            break;
+        case BITS_LITERAL:
+            ret = emit(v);
+            bits_state = BITS_TAG;
+            break;
+        case BITS_INDEX:
+            backref_index = v + 1;
+            bits_state = BITS_COUNT;
+            break;
+        case BITS_COUNT:
+            for (int i = 0; i <= v && ret == ESP_OK; i++) {
+                ret = emit(window[(window_pos - backref_index) & window_mask]);
+            }
+            bits_state = BITS_TAG;
+            break;
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t start_image(uint32_t size, bool compressed) {
+    if (image_seen) {
+        ESP_LOGW(TAG, "More than one application image in the payload");
+        return ESP_ERR_INVALID_ARG;
+    }
+    image_seen = true;
+    stats.image_size = size;
+    stats.compressed = compressed;
+    return ESP_OK;
+}
+
+static esp_err_t element_header_done(void) {
+    uint16_t tag = header[0] | header[1] << 8;
+    element_left = get_u32(&header[2]);
+    header_len = 0;
+    switch (tag) {
+    case OTA_TAG_UPGRADE_IMAGE:
+        part = PART_PLAIN;
+        return start_image(element_left, false);
+    case OTA_TAG_COMPRESSED_IMAGE:
+        if (element_left < OTA_COMPRESSED_HEADER_SIZE) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        part = PART_COMPRESSED_HEADER;
+        return ESP_OK;
+    default:
+        ESP_LOGI(TAG, "Skipping element 0x%04x (%lu bytes)", tag, (unsigned long)element_left);
+        part = PART_SKIP;
+        return ESP_OK;
+    }
+}
+
+static esp_err_t compressed_header_done(void) {
+    window_bits = header[0];
+    lookahead_bits = header[1];
+    header_len = 0;
+    if (window_bits < OTA_MIN_WINDOW_BITS || window_bits > OTA_MAX_WINDOW_BITS || lookahead_bits < 3 ||
+        lookahead_bits >= window_bits) {
+        ESP_LOGW(TAG, "Unsupported compression parameters w%d l%d", window_bits, lookahead_bits);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    memset(window, 0, sizeof(window));
+    window_pos = 0;
+    window_mask = (1u << window_bits) - 1;
+    bit_buf = 0;
+    bit_count = 0;
+    bits_state = BITS_TAG;
+    out_len = 0;
+    part = PART_COMPRESSED;
+    return start_image(get_u32(&header[2]), true);
+}
+
+// Called once the current element has been consumed
+static esp_err_t element_done(void) {
+    esp_err_t ret = ESP_OK;
+    if (part == PART_COMPRESSED) {
+        // the last byte may carry a few bits of padding, which never complete a symbol
+        ret = flush_out();
+    }
+    if (ret == ESP_OK && (part == PART_PLAIN || part == PART_COMPRESSED) && stats.written != stats.image_size) {
+        ESP_LOGW(TAG, "Image decoded to %lu of %lu bytes", (unsigned long)stats.written, (unsigned long)stats.image_size);
+        ret = ESP_ERR_INVALID_SIZE;
+    }
+    part = PART_ELEMENT_HEADER;
+    return ret;
+}
+
+static esp_err_t feed(const uint8_t *data, size_t len) {
+    while (len) {
+        esp_err_t ret = ESP_OK;
+        size_t used;
+        switch (part) {
+        case PART_ELEMENT_HEADER:
+        case PART_COMPRESSED_HEADER: {
+            int size = part == PART_ELEMENT_HEADER ? OTA_ELEMENT_HEADER_SIZE : OTA_COMPRESSED_HEADER_SIZE;
+            used = size - header_len < len ? size - header_len : len;
+            memcpy(&header[header_len], data, used);
+            header_len += used;
+            if (part == PART_COMPRESSED_HEADER) {
+                element_left -= used;
+            }
+            if (header_len == size) {
+                ret = part == PART_ELEMENT_HEADER ? element_header_done() : compressed_header_done();
+            }
+            break;
+        }
+        case PART_PLAIN:
+        case PART_COMPRESSED:
+        case PART_SKIP:
+        default:
+            used = element_left < len ? element_left : len;
+            if (part == PART_PLAIN) {
+                ret = write_out(data, used);
+            } else if (part == PART_COMPRESSED) {
+                for (size_t i = 0; i < used && ret == ESP_OK; i++) {
+                    ret = decode_byte(data[i]);
+                }
+            }
+            element_left -= used;
+            break;
+        }
+        if (ret == ESP_OK && part != PART_ELEMENT_HEADER && part != PART_COMPRESSED_HEADER && !element_left) {
+            ret = element_done();
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        data += used;
+        len -= used;
+    }
+    return ESP_OK;
+}
+
+void ota_image_begin(uint32_t size, ota_image_sink_t image_sink, void *ctx) {
+    sink = image_sink;
+    sink_ctx = ctx;
+    payload_size = size;
+    status = ESP_OK;
+    memset(&stats, 0, sizeof(stats));
+    image_seen = false;
+    part = PART_ELEMENT_HEADER;
+    header_len = 0;
+    element_left = 0;
+}
+
+esp_err_t ota_image_feed(const void *data, size_t len) {
+    if (status != ESP_OK) {
+        return status;
+    }
+    if (stats.received + len > payload_size) {
+        status = ESP_ERR_INVALID_SIZE;
+        return status;
+    }
+    stats.received += len;
+    status = feed(data, len);
+    return status;
+}
+
+esp_err_t ota_image_finish(void) {
+    if (status != ESP_OK) {
+        return status;
+    }
+    if (stats.received != payload_size || part != PART_ELEMENT_HEADER || header_len || !image_seen) {
+        ESP_LOGW(TAG, "Incomplete payload, %lu of %lu bytes", (unsigned long)stats.received, (unsigned long)payload_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+const ota_image_stats_t *ota_image_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Zigbee OTA image payload (everything after the OTA file header), unpacked while it streams in.
+//
+// The payload is a sequence of sub-elements, each a u16 tag and a u32 length followed by the data. Exactly one
+// of them carries the application:
+//
+//   OTA_TAG_UPGRADE_IMAGE      the application image as is
+//   OTA_TAG_COMPRESSED_IMAGE   u8 window bits, u8 lookahead bits, u32 image size, then the image as a heatshrink
+//                              bit stream (LZSS, 1 + 8 bit literals and 0 + window + lookahead bit back-references
+//                              into a 2^window byte history, so the decoder needs no more RAM than that)
+//
+// Other tags are skipped. All fields are little endian, as in the rest of the OTA file.
+
+// Identity of this firmware's OTA files, host/ota_pack writes them into the file header
+#define OTA_UPGRADE_MANUFACTURER        0x131B      // Espressif
+#define OTA_UPGRADE_IMAGE_TYPE          0x0001
+#define OTA_UPGRADE_FILE_VERSION        0x00010000  // of the running image, every release needs a higher one
+#define OTA_UPGRADE_MAX_DATA_SIZE       64          // image block payload, fits an unfragmented APS frame
+
+#define OTA_TAG_UPGRADE_IMAGE           0x0000
+#define OTA_TAG_COMPRESSED_IMAGE        0xF000  // manufacturer-specific tag range
+#define OTA_ELEMENT_HEADER_SIZE         6
+#define OTA_COMPRESSED_HEADER_SIZE      6
+#define OTA_WINDOW_BITS                 11      // used by the packer, the decoder accepts up to OTA_MAX_WINDOW_BITS
+#define OTA_LOOKAHEAD_BITS              4
+#define OTA_MIN_WINDOW_BITS             8
+#define OTA_MAX_WINDOW_BITS             12
+#define OTA_OUTPUT_CHUNK                256     // decoded bytes are handed to the sink in chunks of this size
+
+// Receives the application image in order, e.g. esp_ota_write
+typedef esp_err_t (*ota_image_sink_t)(const void *data, size_t len, void *ctx);
+
+typedef struct {
+    uint32_t received;          // payload bytes fed
+    uint32_t written;           // image bytes handed to the sink
+    uint32_t image_size;        // expected image size, known once its element header has arrived
+    bool compressed;
+} ota_image_stats_t;
+
+// Starts a new payload of payload_size bytes, drops whatever a previous transfer left behind
+void ota_image_begin(uint32_t payload_size, ota_image_sink_t sink, void *ctx);
+esp_err_t ota_image_feed(const void *data, size_t len);
+// Flushes the last decoded bytes, fails unless the whole payload arrived and decoded to exactly one image
+esp_err_t ota_image_finish(void);
+const ota_image_stats_t *ota_image_stats(void);
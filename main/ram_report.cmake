@@ -0,0 +1,61 @@
+# Static RAM per source file of a library, largest first, from the Berkeley output of binutils size.
+# Task stacks and the event queue show up under hal_esp32 with HAL_STATIC_ALLOCATION.
+#   cmake -DSIZE=riscv32-esp-elf-size -DLIBRARY=build/esp-idf/main/libmain.a -P main/ram_report.cmake
+
+if(NOT SIZE OR NOT LIBRARY)
+    message(FATAL_ERROR "usage: cmake -DSIZE=<size tool> -DLIBRARY=<archive> -P ram_report.cmake")
+endif()
+
+execute_process(COMMAND ${SIZE} ${LIBRARY} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${SIZE} failed on ${LIBRARY}")
+endif()
+
+string(REPLACE "\n" ";" lines "${output}")
+set(entries "")
+set(total_data 0)
+set(total_bss 0)
+foreach(line IN LISTS lines)
+    # text data bss dec hex filename [(ex archive)]
+    if(line MATCHES "^[ \t]*([0-9]+)[ \t]+([0-9]+)[ \t]+([0-9]+)[ \t]+[0-9]+[ \t]+[0-9a-f]+[ \t]+([^ \t]+)")
+        set(data ${CMAKE_MATCH_2})
+        set(bss ${CMAKE_MATCH_3})
+        get_filename_component(name "${CMAKE_MATCH_4}" NAME)
+        string(REGEX REPLACE "\\.(c|cpp)\\.obj$|\\.(c|cpp)\\.o$|\\.obj$|\\.o$" "" name "${name}")
+        math(EXPR ram "${data} + ${bss}")
+        math(EXPR total_data "${total_data} + ${data}")
+        math(EXPR total_bss "${total_bss} + ${bss}")
+        # zero padded so the list sorts by size
+        string(LENGTH "${ram}" digits)
+        math(EXPR pad "10 - ${digits}")
+        string(REPEAT "0" ${pad} zeros)
+        list(APPEND entries "${zeros}${ram}|${name}|${data}|${bss}")
+    endif()
+endforeach()
+
+list(SORT entries ORDER DESCENDING)
+message("RAM budget (static), bytes:")
+message("  file                     data      bss    total")
+foreach(entry IN LISTS entries)
+    string(REPLACE "|" ";" fields "${entry}")
+    list(GET fields 1 name)
+    list(GET fields 2 data)
+    list(GET fields 3 bss)
+    math(EXPR ram "${data} + ${bss}")
+    string(LENGTH "${name}" name_length)
+    math(EXPR name_pad "22 - ${name_length}")
+    if(name_pad LESS 1)
+        set(name_pad 1)
+    endif()
+    string(REPEAT " " ${name_pad} spacing)
+    set(row "  ${name}${spacing}")
+    foreach(value IN ITEMS ${data} ${bss} ${ram})
+        string(LENGTH "${value}" value_length)
+        math(EXPR value_pad "9 - ${value_length}")
+        string(REPEAT " " ${value_pad} spacing)
+        string(APPEND row "${spacing}${value}")
+    endforeach()
+    message("${row}")
+endforeach()
+math(EXPR total "${total_data} + ${total_bss}")
+message("  total data ${total_data}, bss ${total_bss}, ${total} bytes")
@@ -0,0 +1,86 @@
+#include "reporting.h"
+#include <stdlib.h>
+
+typedef struct {
+    report_policy_t policy;
+    report_counters_t counters;
+    int32_t last_value;
+    int64_t last_report_us;
+    bool reported;
+    bool pending;           // pending_value is a reportable change held back by min_interval_s
+    int32_t pending_value;
+} report_channel_t;
+
+static report_channel_t channels[REPORT_CHANNEL_COUNT];
+
+void reporting_init(void) {
+    for (int i = 0; i < REPORT_CHANNEL_COUNT; i++) {
+        channels[i] = (report_channel_t) {
+            .policy = {
+                .min_interval_s = REPORT_DEFAULT_MIN_INTERVAL_S,
+                .max_interval_s = REPORT_DEFAULT_MAX_INTERVAL_S,
+                .reportable_change = i == REPORT_CHANNEL_CONSUMPTION ? REPORT_DEFAULT_CONSUMPTION_CHANGE : REPORT_DEFAULT_HUMIDITY_CHANGE,
+            },
+        };
+    }
+}
+
+void reporting_set_policy(int channel, const report_policy_t *policy) {
+    channels[channel].policy = *policy;
+}
+
+const report_policy_t *reporting_get_policy(int channel) {
+    return &channels[channel].policy;
+}
+
+const report_counters_t *reporting_get_counters(int channel) {
+    return &channels[channel].counters;
+}
+
+static void report(report_channel_t *ch, int32_t value, int64_t now_us) {
+    ch->reported = true;
+    ch->pending = false;
+    ch->last_value = value;
+    ch->last_report_us = now_us;
+    ch->counters.sent++;
+}
+
+bool reporting_filter(int channel, int32_t value, int64_t now_us) {
+    report_channel_t *ch = &channels[channel];
+    int64_t elapsed_s = (now_us - ch->last_report_us) / 1000000;
+    bool changed = abs(value - ch->last_value) >= ch->policy.reportable_change && value != ch->last_value;
+    bool send;
+
+    if (!ch->reported) {
+        send = true;
+    } else if (ch->policy.max_interval_s && elapsed_s >= ch->policy.max_interval_s) {
+        send = true;
+    } else {
+        send = changed && elapsed_s >= ch->policy.min_interval_s;
+    }
+
+    if (send) {
+        report(ch, value, now_us);
+    } else {
+        // a later value that is back within reportable_change leaves nothing to send
+        ch->pending = changed;
+        ch->pending_value = value;
+        ch->counters.suppressed++;
+    }
+    return send;
+}
+
+int64_t reporting_pending_us(int channel) {
+    const report_channel_t *ch = &channels[channel];
+    return ch->pending ? ch->last_report_us + (int64_t)ch->policy.min_interval_s * 1000000 : 0;
+}
+
+bool reporting_take_pending(int channel, int64_t now_us, int32_t *value) {
+    report_channel_t *ch = &channels[channel];
+    if (!ch->pending || now_us < reporting_pending_us(channel)) {
+        return false;
+    }
+    *value = ch->pending_value;
+    report(ch, ch->pending_value, now_us);
+    return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver.h"
+
+// Firmware-side reporting policy: a value only reaches the ZCL attribute table (and so the radio) when it moved by
+// at least reportable_change since the last report and min_interval_s has passed, or when max_interval_s ran out.
+// A change that arrives within min_interval_s is kept, the latest one per channel, and goes out once it has passed.
+
+#define REPORT_CHANNEL_COUNT                (SENSOR_COUNT + 1)
+#define REPORT_CHANNEL_CONSUMPTION          SENSOR_COUNT    // humidity sensors use their sensor index
+
+#define REPORT_DEFAULT_MIN_INTERVAL_S       60
+#define REPORT_DEFAULT_MAX_INTERVAL_S       3600            // 0 disables periodic reports
+#define REPORT_DEFAULT_HUMIDITY_CHANGE      100             // 1/100 %
+#define REPORT_DEFAULT_CONSUMPTION_CHANGE   1
+
+typedef struct {
+    uint16_t min_interval_s;
+    uint16_t max_interval_s;
+    uint16_t reportable_change;
+} report_policy_t;
+
+typedef struct {
+    uint32_t sent;
+    uint32_t suppressed;
+} report_counters_t;
+
+void reporting_init(void);
+void reporting_set_policy(int channel, const report_policy_t *policy);
+const report_policy_t *reporting_get_policy(int channel);
+const report_counters_t *reporting_get_counters(int channel);
+
+// Returns true if the value should be reported now, updates the counters either way
+bool reporting_filter(int channel, int32_t value, int64_t now_us);
+// When the change held back by min_interval_s may be reported, 0 if none is pending
+int64_t reporting_pending_us(int channel);
+// True once the pending change is due, with its value; it then counts as reported
+bool reporting_take_pending(int channel, int64_t now_us, int32_t *value);
@@ -0,0 +1,49 @@
+#include "sample_queue.h"
+#include <stdatomic.h>
+
+#define SAMPLE_QUEUE_MASK (SAMPLE_QUEUE_LENGTH - 1)
+
+_Static_assert((SAMPLE_QUEUE_LENGTH & SAMPLE_QUEUE_MASK) == 0, "SAMPLE_QUEUE_LENGTH must be a power of two");
+
+static sample_t slots[SAMPLE_QUEUE_LENGTH];
+static atomic_uint head;    // next slot to read, owned by the consumer
+static atomic_uint tail;    // next slot to write, owned by the producer
+static sample_queue_stats_t stats;
+
+bool sample_queue_push(const sample_t *sample) {
+    unsigned t = atomic_load_explicit(&tail, memory_order_relaxed);
+    unsigned h = atomic_load_explicit(&head, memory_order_acquire);
+
+    if (t - h >= SAMPLE_QUEUE_LENGTH) {
+        stats.dropped++;
+        return false;
+    }
+    slots[t & SAMPLE_QUEUE_MASK] = *sample;
+    atomic_store_explicit(&tail, t + 1, memory_order_release);
+
+    stats.pushed++;
+    if (t + 1 - h > stats.max_depth) {
+        stats.max_depth = t + 1 - h;
+    }
+    return true;
+}
+
+bool sample_queue_pop(sample_t *sample) {
+    unsigned h = atomic_load_explicit(&head, memory_order_relaxed);
+    unsigned t = atomic_load_explicit(&tail, memory_order_acquire);
+
+    if (h == t) {
+        return false;
+    }
+    *sample = slots[h & SAMPLE_QUEUE_MASK];
+    atomic_store_explicit(&head, h + 1, memory_order_release);
+    return true;
+}
+
+uint32_t sample_queue_depth(void) {
+    return atomic_load_explicit(&tail, memory_order_acquire) - atomic_load_explicit(&head, memory_order_acquire);
+}
+
+const sample_queue_stats_t *sample_queue_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bounded single-producer/single-consumer ring between the measure task (producer) and the Zigbee task (consumer).
+// Neither side takes a lock; the producer drops new samples when the ring is full.
+
+#define SAMPLE_QUEUE_LENGTH 32      // power of two
+
+typedef enum {
+    SAMPLE_HUMIDITY,                // value in 1/100 %, -100 for an invalid reading, time is the measure task wakeup
+    SAMPLE_CONSUMPTION,             // value in total pump seconds since boot
+    SAMPLE_PUMP,                    // value in seconds the pump ran, time is when it stopped, channel is the zone
+    SAMPLE_DOSE_GAIN,               // learned dose gain of a sensor, value in 1/DOSE_GAIN_SCALE %/s
+    SAMPLE_FLOW_VOLUME,             // value in total metered ml, sent when the last pump stops
+    SAMPLE_FLOW_RATE,               // value in ml/h, once per run when the flow has settled and 0 when it ends
+    SAMPLE_FLOW_DRY,                // value 1 when a dry run stopped the pumps, 0 once a manual command cleared it
+    SAMPLE_SENSOR_FAULTS,           // health_fault_t flags of a sensor, sent when they change
+    SAMPLE_RELAY,                   // value 1 when a zone's pump started, 0 when it stopped or a command was refused
+    SAMPLE_PAUSE,                   // seconds from time_us a zone stays paused, 0 once it resumed
+} sample_kind_t;
+
+typedef struct {
+    int64_t time_us;
+    int32_t value;
+    uint8_t kind;
+    uint8_t channel;
+} sample_t;
+
+typedef struct {
+    uint32_t pushed;
+    uint32_t dropped;
+    uint32_t max_depth;
+} sample_queue_stats_t;
+
+bool sample_queue_push(const sample_t *sample);
+bool sample_queue_pop(sample_t *sample);
+uint32_t sample_queue_depth(void);
+// Counters are only written by the producer, readers may see slightly stale values
+const sample_queue_stats_t *sample_queue_stats(void);
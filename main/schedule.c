@@ -0,0 +1,121 @@
+#include "schedule.h"
+#include <math.h>
+#include <string.h>
+
+typedef struct {
+    // decayed sums of weight, t, h, t*t and t*h with t in hours relative to the last observation
+    float w, t, h, tt, th;
+    float last;
+    int64_t last_us;
+    uint16_t points;
+} dryout_fit_t;
+
+static dryout_fit_t fits[SENSOR_COUNT];
+static uint32_t min_interval_s = SCHEDULE_MIN_INTERVAL_S;
+static uint32_t max_interval_s = SCHEDULE_MAX_INTERVAL_S;
+static uint32_t default_interval_s = SCHEDULE_MAX_INTERVAL_S;
+static schedule_stats_t stats;
+
+void schedule_configure(uint32_t min_s, uint32_t max_s, uint32_t default_s) {
+    min_interval_s = min_s;
+    max_interval_s = max_s;
+    default_interval_s = default_s;
+}
+
+void schedule_observe(int channel, int64_t time_us, float humidity) {
+    if (channel < 0 || channel >= SENSOR_COUNT || humidity < 0) {
+        return;
+    }
+    dryout_fit_t *f = &fits[channel];
+    if (f->points && humidity > f->last + SCHEDULE_RISE_RESET) {
+        memset(f, 0, sizeof(*f));
+    }
+    if (f->points) {
+        // move the time origin to now, then age the old observations
+        float d = (time_us - f->last_us) / 3.6e9f;
+        float decay = expf(-d / SCHEDULE_MEMORY_H);
+        f->tt = (f->tt - 2 * d * f->t + d * d * f->w) * decay;
+        f->th = (f->th - d * f->h) * decay;
+        f->t = (f->t - d * f->w) * decay;
+        f->h *= decay;
+        f->w *= decay;
+    }
+    f->w += 1;
+    f->h += humidity;
+    f->last = humidity;
+    f->last_us = time_us;
+    if (f->points < UINT16_MAX) {
+        f->points++;
+    }
+}
+
+void schedule_reset(uint32_t channel_mask) {
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        if (channel_mask & (1u << i)) {
+            memset(&fits[i], 0, sizeof(fits[i]));
+        }
+    }
+}
+
+// Fitted humidity at the last observation and its slope in %/h
+static bool fit_line(const dryout_fit_t *f, float *now, float *slope) {
+    if (f->points < SCHEDULE_MIN_POINTS) {
+        return false;
+    }
+    float det = f->w * f->tt - f->t * f->t;
+    if (det <= 1e-6f) {
+        return false;
+    }
+    *slope = (f->w * f->th - f->t * f->h) / det;
+    *now = (f->h - *slope * f->t) / f->w;
+    return true;
+}
+
+bool schedule_rate(int channel, float *rate_per_h) {
+    float now;
+    return fit_line(&fits[channel], &now, rate_per_h);
+}
+
+uint32_t schedule_next_interval_s(const float *target_humidity) {
+    float next_s = max_interval_s;
+    bool fallback = false;
+
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        float now, slope;
+        if (target_humidity[i] < 0) {
+            continue;
+        }
+        if (!fit_line(&fits[i], &now, &slope)) {
+            fallback = true;
+            continue;
+        }
+        // a flat or rising fit (still soaking up water) is planned with the floor rate
+        float rate = -slope > SCHEDULE_MIN_DRY_RATE ? -slope : SCHEDULE_MIN_DRY_RATE;
+        float margin = now - target_humidity[i];
+        float s = margin > 0 ? SCHEDULE_HORIZON_FRACTION * margin / rate * 3600.0f : 0.0f;
+        if (s < next_s) {
+            next_s = s;
+        }
+    }
+    if (fallback && default_interval_s < next_s) {
+        next_s = default_interval_s;
+    }
+
+    if (next_s <= min_interval_s) {
+        stats.min_clamped++;
+        next_s = min_interval_s;
+    } else if (next_s >= max_interval_s) {
+        stats.max_clamped++;
+        next_s = max_interval_s;
+    }
+    if (fallback) {
+        stats.fallback++;
+    } else {
+        stats.adaptive++;
+    }
+    return (uint32_t)next_s;
+}
+
+const schedule_stats_t *schedule_stats(void) {
+    return &stats;
+}
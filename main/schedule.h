@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver.h"
+
+// Adaptive measurement scheduling. Each sensor keeps an exponentially weighted least-squares fit of humidity over
+// time (recursive least squares with a time-based forgetting factor), the next measurement is planned for a fraction
+// of the time the fitted drying rate needs to reach the target: rare while the soil is wet, dense near the threshold.
+
+#define SCHEDULE_MIN_INTERVAL_S         (10 * 60)
+#define SCHEDULE_MAX_INTERVAL_S         (3 * 3600)
+#define SCHEDULE_MEMORY_H               3.0f    // observations lose 1/e of their weight over this time
+#define SCHEDULE_MIN_POINTS             3       // fit is used after this many observations since the last reset
+#define SCHEDULE_RISE_RESET             1.0f    // %, a reading this much above the previous one restarts the fit
+#define SCHEDULE_MIN_DRY_RATE           1.0f    // %/h, floor for the fitted rate, covers the night to noon speed-up
+#define SCHEDULE_HORIZON_FRACTION       0.5f    // measure again after this part of the predicted time to the target
+
+typedef struct {
+    uint32_t adaptive;                  // intervals taken from the fit
+    uint32_t fallback;                  // fit not ready (start-up, after watering), default interval used
+    uint32_t min_clamped;
+    uint32_t max_clamped;
+} schedule_stats_t;
+
+// Bounds for the planned interval and the interval used while there is no usable fit, min == max gives a fixed interval
+void schedule_configure(uint32_t min_s, uint32_t max_s, uint32_t default_s);
+// humidity in %, negative (invalid reading) is ignored. Only the drying phase is fitted: a rising reading
+// (water still soaking in, rain, manual watering) starts the fit over.
+void schedule_observe(int channel, int64_t time_us, float humidity);
+// Forgets the fit of the channels in the mask, watering breaks their trend
+void schedule_reset(uint32_t channel_mask);
+// Seconds until the next measurement, targets in % per channel (the setpoint of its zone), negative to ignore a channel
+uint32_t schedule_next_interval_s(const float *target_humidity);
+// Fitted drying rate in %/h (negative while drying), false if the channel has no usable fit
+bool schedule_rate(int channel, float *rate_per_h);
+const schedule_stats_t *schedule_stats(void);
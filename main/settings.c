@@ -0,0 +1,163 @@
+#include "settings.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include "nvs.h"
+#include "esp_log.h"
+
+static const char *TAG = "SETTINGS";
+
+static void report_policy_key(int channel, char *key, size_t size) {
+    snprintf(key, size, "report%d", channel);
+}
+
+esp_err_t settings_load_report_policy(int channel, report_policy_t *policy) {
+    nvs_handle_t handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    size_t size = sizeof(*policy);
+
+    esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    report_policy_key(channel, key, sizeof(key));
+    ret = nvs_get_blob(handle, key, policy, &size);
+    nvs_close(handle);
+    if (ret == ESP_OK && size != sizeof(*policy)) {
+        ret = ESP_ERR_INVALID_SIZE;
+    }
+    return ret;
+}
+
+esp_err_t settings_save_report_policy(int channel, const report_policy_t *policy) {
+    nvs_handle_t handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+
+    esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    report_policy_key(channel, key, sizeof(key));
+    ret = nvs_set_blob(handle, key, policy, sizeof(*policy));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save reporting policy %d: %s", channel, esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+esp_err_t settings_load_dose_gain(int channel, int32_t *gain) {
+    nvs_handle_t handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+
+    esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    snprintf(key, sizeof(key), "dose%d", channel);
+    ret = nvs_get_i32(handle, key, gain);
+    nvs_close(handle);
+    return ret;
+}
+
+esp_err_t settings_save_dose_gain(int channel, int32_t gain) {
+    nvs_handle_t handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+
+    esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    snprintf(key, sizeof(key), "dose%d", channel);
+    ret = nvs_set_i32(handle, key, gain);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save dose gain %d: %s", channel, esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+esp_err_t settings_load_calibration(int channel, calibration_point_t *points, int *count) {
+    nvs_handle_t handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    size_t size = *count * sizeof(points[0]);
+
+    esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    snprintf(key, sizeof(key), "cal%d", channel);
+    ret = nvs_get_blob(handle, key, points, &size);
+    nvs_close(handle);
+    if (ret == ESP_OK && size % sizeof(points[0])) {
+        ret = ESP_ERR_INVALID_SIZE;
+    }
+    *count = ret == ESP_OK ? size / sizeof(points[0]) : 0;
+    return ret;
+}
+
+esp_err_t settings_save_calibration(int channel, const calibration_point_t *points, int count) {
+    nvs_handle_t handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+
+    esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    snprintf(key, sizeof(key), "cal%d", channel);
+    ret = nvs_set_blob(handle, key, points, count * sizeof(points[0]));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save calibration %d: %s", channel, esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+esp_err_t settings_load_control_state(control_state_t *state) {
+    nvs_handle_t handle;
+    size_t size = sizeof(*state);
+
+    esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    memset(state, 0, sizeof(*state));
+    ret = nvs_get_blob(handle, "control", state, &size);
+    nvs_close(handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (state->version == 1 && size == offsetof(control_state_t, volume_ml)) {
+        state->version = SETTINGS_CONTROL_VERSION;
+    } else if (size != sizeof(*state) || state->version != SETTINGS_CONTROL_VERSION) {
+        ret = ESP_ERR_INVALID_VERSION;
+    }
+    return ret;
+}
+
+esp_err_t settings_save_control_state(const control_state_t *state) {
+    nvs_handle_t handle;
+
+    esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_set_blob(handle, "control", state, sizeof(*state));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save control state: %s", esp_err_to_name(ret));
+    }
+    return ret;
+}
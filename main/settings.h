@@ -0,0 +1,31 @@
+#pragma once
+
+#include "esp_err.h"
+#include "reporting.h"
+#include "conversion.h"
+#include "zones.h"
+
+// Persistent device settings in the default NVS partition
+
+#define SETTINGS_NAMESPACE "waterer"
+#define SETTINGS_CONTROL_VERSION        2       // 2 added volume_ml, version 1 blobs load with it zero
+#define SETTINGS_COMMIT_DELAY_S         60      // control state changes within this window go to flash as one write
+
+// What watering needs to carry on after a reboot without the coordinator
+typedef struct {
+    uint8_t version;
+    int32_t target[ZONE_MAX];       // 1/100 %
+    uint32_t pump_total_s;
+    uint32_t volume_ml;             // flow meter total
+} control_state_t;
+
+esp_err_t settings_load_report_policy(int channel, report_policy_t *policy);
+esp_err_t settings_save_report_policy(int channel, const report_policy_t *policy);
+// Sensor calibration points of a channel, *count is the capacity on entry and the number loaded on return
+esp_err_t settings_load_calibration(int channel, calibration_point_t *points, int *count);
+esp_err_t settings_save_calibration(int channel, const calibration_point_t *points, int count);
+// Learned dose gain of a sensor in 1/DOSE_GAIN_SCALE %/s
+esp_err_t settings_load_dose_gain(int channel, int32_t *gain);
+esp_err_t settings_save_dose_gain(int channel, int32_t gain);
+esp_err_t settings_load_control_state(control_state_t *state);
+esp_err_t settings_save_control_state(const control_state_t *state);
@@ -0,0 +1,28 @@
+#pragma once
+
+// Task stacks and priorities. A task keeps a conservative stack until it has been profiled on the device: the
+// diagnostics cluster (metrics_cluster.h, attributes 0x0010 / 0x0020 / 0x0040) reports the free part, then size the
+// stack to the measured peak plus TASK_STACK_MARGIN and re-profile after changes. Host figures leave out the IDF
+// driver frames and newlib, they are no substitute.
+// With HAL_STATIC_ALLOCATION (hal.h) the stacks are carved out of one static arena of TASK_STACK_ARENA bytes.
+
+#define TASK_STACK_MARGIN               1024
+
+// Not profiled on the device yet, kept at its original size. On the host the driver path peaks at 4088 bytes over a
+// simulated year (waterer_sim, "measure task stack"), without the IDF ADC, PCNT and esp_timer driver frames.
+// Log messages are formatted on Log_main (dlog.h).
+#define MEASURE_TASK_STACK_SIZE         8192
+#define MEASURE_TASK_PRIORITY           10
+
+// Not profiled on the device yet. Twice the esp-zigbee-sdk examples' 4096: besides the Zigbee stack it runs the
+// history flash writes and erases, NVS commits, and the OTA heatshrink decoding and esp_ota_write.
+#define ZIGBEE_TASK_STACK_SIZE          8192
+#define ZIGBEE_TASK_PRIORITY            5
+
+// Not profiled on the device yet. On the host the log drain peaks at 3592 bytes (waterer_bench, "log_drain"), in the
+// float snprintf; newlib's printf and esp_log_write are not in that figure.
+#define LOG_TASK_STACK_SIZE             6144
+#define LOG_TASK_PRIORITY               1       // just above idle, printing waits for everything else
+
+#define TASK_COUNT                      3
+#define TASK_STACK_ARENA                (MEASURE_TASK_STACK_SIZE + ZIGBEE_TASK_STACK_SIZE + LOG_TASK_STACK_SIZE)
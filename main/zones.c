@@ -0,0 +1,102 @@
+#include "zones.h"
+#include "conversion.h"
+#include "esp_log.h"
+
+static const char *TAG = "ZONES";
+
+// Endpoints 1 (relay), 10/20 (sensors) and 50 (target) are the ones the single-pump firmware used, so existing
+// bindings keep working.
+const sensor_config_t sensor_config[] = {
+    { .adc_channel = ADC1_GPIO1_CHANNEL, .endpoint = 10 },
+    { .adc_channel = ADC1_GPIO2_CHANNEL, .endpoint = 20 },
+};
+_Static_assert(sizeof(sensor_config) / sizeof(sensor_config[0]) == SENSOR_COUNT, "one sensor_config entry per sensor");
+
+static const zone_config_t default_zones[] = {
+    {
+        .relay_pin = RELAY_PIN,
+        .sensor_mask = (1u << SENSOR_COUNT) - 1,
+        .aggregation = ZONE_AGGREGATE_MIN,
+        .cooldown_s = RELAY_MIN_TIME_BETWEEN_CYCLES_M * 60,
+        .setpoint_endpoint = 50,
+        .relay_endpoint = 1,
+    },
+    // further pumps follow the same pattern, e.g.
+    // { .relay_pin = GPIO_NUM_5, .sensor_mask = 1u << 2, .aggregation = ZONE_AGGREGATE_MEAN, .cooldown_s = 180,
+    //   .setpoint_endpoint = 51, .relay_endpoint = 2 },
+};
+
+static const zone_config_t *zones = default_zones;
+static int zone_count = sizeof(default_zones) / sizeof(default_zones[0]);
+static int pump_budget = ZONE_DEFAULT_PUMP_BUDGET;
+
+esp_err_t zones_configure(const zone_config_t *table, int count) {
+    if (!table || count < 1 || count > ZONE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint32_t used = 0;
+    for (int i = 0; i < count; i++) {
+        if (table[i].sensor_mask & used || table[i].sensor_mask >> SENSOR_COUNT) {
+            ESP_LOGW(TAG, "Zone %d: sensors 0x%lx overlap another zone or do not exist", i, (unsigned long)table[i].sensor_mask);
+            return ESP_ERR_INVALID_ARG;
+        }
+        used |= table[i].sensor_mask;
+    }
+    zones = table;
+    zone_count = count;
+    return ESP_OK;
+}
+
+int zones_count(void) {
+    return zone_count;
+}
+
+const zone_config_t *zones_get(int zone) {
+    return &zones[zone];
+}
+
+int zones_of_sensor(int sensor) {
+    for (int i = 0; i < zone_count; i++) {
+        if (zones[i].sensor_mask & (1u << sensor)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int16_t zones_aggregate(int zone, const int16_t *humidity) {
+    const zone_config_t *z = &zones[zone];
+    int32_t sum = 0;
+    int valid = 0;
+    int16_t lowest = INT16_MAX;
+    int16_t highest = INT16_MIN;
+    for (int i = 0; i < SENSOR_COUNT; i++) {
+        if (!(z->sensor_mask & (1u << i)) || humidity[i] == CONVERSION_INVALID) {
+            continue;
+        }
+        sum += humidity[i];
+        valid++;
+        if (humidity[i] < lowest) { lowest = humidity[i]; }
+        if (humidity[i] > highest) { highest = humidity[i]; }
+    }
+    if (!valid) {
+        return CONVERSION_INVALID;
+    }
+    switch (z->aggregation) {
+    case ZONE_AGGREGATE_MEAN:
+        return (int16_t)(sum / valid);
+    case ZONE_AGGREGATE_MAX:
+        return highest;
+    case ZONE_AGGREGATE_MIN:
+    default:
+        return lowest;
+    }
+}
+
+void zones_set_pump_budget(int pumps) {
+    pump_budget = pumps < 1 ? 1 : pumps;
+}
+
+int zones_pump_budget(void) {
+    return pump_budget;
+}
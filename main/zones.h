@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "driver.h"
+
+// Board layout. sensor_config says which ADC channel every sensor sits on, the zone table which sensors every relay
+// waters and how their readings are combined. The driver runs one dose per zone, the application creates the
+// sensor, setpoint and relay endpoints from the same tables.
+//
+// All sensors are sampled in one continuous conversion burst no matter how many zones use them, so a measurement
+// takes about as long with eight zones as with one.
+
+#define ZONE_MAX                    8
+#define ZONE_DEFAULT_PUMP_BUDGET    1       // relays on at the same time, the supply is sized for a single pump
+
+typedef enum {
+    ZONE_AGGREGATE_MIN,     // driest sensor decides, nothing in the zone gets too dry
+    ZONE_AGGREGATE_MEAN,    // one stray sensor does not water the whole zone
+    ZONE_AGGREGATE_MAX,     // only water once every sensor is dry
+} zone_aggregation_t;
+
+typedef struct {
+    int adc_channel;
+    uint8_t endpoint;
+} sensor_config_t;
+
+typedef struct {
+    gpio_num_t relay_pin;           // active low
+    uint32_t sensor_mask;           // a sensor belongs to one zone at most
+    zone_aggregation_t aggregation;
+    uint16_t cooldown_s;            // minimum time from the end of a watering to the start of the next
+    uint8_t setpoint_endpoint;
+    uint8_t relay_endpoint;         // 0 - relay not exposed for manual control
+} zone_config_t;
+
+extern const sensor_config_t sensor_config[SENSOR_COUNT];
+
+// Replaces the built-in zone table, must be called before init_driver_immediate. The table is not copied.
+esp_err_t zones_configure(const zone_config_t *zones, int count);
+int zones_count(void);
+const zone_config_t *zones_get(int zone);
+// Zone watering the sensor, -1 if none
+int zones_of_sensor(int sensor);
+// Combines the valid readings (1/100 %) of the zone's sensors, CONVERSION_INVALID if none of them is valid
+int16_t zones_aggregate(int zone, const int16_t *humidity);
+
+void zones_set_pump_budget(int pumps);
+int zones_pump_budget(void);